@@ -21,9 +21,22 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// whisper_quantize_file
+bool whisper_quantize_file(std::string model, std::string file, int ftype);
+RcppExport SEXP _audio_whisper_whisper_quantize_file(SEXP modelSEXP, SEXP fileSEXP, SEXP ftypeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< std::string >::type file(fileSEXP);
+    Rcpp::traits::input_parameter< int >::type ftype(ftypeSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_quantize_file(model, file, ftype));
+    return rcpp_result_gen;
+END_RCPP
+}
 // whisper_encode
-Rcpp::List whisper_encode(SEXP model, std::string path, std::string language, bool token_timestamps, bool translate, bool print_special, int duration, int offset, bool trace, int n_threads, int n_processors);
-RcppExport SEXP _audio_whisper_whisper_encode(SEXP modelSEXP, SEXP pathSEXP, SEXP languageSEXP, SEXP token_timestampsSEXP, SEXP translateSEXP, SEXP print_specialSEXP, SEXP durationSEXP, SEXP offsetSEXP, SEXP traceSEXP, SEXP n_threadsSEXP, SEXP n_processorsSEXP) {
+Rcpp::List whisper_encode(SEXP model, std::string path, std::string language, bool token_timestamps, bool translate, bool print_special, int duration, int offset, bool trace, int n_threads, int n_processors, int beam_width, bool vad, int spin_us);
+RcppExport SEXP _audio_whisper_whisper_encode(SEXP modelSEXP, SEXP pathSEXP, SEXP languageSEXP, SEXP token_timestampsSEXP, SEXP translateSEXP, SEXP print_specialSEXP, SEXP durationSEXP, SEXP offsetSEXP, SEXP traceSEXP, SEXP n_threadsSEXP, SEXP n_processorsSEXP, SEXP beam_widthSEXP, SEXP vadSEXP, SEXP spin_usSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -38,14 +51,87 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< bool >::type trace(traceSEXP);
     Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
     Rcpp::traits::input_parameter< int >::type n_processors(n_processorsSEXP);
-    rcpp_result_gen = Rcpp::wrap(whisper_encode(model, path, language, token_timestamps, translate, print_special, duration, offset, trace, n_threads, n_processors));
+    Rcpp::traits::input_parameter< int >::type beam_width(beam_widthSEXP);
+    Rcpp::traits::input_parameter< bool >::type vad(vadSEXP);
+    Rcpp::traits::input_parameter< int >::type spin_us(spin_usSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_encode(model, path, language, token_timestamps, translate, print_special, duration, offset, trace, n_threads, n_processors, beam_width, vad, spin_us));
+    return rcpp_result_gen;
+END_RCPP
+}
+// whisper_encode_batch
+Rcpp::List whisper_encode_batch(SEXP model, std::vector<std::string> path, std::string language, bool token_timestamps, bool translate, bool print_special, int duration, int offset, bool trace, int n_threads, int n_processors, int beam_width, bool vad, int spin_us);
+RcppExport SEXP _audio_whisper_whisper_encode_batch(SEXP modelSEXP, SEXP pathSEXP, SEXP languageSEXP, SEXP token_timestampsSEXP, SEXP translateSEXP, SEXP print_specialSEXP, SEXP durationSEXP, SEXP offsetSEXP, SEXP traceSEXP, SEXP n_threadsSEXP, SEXP n_processorsSEXP, SEXP beam_widthSEXP, SEXP vadSEXP, SEXP spin_usSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< std::string >::type language(languageSEXP);
+    Rcpp::traits::input_parameter< bool >::type token_timestamps(token_timestampsSEXP);
+    Rcpp::traits::input_parameter< bool >::type translate(translateSEXP);
+    Rcpp::traits::input_parameter< bool >::type print_special(print_specialSEXP);
+    Rcpp::traits::input_parameter< int >::type duration(durationSEXP);
+    Rcpp::traits::input_parameter< int >::type offset(offsetSEXP);
+    Rcpp::traits::input_parameter< bool >::type trace(traceSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    Rcpp::traits::input_parameter< int >::type n_processors(n_processorsSEXP);
+    Rcpp::traits::input_parameter< int >::type beam_width(beam_widthSEXP);
+    Rcpp::traits::input_parameter< bool >::type vad(vadSEXP);
+    Rcpp::traits::input_parameter< int >::type spin_us(spin_usSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_encode_batch(model, path, language, token_timestamps, translate, print_special, duration, offset, trace, n_threads, n_processors, beam_width, vad, spin_us));
+    return rcpp_result_gen;
+END_RCPP
+}
+// whisper_stream_init_model
+SEXP whisper_stream_init_model(SEXP model, std::string language, bool translate, int step, int length, int keep, bool keep_context, int n_threads);
+RcppExport SEXP _audio_whisper_whisper_stream_init_model(SEXP modelSEXP, SEXP languageSEXP, SEXP translateSEXP, SEXP stepSEXP, SEXP lengthSEXP, SEXP keepSEXP, SEXP keep_contextSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type model(modelSEXP);
+    Rcpp::traits::input_parameter< std::string >::type language(languageSEXP);
+    Rcpp::traits::input_parameter< bool >::type translate(translateSEXP);
+    Rcpp::traits::input_parameter< int >::type step(stepSEXP);
+    Rcpp::traits::input_parameter< int >::type length(lengthSEXP);
+    Rcpp::traits::input_parameter< int >::type keep(keepSEXP);
+    Rcpp::traits::input_parameter< bool >::type keep_context(keep_contextSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_stream_init_model(model, language, translate, step, length, keep, keep_context, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// whisper_stream_push_audio
+Rcpp::List whisper_stream_push_audio(SEXP stream, std::vector<float> x);
+RcppExport SEXP _audio_whisper_whisper_stream_push_audio(SEXP streamSEXP, SEXP xSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type stream(streamSEXP);
+    Rcpp::traits::input_parameter< std::vector<float> >::type x(xSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_stream_push_audio(stream, x));
+    return rcpp_result_gen;
+END_RCPP
+}
+// whisper_stream_finish_audio
+Rcpp::List whisper_stream_finish_audio(SEXP stream);
+RcppExport SEXP _audio_whisper_whisper_stream_finish_audio(SEXP streamSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type stream(streamSEXP);
+    rcpp_result_gen = Rcpp::wrap(whisper_stream_finish_audio(stream));
     return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
     {"_audio_whisper_whisper_load_model", (DL_FUNC) &_audio_whisper_whisper_load_model, 1},
-    {"_audio_whisper_whisper_encode", (DL_FUNC) &_audio_whisper_whisper_encode, 11},
+    {"_audio_whisper_whisper_quantize_file", (DL_FUNC) &_audio_whisper_whisper_quantize_file, 3},
+    {"_audio_whisper_whisper_encode", (DL_FUNC) &_audio_whisper_whisper_encode, 14},
+    {"_audio_whisper_whisper_encode_batch", (DL_FUNC) &_audio_whisper_whisper_encode_batch, 14},
+    {"_audio_whisper_whisper_stream_init_model", (DL_FUNC) &_audio_whisper_whisper_stream_init_model, 8},
+    {"_audio_whisper_whisper_stream_push_audio", (DL_FUNC) &_audio_whisper_whisper_stream_push_audio, 2},
+    {"_audio_whisper_whisper_stream_finish_audio", (DL_FUNC) &_audio_whisper_whisper_stream_finish_audio, 1},
     {NULL, NULL, 0}
 };
 
@@ -5,14 +5,30 @@
 // use your favorite implementations
 #define DR_WAV_IMPLEMENTATION
 #include "dr_wav.h"
+#define DR_FLAC_IMPLEMENTATION
+#include "dr_flac.h"
+#define DR_MP3_IMPLEMENTATION
+#include "dr_mp3.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <limits>
 #include <cstdio>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // Terminal color map. 10 colors grouped in ranges [0.0, 0.1, ..., 0.9]
 // Lowest is red, middle is yellow, highest is green.
 const std::vector<std::string> k_colors = {
@@ -55,15 +71,18 @@ void replace_all(std::string & s, const std::string & search, const std::string
 struct whisper_params {
     int32_t n_threads    = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors = 1;
+    int32_t beam_width   = 1;
     int32_t offset_t_ms  = 0;
     int32_t offset_n     = 0;
     int32_t duration_ms  = 0;
     int32_t max_context  = -1;
     int32_t max_len      = 0;
+    int32_t spin_us      = 200;
     
     float word_thold = 0.01f;
     
     bool speed_up      = false;
+    bool vad           = false;
     bool translate     = false;
     bool diarize       = false;
     bool output_txt    = false;
@@ -87,11 +106,11 @@ struct whisper_print_user_data {
     const std::vector<std::vector<float>> * pcmf32s;
 };
 
-void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
     
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     
     // print the last n_new segments
     const int s0 = n_segments - n_new;
@@ -102,30 +121,30 @@ void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, voi
     for (int i = s0; i < n_segments; i++) {
         if (params.no_timestamps) {
             if (params.print_colors) {
-                for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                     if (params.print_special == false) {
-                        const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                        const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                         if (id >= whisper_token_eot(ctx)) {
                             continue;
                         }
                     }
                     
-                    const char * text = whisper_full_get_token_text(ctx, i, j);
-                    const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                    const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                    const float  p    = whisper_full_get_token_p_from_state(state, i, j);
                     
                     const int col = std::max(0, std::min((int) k_colors.size(), (int) (std::pow(p, 3)*float(k_colors.size()))));
                     
                     Rprintf("%s%s%s", k_colors[col].c_str(), text, "\033[0m");
                 }
             } else {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
                 Rprintf("%s", text);
             }
             Rcpp::checkUserInterrupt();
             //fflush(stdout);
         } else {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             
             std::string speaker = "";
             
@@ -156,16 +175,16 @@ void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, voi
             
             if (params.print_colors) {
                 Rprintf("[%s --> %s]  ", to_timestamp(t0).c_str(), to_timestamp(t1).c_str());
-                for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+                for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                     if (params.print_special == false) {
-                        const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                        const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                         if (id >= whisper_token_eot(ctx)) {
                             continue;
                         }
                     }
                     
-                    const char * text = whisper_full_get_token_text(ctx, i, j);
-                    const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                    const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                    const float  p    = whisper_full_get_token_p_from_state(state, i, j);
                     
                     const int col = std::max(0, std::min((int) k_colors.size(), (int) (std::pow(p, 3)*float(k_colors.size()))));
                     
@@ -173,7 +192,7 @@ void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, voi
                 }
                 Rprintf("\n");
             } else {
-                const char * text = whisper_full_get_segment_text(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(state, i);
                 
                 Rprintf("[%s --> %s]  %s%s\n", to_timestamp(t0).c_str(), to_timestamp(t1).c_str(), speaker.c_str(), text);
             }
@@ -182,33 +201,729 @@ void whisper_print_segment_callback(struct whisper_context * ctx, int n_new, voi
 }
 
 
+// An audio file decoded by dr_wav, dr_flac or dr_mp3, the PCM frames are read in blocks of interleaved float samples
+struct whisper_audio_file {
+    enum format_t { NONE, WAV, FLAC, MP3 };
+    
+    format_t format = NONE;
+    drwav wav;
+    drflac * flac = NULL;
+    drmp3 mp3;
+    
+    uint32_t channels = 0;
+    uint32_t sample_rate = 0;
+    uint64_t n_frames = 0; // 0 if unknown
+    bool     pcm16 = false; // the decoder gives 16-bit samples without a loss, read_s16 avoids its conversion to float
+    
+    // WAV of any bit depth (integer, float, A-law, mu-law), FLAC or MP3, tried in that order
+    bool open(const std::string & fname) {
+        close();
+        if (drwav_init_file(&wav, fname.c_str(), NULL)) {
+            format      = WAV;
+            channels    = wav.channels;
+            sample_rate = wav.sampleRate;
+            n_frames    = wav.totalPCMFrameCount;
+            pcm16       = wav.translatedFormatTag == DR_WAVE_FORMAT_PCM && wav.bitsPerSample == 16;
+            return true;
+        }
+        flac = drflac_open_file(fname.c_str(), NULL);
+        if (flac != NULL) {
+            format      = FLAC;
+            channels    = flac->channels;
+            sample_rate = flac->sampleRate;
+            n_frames    = flac->totalPCMFrameCount;
+            pcm16       = flac->bitsPerSample <= 16;
+            return true;
+        }
+        if (drmp3_init_file(&mp3, fname.c_str(), NULL)) {
+            format      = MP3;
+            channels    = mp3.channels;
+            sample_rate = mp3.sampleRate;
+            // only parses the frame headers, such that the buffers can be allocated once
+            n_frames    = drmp3_get_pcm_frame_count(&mp3);
+#ifndef DR_MP3_FLOAT_OUTPUT
+            pcm16       = true;
+#endif
+            return true;
+        }
+        return false;
+    }
+    
+    // returns the number of frames written to out, 0 at the end of the file
+    uint64_t read(uint64_t n, float * out) {
+        switch (format) {
+            case WAV:  return drwav_read_pcm_frames_f32(&wav, n, out);
+            case FLAC: return drflac_read_pcm_frames_f32(flac, n, out);
+            case MP3:  return drmp3_read_pcm_frames_f32(&mp3, n, out);
+            default:   return 0;
+        }
+    }
+    
+    uint64_t read_s16(uint64_t n, int16_t * out) {
+        switch (format) {
+            case WAV:  return drwav_read_pcm_frames_s16(&wav, n, out);
+            case FLAC: return drflac_read_pcm_frames_s16(flac, n, out);
+            case MP3:  return drmp3_read_pcm_frames_s16(&mp3, n, out);
+            default:   return 0;
+        }
+    }
+    
+    void close() {
+        switch (format) {
+            case WAV:  drwav_uninit(&wav);    break;
+            case FLAC: drflac_close(flac);    break;
+            case MP3:  drmp3_uninit(&mp3);    break;
+            default:   break;
+        }
+        format = NONE;
+        flac   = NULL;
+    }
+    
+    ~whisper_audio_file() {
+        close();
+    }
+};
+
+// Streaming polyphase resampler with a Kaiser windowed-sinc low-pass filter
+// For the ratio up/down of the output and input sample rate, output sample j is the filtered input at time j*down/up.
+// The filter is tabulated for n_phase fractional input positions, such that each output sample is the dot product
+// of n_taps contiguous input samples and 1 contiguous row of coefficients.
+// If up is too large to tabulate every phase, the output is interpolated between the 2 nearest rows.
+struct whisper_resampler {
+    int64_t up   = 1;
+    int64_t down = 1;
+    
+    int half    = 0; // the filter spans the input samples i - half + 1, ..., i + half around output time i + frac
+    int n_taps  = 0; // 2*half rounded up to a multiple of 4, the extra taps are 0
+    int n_phase = 0;
+    std::vector<float> coef; // [n_phase + 1][n_taps]
+    
+    std::vector<float> buf;  // input which is still needed, buf[0] is input sample buf_start
+    int64_t buf_start = 0;
+    int64_t n_in  = 0;
+    int64_t n_out = 0;
+    
+    static double bessel_i0(double x) {
+        double sum  = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 100; k++) {
+            term *= (x/(2.0*k))*(x/(2.0*k));
+            sum  += term;
+            if (term < 1e-12*sum) {
+                break;
+            }
+        }
+        return sum;
+    }
+    
+    void init(int sample_rate_in, int sample_rate_out) {
+        int64_t a = sample_rate_in;
+        int64_t b = sample_rate_out;
+        while (b != 0) {
+            const int64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        up   = sample_rate_out/a;
+        down = sample_rate_in/a;
+        
+        // cutoff relative to the input Nyquist frequency, just below the lower of the 2 Nyquist frequencies
+        const int    n_zero  = 32;  // zero crossings of the sinc on each side
+        const double rolloff = 0.95;
+        const double beta    = 8.6; // about 90 dB stopband attenuation
+        const double cutoff  = rolloff*std::min(1.0, double(up)/double(down));
+        
+        half    = (int) std::ceil(n_zero/cutoff);
+        n_taps  = (2*half + 3)/4*4;
+        n_phase = (int) std::min<int64_t>(up, 512);
+        
+        coef.assign((size_t) (n_phase + 1)*n_taps, 0.0f);
+        std::vector<double> row(2*half);
+        for (int p = 0; p <= n_phase; p++) {
+            const double frac = double(p)/n_phase;
+            double sum = 0.0;
+            for (int k = 0; k < 2*half; k++) {
+                const double t = (k - half + 1) - frac;
+                const double x = t/half;
+                const double arg = M_PI*cutoff*t;
+                const double sinc = std::fabs(arg) < 1e-9 ? 1.0 : std::sin(arg)/arg;
+                row[k] = std::fabs(x) < 1.0 ? sinc*bessel_i0(beta*std::sqrt(1.0 - x*x)) : 0.0;
+                sum += row[k];
+            }
+            // unit gain at DC for every phase
+            for (int k = 0; k < 2*half; k++) {
+                coef[(size_t) p*n_taps + k] = float(row[k]/sum);
+            }
+        }
+        
+        reset();
+    }
+    
+    // start a new input, the input before the first sample is silence
+    void reset() {
+        buf.assign(half - 1, 0.0f);
+        buf_start = -(half - 1);
+        n_in  = 0;
+        n_out = 0;
+    }
+    
+    static float dot(const float * x, const float * c, int n) {
+        // 4 independent sums such that the loop vectorizes without reassociating floating point additions
+        float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+        for (int k = 0; k < n; k += 4) {
+            s0 += x[k + 0]*c[k + 0];
+            s1 += x[k + 1]*c[k + 1];
+            s2 += x[k + 2]*c[k + 2];
+            s3 += x[k + 3]*c[k + 3];
+        }
+        return (s0 + s1) + (s2 + s3);
+    }
+    
+    // append the output samples, up to n_out_max, whose taps are all in the buffer
+    void run(std::vector<float> & out, int64_t n_out_max) {
+        const int64_t buf_end = buf_start + (int64_t) buf.size();
+        while (n_out < n_out_max) {
+            const int64_t pos = n_out*down;
+            const int64_t i   = pos/up;
+            if (i - half + 1 + n_taps > buf_end) {
+                break;
+            }
+            const float * x = buf.data() + (i - half + 1 - buf_start);
+            const int64_t p = pos % up;
+            float y;
+            if (n_phase == up) {
+                y = dot(x, coef.data() + p*n_taps, n_taps);
+            } else {
+                const double  f  = double(p)*n_phase/double(up);
+                const int64_t p0 = (int64_t) f;
+                const float   w  = float(f - p0);
+                y = dot(x, coef.data() + p0*n_taps, n_taps);
+                if (w > 0.0f) {
+                    y += w*(dot(x, coef.data() + (p0 + 1)*n_taps, n_taps) - y);
+                }
+            }
+            out.push_back(y);
+            n_out++;
+        }
+        
+        // drop the input before the first tap of the next output sample
+        const int64_t n_drop = std::min(n_out*down/up - half + 1 - buf_start, (int64_t) buf.size());
+        if (n_drop > 0) {
+            buf.erase(buf.begin(), buf.begin() + n_drop);
+            buf_start += n_drop;
+        }
+    }
+    
+    void push(const float * x, int64_t n, std::vector<float> & out) {
+        buf.insert(buf.end(), x, x + n);
+        n_in += n;
+        run(out, std::numeric_limits<int64_t>::max());
+    }
+    
+    // the input after the last sample is silence, the output has ceil(n_in*up/down) samples
+    void finish(std::vector<float> & out) {
+        buf.insert(buf.end(), n_taps, 0.0f);
+        run(out, (n_in*up + down - 1)/down);
+    }
+};
+
+// Mix n interleaved frames to mono, the average of the channels, and for stereo audio also split the channels
+// into left and right if these are not NULL, in 1 pass over the frames
+static void whisper_pcm_mix_s16(const int16_t * src, uint64_t n, uint32_t n_channels, float * mono, float * left, float * right) {
+    const float scale = 1.0f/32768.0f;
+    uint64_t i = 0;
+    if (n_channels == 1) {
+#if defined(__SSE2__)
+        const __m128 vscale = _mm_set1_ps(scale);
+        for (; i + 8 <= n; i += 8) {
+            const __m128i v  = _mm_loadu_si128((const __m128i *) (src + i));
+            const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+            _mm_storeu_ps(mono + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+            _mm_storeu_ps(mono + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+        }
+#endif
+        for (; i < n; i++) {
+            mono[i] = float(src[i])*scale;
+        }
+    } else if (n_channels == 2) {
+        // the sum of 2 16-bit samples is exact in float, so the mix equals the average of the converted channels
+#if defined(__SSE2__)
+        const __m128 vscale = _mm_set1_ps(scale);
+        const __m128 vhalf  = _mm_set1_ps(0.5f*scale);
+        for (; i + 4 <= n; i += 4) {
+            const __m128i v = _mm_loadu_si128((const __m128i *) (src + 2*i));
+            const __m128i l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+            const __m128i r = _mm_srai_epi32(v, 16);
+            _mm_storeu_ps(mono + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(l, r)), vhalf));
+            if (left != NULL) {
+                _mm_storeu_ps(left  + i, _mm_mul_ps(_mm_cvtepi32_ps(l), vscale));
+                _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), vscale));
+            }
+        }
+#endif
+        for (; i < n; i++) {
+            mono[i] = float(int32_t(src[2*i]) + int32_t(src[2*i + 1]))*(0.5f*scale);
+            if (left != NULL) {
+                left[i]  = float(src[2*i])*scale;
+                right[i] = float(src[2*i + 1])*scale;
+            }
+        }
+    } else {
+        const float scale_mix = scale/n_channels;
+        for (; i < n; i++) {
+            int32_t sum = 0;
+            for (uint32_t c = 0; c < n_channels; c++) {
+                sum += src[i*n_channels + c];
+            }
+            mono[i] = float(sum)*scale_mix;
+        }
+    }
+}
+
+static void whisper_pcm_mix_f32(const float * src, uint64_t n, uint32_t n_channels, float * mono, float * left, float * right) {
+    if (n_channels == 1) {
+        std::copy(src, src + n, mono);
+    } else if (n_channels == 2) {
+        for (uint64_t i = 0; i < n; i++) {
+            mono[i] = (src[2*i] + src[2*i + 1])*0.5f;
+            if (left != NULL) {
+                left[i]  = src[2*i];
+                right[i] = src[2*i + 1];
+            }
+        }
+    } else {
+        const float scale = 1.0f/n_channels;
+        for (uint64_t i = 0; i < n; i++) {
+            float sum = 0.0f;
+            for (uint32_t c = 0; c < n_channels; c++) {
+                sum += src[i*n_channels + c];
+            }
+            mono[i] = sum*scale;
+        }
+    }
+}
+
+// Reads a WAV, FLAC or MP3 file block by block as 16 kHz mono float PCM and, for diarization, as 2 float channels
+// Each block of frames is mixed, and resampled if needed, directly into the float buffers, without a copy of the whole
+// file in its own sample format or sample rate.
+// R is not called such that the file can be read in a worker thread
+struct whisper_audio_reader {
+    std::string fname;
+    whisper_audio_file audio;
+    
+    uint32_t n_channels = 0;
+    bool stereo   = false; // the 2 channels are read as well
+    bool resample = false;
+    whisper_resampler resampler[3];
+    
+    static const uint64_t n_block = 4096;
+    std::vector<int16_t> block16;
+    std::vector<float>   block;
+    std::vector<float>   tmp[3];
+    
+    int64_t n_read       = 0; // frames read from the file since it was opened or rewound
+    int64_t n_read_total = 0; // frames read from the file, by all passes
+    bool finished = false;
+    
+    // the samples of the last block which are not yet taken by read_callback()
+    std::vector<float> pending;
+    size_t pending_pos = 0;
+    
+    // returns the error message or an empty string
+    std::string open(const std::string & fname_inp, const whisper_params & params) {
+        fname = fname_inp;
+        
+        if (!audio.open(fname)) {
+            return "Failed to open the file as WAV, FLAC or MP3 file: " + fname;
+        }
+        
+        if (audio.channels < 1) {
+            return "Audio file has no channels: " + fname;
+        }
+        
+        if (params.diarize && audio.channels != 2 && params.no_timestamps == false) {
+            return "Audio file must be stereo for diarization and timestamps have to be enabled: " + fname;
+        }
+        
+        if (audio.sample_rate < 1000 || audio.sample_rate > 384000) {
+            return "Audio file has an unsupported sample rate of " + std::to_string(audio.sample_rate) + " Hz: " + fname;
+        }
+        
+        n_channels = audio.channels;
+        stereo     = params.diarize && n_channels == 2;
+        if (audio.pcm16) {
+            block16.resize(n_block*n_channels);
+        } else {
+            block.resize(n_block*n_channels);
+        }
+        
+        // other sample rates are converted to 16 kHz while decoding, block by block
+        resample = audio.sample_rate != WHISPER_SAMPLE_RATE;
+        if (resample) {
+            resampler[0].init(audio.sample_rate, WHISPER_SAMPLE_RATE);
+            tmp[0].resize(n_block);
+            if (stereo) {
+                for (int c = 1; c < 3; c++) {
+                    resampler[c] = resampler[0];
+                    tmp[c].resize(n_block);
+                }
+            }
+        }
+        
+        return "";
+    }
+    
+    // the number of 16 kHz samples of the file, 0 if unknown
+    uint64_t n_samples() const {
+        if (!resample) {
+            return audio.n_frames;
+        }
+        return (audio.n_frames*WHISPER_SAMPLE_RATE + audio.sample_rate - 1)/audio.sample_rate;
+    }
+    
+    // decode the next block of the file and append its samples, returns false at the end of the file
+    bool read(std::vector<float> & mono, std::vector<float> * left, std::vector<float> * right) {
+        if (finished) {
+            return false;
+        }
+        
+        const uint64_t n = audio.pcm16 ? audio.read_s16(n_block, block16.data()) : audio.read(n_block, block.data());
+        if (n == 0) {
+            finished = true;
+            if (resample) {
+                resampler[0].finish(mono);
+                if (stereo) {
+                    resampler[1].finish(*left);
+                    resampler[2].finish(*right);
+                }
+            }
+            return resample;
+        }
+        
+        // decode straight into the output buffers, or into the input of the resamplers
+        float * dst  = tmp[0].data();
+        float * dst0 = stereo ? tmp[1].data() : NULL;
+        float * dst1 = stereo ? tmp[2].data() : NULL;
+        if (!resample) {
+            mono.resize(mono.size() + n);
+            dst = mono.data() + mono.size() - n;
+            if (stereo) {
+                left->resize(left->size() + n);
+                right->resize(right->size() + n);
+                dst0 = left->data() + left->size() - n;
+                dst1 = right->data() + right->size() - n;
+            }
+        }
+        if (audio.pcm16) {
+            whisper_pcm_mix_s16(block16.data(), n, n_channels, dst, dst0, dst1);
+        } else {
+            whisper_pcm_mix_f32(block.data(), n, n_channels, dst, dst0, dst1);
+        }
+        
+        if (resample) {
+            resampler[0].push(tmp[0].data(), n, mono);
+            if (stereo) {
+                resampler[1].push(tmp[1].data(), n, *left);
+                resampler[2].push(tmp[2].data(), n, *right);
+            }
+        }
+        
+        n_read       += n;
+        n_read_total += n;
+        
+        return true;
+    }
+    
+    // start again at the first sample of the file
+    bool rewind() {
+        if (!audio.open(fname)) {
+            return false;
+        }
+        if (resample) {
+            for (int c = 0; c < (stereo ? 3 : 1); c++) {
+                resampler[c].reset();
+            }
+        }
+        n_read   = 0;
+        finished = false;
+        pending.clear();
+        pending_pos = 0;
+        return true;
+    }
+    
+    // whisper_pcm_read_callback of the mono samples
+    static int read_callback(float * samples, int n_samples, void * user_data) {
+        whisper_audio_reader & reader = *(whisper_audio_reader *) user_data;
+        while (reader.pending_pos == reader.pending.size()) {
+            reader.pending.clear();
+            reader.pending_pos = 0;
+            if (!reader.read(reader.pending, NULL, NULL)) {
+                return 0;
+            }
+        }
+        const int n = std::min<size_t>(n_samples, reader.pending.size() - reader.pending_pos);
+        std::copy(reader.pending.begin() + reader.pending_pos, reader.pending.begin() + reader.pending_pos + n, samples);
+        reader.pending_pos += n;
+        return n;
+    }
+    
+    // whisper_pcm_rewind_callback
+    static int rewind_callback(void * user_data) {
+        return ((whisper_audio_reader *) user_data)->rewind() ? 0 : -1;
+    }
+};
+
+// Read a WAV, FLAC or MP3 file as 16 kHz mono float PCM and, for diarization, as 2 float channels
+// Returns the error message or an empty string
+std::string read_audio(const std::string & fname_inp, const whisper_params & params, std::vector<float> & pcmf32, std::vector<std::vector<float>> & pcmf32s) {
+    whisper_audio_reader reader;
+    
+    const std::string error = reader.open(fname_inp, params);
+    if (!error.empty()) {
+        return error;
+    }
+    
+    pcmf32.clear();
+    pcmf32.reserve(reader.n_samples());
+    if (reader.stereo) {
+        pcmf32s.resize(2);
+        pcmf32s[0].clear();
+        pcmf32s[1].clear();
+        pcmf32s[0].reserve(reader.n_samples());
+        pcmf32s[1].reserve(reader.n_samples());
+    }
+    
+    while (reader.stereo ? reader.read(pcmf32, &pcmf32s[0], &pcmf32s[1]) : reader.read(pcmf32, NULL, NULL)) {
+    }
+    
+    if (reader.n_read == 0) {
+        return "Audio file contains no samples: " + fname_inp;
+    }
+    
+    return "";
+}
+
+// The segments and tokens of a transcription, copied out of the state such that the state can transcribe the next file
+struct whisper_transcript_token {
+    whisper_token id;
+    std::string text;
+    float p;
+    int64_t t0;
+    int64_t t1;
+};
+
+struct whisper_transcript_segment {
+    std::string text;
+    int64_t t0;
+    int64_t t1;
+    std::vector<whisper_transcript_token> tokens;
+};
+
+std::vector<whisper_transcript_segment> whisper_transcript(struct whisper_context * ctx, struct whisper_state * state) {
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    std::vector<whisper_transcript_segment> segments(n_segments);
+    for (int i = 0; i < n_segments; ++i) {
+        segments[i].text = whisper_full_get_segment_text_from_state(state, i);
+        segments[i].t0 = whisper_full_get_segment_t0_from_state(state, i);
+        segments[i].t1 = whisper_full_get_segment_t1_from_state(state, i);
+        for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
+            const whisper_token_data token = whisper_full_get_token_data_from_state(state, i, j);
+            segments[i].tokens.push_back({ token.id, whisper_full_get_token_text_from_state(ctx, state, i, j), token.p, token.t0, token.t1 });
+        }
+    }
+    return segments;
+}
+
+// The transcription as returned to R
+Rcpp::List whisper_transcript_list(struct whisper_context * ctx, const std::vector<whisper_transcript_segment> & segments, const whisper_params & params, 
+                                   std::string path, int duration, int offset, bool token_timestamps) {
+    const int n_segments = segments.size();
+    std::vector<int> segment_nr;
+    Rcpp::StringVector transcriptions(n_segments);
+    Rcpp::StringVector transcriptions_from(n_segments);
+    Rcpp::StringVector transcriptions_to(n_segments);
+    std::vector<int> token_segment_nr;
+    std::vector<std::string> token_segment_text;
+    std::vector<float> token_segment_probability;
+    std::vector<std::string> token_segment_from;
+    std::vector<std::string> token_segment_to;
+    for (int i = 0; i < n_segments; ++i) {
+        segment_nr.push_back(i + 1);
+        transcriptions[i] = Rcpp::String(segments[i].text.c_str());
+        transcriptions_from[i] = Rcpp::String(to_timestamp(segments[i].t0).c_str());
+        transcriptions_to[i] = Rcpp::String(to_timestamp(segments[i].t1).c_str());
+        
+        for (const auto & token : segments[i].tokens) {
+            if (params.print_special == false) {
+                if (token.id >= whisper_token_eot(ctx)) {
+                    continue;
+                }
+            }
+            token_segment_nr.push_back(i + 1);
+            token_segment_text.push_back(token.text);
+            token_segment_probability.push_back(token.p);
+            if(token_timestamps){
+                token_segment_from.push_back(to_timestamp(token.t0));
+                token_segment_to.push_back(to_timestamp(token.t1));
+            }
+        }
+    }
+    Rcpp::DataFrame tokens;
+    if(token_timestamps){
+        tokens = Rcpp::DataFrame::create(
+            Rcpp::Named("segment") = token_segment_nr, 
+            Rcpp::Named("token") = token_segment_text, 
+            Rcpp::Named("token_prob") = token_segment_probability,
+            Rcpp::Named("token_from") = token_segment_from,
+            Rcpp::Named("token_to") = token_segment_to,
+            Rcpp::Named("stringsAsFactors") = false);
+    }else{
+        tokens = Rcpp::DataFrame::create(
+            Rcpp::Named("segment") = token_segment_nr, 
+            Rcpp::Named("token") = token_segment_text, 
+            Rcpp::Named("token_prob") = token_segment_probability,
+            Rcpp::Named("stringsAsFactors") = false);
+    }
+    
+    Rcpp::List output = Rcpp::List::create(Rcpp::Named("n_segments") = n_segments,
+                                           Rcpp::Named("data") = Rcpp::DataFrame::create(
+                                               Rcpp::Named("segment") = segment_nr, 
+                                               Rcpp::Named("from") = transcriptions_from,
+                                               Rcpp::Named("to") = transcriptions_to,
+                                               Rcpp::Named("text") = transcriptions, 
+                                               Rcpp::Named("stringsAsFactors") = false),
+                                           Rcpp::Named("tokens") = tokens,
+                                           Rcpp::Named("params") = Rcpp::List::create(
+                                               Rcpp::Named("audio") = path,
+                                               Rcpp::Named("language") = params.language, 
+                                               Rcpp::Named("offset") = offset,
+                                               Rcpp::Named("duration") = duration,
+                                               Rcpp::Named("translate") = params.translate,
+                                               Rcpp::Named("token_timestamps") = token_timestamps,
+                                               Rcpp::Named("word_threshold") = params.word_thold,
+                                               Rcpp::Named("vad") = params.vad));
+    return output;
+}
+
+// The inference parameters shared by all transcriptions of a call, without the callbacks
+whisper_full_params whisper_full_params_from(const whisper_params & params, bool token_timestamps) {
+    whisper_full_params wparams = whisper_full_default_params(params.beam_width > 1 ? WHISPER_SAMPLING_BEAM_SEARCH : WHISPER_SAMPLING_GREEDY);
+    
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.print_timestamps = !params.no_timestamps;
+    wparams.print_special    = params.print_special;
+    wparams.translate        = params.translate;
+    wparams.language         = params.language.c_str();
+    wparams.n_threads        = params.n_threads;
+    wparams.spin_us          = params.spin_us;
+    wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
+    wparams.offset_ms        = params.offset_t_ms;
+    wparams.duration_ms      = params.duration_ms;
+    
+    wparams.token_timestamps = params.output_wts || params.max_len > 0;
+    wparams.token_timestamps = token_timestamps;
+    wparams.thold_pt         = params.word_thold;
+    wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
+    
+    wparams.speed_up         = params.speed_up;
+    wparams.vad              = params.vad;
+    
+    wparams.beam_search.beam_width = params.beam_width;
+    wparams.beam_search.n_best     = params.beam_width;
+    
+    return wparams;
+}
+
+
+// Whether a file can be transcribed while it is read, with whisper_full_from_reader_with_state(), instead of being read
+// into memory first: voice activity detection, token timestamps, diarization and the parallel transcription of parts
+// of a file need all the samples at once
+bool whisper_full_params_streaming(const whisper_params & params, const whisper_full_params & wparams) {
+    return params.n_processors == 1 && !params.diarize && !wparams.vad && !wparams.speed_up && !wparams.token_timestamps;
+}
+
+// Reading a file while it is transcribed decodes it twice, the first pass finds the maximum of its spectrogram. This only
+// pays off when the samples of the file would take a lot of memory: files shorter than 10 minutes (38 MB of samples)
+// are read into memory and transcribed in one pass
+const uint64_t k_streaming_min_samples = 10*60*WHISPER_SAMPLE_RATE;
+
+// Transcribe the file opened by the reader, block by block if it is long or its length is unknown
+int whisper_full_from_audio_reader(struct whisper_context * ctx, struct whisper_state * state, const whisper_full_params & wparams, whisper_audio_reader & reader) {
+    const uint64_t n_samples = reader.n_samples();
+    if (n_samples > 0 && n_samples < k_streaming_min_samples) {
+        std::vector<float> pcmf32;
+        pcmf32.reserve(n_samples);
+        while (reader.read(pcmf32, NULL, NULL)) {
+        }
+        return whisper_full_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size());
+    }
+    return whisper_full_from_reader_with_state(ctx, state, wparams, whisper_audio_reader::read_callback, whisper_audio_reader::rewind_callback, &reader);
+}
+
 // Functionality to free the Rcpp::XPtr
+// The model is loaded once and is only read by the transcriptions, which each use their own WhisperState
 class WhisperModel {
     public: 
         struct whisper_context * ctx;
         WhisperModel(std::string model){
-          ctx = whisper_init(model.c_str());
+          ctx = whisper_init_no_state(model.c_str());
         }
         ~WhisperModel(){
             whisper_free(ctx);
         }
 };
 
+// The memory used by one transcription: key/value memory, compute buffers and the results
+// Freed when going out of scope, also when an R error is raised during the transcription
+class WhisperState {
+    public: 
+        struct whisper_state * state;
+        WhisperState(struct whisper_context * ctx){
+          state = whisper_init_state(ctx);
+        }
+        ~WhisperState(){
+            whisper_free_state(state);
+        }
+};
+
+class WhisperGroup {
+    public: 
+        struct whisper_group * group;
+        WhisperGroup(int n_threads){
+          group = whisper_group_init(n_threads);
+        }
+        ~WhisperGroup(){
+            whisper_group_free(group);
+        }
+};
+
 // [[Rcpp::export]]
 SEXP whisper_load_model(std::string model) {
     // Load language model and return the pointer to be used by whisper_encode
     //struct whisper_context * ctx = whisper_init(model.c_str());
     //Rcpp::XPtr<whisper_context> ptr(ctx, false);
     WhisperModel * wp = new WhisperModel(model);
+    if (wp->ctx == NULL) {
+        delete wp;
+        Rcpp::stop("Failed to load the model: ", model);
+    }
     Rcpp::XPtr<WhisperModel> ptr(wp, false);
     return ptr;
 }
+
+// [[Rcpp::export]]
+bool whisper_quantize_file(std::string model, std::string file, int ftype) {
+    // Write a copy of the model with the weights of the linear layers quantized, in the aligned layout which is memory-mapped when loaded
+    return whisper_model_quantize(model.c_str(), file.c_str(), (enum whisper_ftype) ftype) == 0;
+}
     
 
 // [[Rcpp::export]]
 Rcpp::List whisper_encode(SEXP model, std::string path, std::string language, 
                           bool token_timestamps = false, bool translate = false, bool print_special = false, int duration = 0, int offset = 0, bool trace = false,
-                          int n_threads = 1, int n_processors = 1) {
+                          int n_threads = 1, int n_processors = 1, int beam_width = 1, bool vad = false, int spin_us = 200) {
     whisper_params params;
     params.language = language;
     //params.model = model;
@@ -219,6 +934,9 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
     params.fname_inp.push_back(path);
     params.n_threads = n_threads;
     params.n_processors = n_processors;
+    params.beam_width = beam_width;
+    params.vad = vad;
+    params.spin_us = spin_us;
     
     
     //std::string language  = "en";
@@ -234,68 +952,29 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
     // whisper init
     Rcpp::XPtr<WhisperModel> whispermodel(model);
     struct whisper_context * ctx = whispermodel->ctx;
+    WhisperState whisperstate(ctx);
+    struct whisper_state * state = whisperstate.state;
+    if (state == NULL) {
+        Rcpp::stop("Failed to allocate the memory for the transcription");
+    }
     //Rcpp::XPtr<whisper_context> ctx(model);
     //struct whisper_context * ctx = whisper_init(params.model.c_str());
     for (int f = 0; f < (int) params.fname_inp.size(); ++f) {
         const auto fname_inp = params.fname_inp[f];
+        // long files are read block by block while they are transcribed, unless the transcription needs all the samples at once
+        const bool streaming = whisper_full_params_streaming(params, whisper_full_params_from(params, token_timestamps));
+        
+        whisper_audio_reader reader;
         std::vector<float> pcmf32; // mono-channel F32 PCM
         std::vector<std::vector<float>> pcmf32s; // stereo-channel F32 PCM
-        // WAV input
+        // WAV, FLAC or MP3 input
         {
-            drwav wav;
-            std::vector<uint8_t> wav_data; // used for pipe input from stdin
-            
-            if (drwav_init_file(&wav, fname_inp.c_str(), NULL) == false) {
-                Rcpp::stop("Failed to open the file as WAV file: ", fname_inp);
-            }
-            
-            if (wav.channels != 1 && wav.channels != 2) {
-                Rcpp::stop("WAV file must be mono or stereo: ", fname_inp);
-            }
-            
-            if (params.diarize && wav.channels != 2 && params.no_timestamps == false) {
-                Rcpp::stop("WAV file must be stereo for diarization and timestamps have to be enabled: ", fname_inp);
-            }
-            
-            if (wav.sampleRate != WHISPER_SAMPLE_RATE) {
-                Rcpp::stop("WAV file must be 16 kHz: ", fname_inp);
-            }
-            
-            if (wav.bitsPerSample != 16) {
-                Rcpp::stop("WAV file must be 16 bit: ", fname_inp);
-            }
-            
-            const uint64_t n = wav_data.empty() ? wav.totalPCMFrameCount : wav_data.size()/(wav.channels*wav.bitsPerSample/8);
-            
-            std::vector<int16_t> pcm16;
-            pcm16.resize(n*wav.channels);
-            drwav_read_pcm_frames_s16(&wav, n, pcm16.data());
-            drwav_uninit(&wav);
-            
-            // convert to mono, float
-            pcmf32.resize(n);
-            if (wav.channels == 1) {
-                for (uint64_t i = 0; i < n; i++) {
-                    pcmf32[i] = float(pcm16[i])/32768.0f;
-                }
-            } else {
-                for (uint64_t i = 0; i < n; i++) {
-                    pcmf32[i] = float(pcm16[2*i] + pcm16[2*i + 1])/65536.0f;
-                }
-            }
-            
-            if (params.diarize) {
-                // convert to stereo, float
-                pcmf32s.resize(2);
-                
-                pcmf32s[0].resize(n);
-                pcmf32s[1].resize(n);
-                for (uint64_t i = 0; i < n; i++) {
-                    pcmf32s[0][i] = float(pcm16[2*i])/32768.0f;
-                    pcmf32s[1][i] = float(pcm16[2*i + 1])/32768.0f;
-                }
+            const std::string error = streaming ? reader.open(fname_inp, params) : read_audio(fname_inp, params, pcmf32, pcmf32s);
+            if (!error.empty()) {
+                Rcpp::stop(error);
             }
         }
+        const uint64_t n_samples = streaming ? reader.n_samples() : pcmf32.size();
         
         /*
         // print system information
@@ -313,30 +992,14 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
                     Rcpp::warning("WARNING: model is not multilingual, ignoring language and translation options");
                 }
             }
-            Rcpp::Rcout << "Processing " << fname_inp << " (" << int(pcmf32.size()) << " samples, " << float(pcmf32.size())/WHISPER_SAMPLE_RATE << " sec)" << ", lang = " << params.language << ", translate = " << params.translate << ", timestamps = " << token_timestamps << "\n";
+            Rcpp::Rcout << "Processing " << fname_inp << " (" << n_samples << " samples, " << float(n_samples)/WHISPER_SAMPLE_RATE << " sec)" << ", lang = " << params.language << ", translate = " << params.translate << ", timestamps = " << token_timestamps << "\n";
         }
         
         // run the inference
         {
-            whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+            whisper_full_params wparams = whisper_full_params_from(params, token_timestamps);
             
             wparams.print_realtime   = trace;
-            wparams.print_progress   = false;
-            wparams.print_timestamps = !params.no_timestamps;
-            wparams.print_special    = params.print_special;
-            wparams.translate        = params.translate;
-            wparams.language         = params.language.c_str();
-            wparams.n_threads        = params.n_threads;
-            wparams.n_max_text_ctx   = params.max_context >= 0 ? params.max_context : wparams.n_max_text_ctx;
-            wparams.offset_ms        = params.offset_t_ms;
-            wparams.duration_ms      = params.duration_ms;
-            
-            wparams.token_timestamps = params.output_wts || params.max_len > 0;
-            wparams.token_timestamps = token_timestamps;
-            wparams.thold_pt         = params.word_thold;
-            wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
-            
-            wparams.speed_up         = params.speed_up;
             
             whisper_print_user_data user_data = { &params, &pcmf32s };
             
@@ -352,94 +1015,379 @@ Rcpp::List whisper_encode(SEXP model, std::string path, std::string language,
             {
                 static bool is_aborted = false; // NOTE: this should be atomic to avoid data race
                 
-                wparams.encoder_begin_callback = [](struct whisper_context * ctx, void * user_data) {
+                wparams.encoder_begin_callback = [](struct whisper_context * ctx, struct whisper_state * state, void * user_data) {
                     bool is_aborted = *(bool*)user_data;
                     return !is_aborted;
                 };
                 wparams.encoder_begin_callback_user_data = &is_aborted;
             }
             
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
-                Rcpp::stop("failed to process audio");
+            if (streaming) {
+                if (whisper_full_from_audio_reader(ctx, state, wparams, reader) != 0) {
+                    Rcpp::stop("failed to process audio");
+                }
+                if (reader.n_read_total == 0) {
+                    Rcpp::stop("Audio file contains no samples: " + fname_inp);
+                }
+            } else {
+                if (whisper_full_parallel_with_state(ctx, state, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+                    Rcpp::stop("failed to process audio");
+                }
             }
         }
     }
     
     // Get the data back in R
-    const int n_segments = whisper_full_n_segments(ctx);
-    std::vector<int> segment_nr;
-    Rcpp::StringVector transcriptions(n_segments);
-    Rcpp::StringVector transcriptions_from(n_segments);
-    Rcpp::StringVector transcriptions_to(n_segments);
-    std::vector<int> token_segment_nr;
-    std::vector<std::string> token_segment_text;
-    std::vector<float> token_segment_probability;
-    std::vector<std::string> token_segment_from;
-    std::vector<std::string> token_segment_to;
-    for (int i = 0; i < n_segments; ++i) {
-        segment_nr.push_back(i + 1);
-        const char * text = whisper_full_get_segment_text(ctx, i);
-        transcriptions[i] = Rcpp::String(text);
-        int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-        int64_t t1 = whisper_full_get_segment_t1(ctx, i);
-        transcriptions_from[i] = Rcpp::String(to_timestamp(t0).c_str());
-        transcriptions_to[i] = Rcpp::String(to_timestamp(t1).c_str());
+    return whisper_transcript_list(ctx, whisper_transcript(ctx, state), params, path, duration, offset, token_timestamps);
+}
+
+
+// Transcription of several files with a pool of states
+// A reader thread decodes the audio of the next files while the states are busy, so that reading the files overlaps with
+// the mel spectrogram, the encoder and the decoder of the files in progress. Each state transcribes one file at a time:
+// the windows of a file are transcribed in order, each window starts where the previous one ended and uses its text as prompt.
+// The main thread waits for the workers, checks for user interrupts and builds the R output.
+struct whisper_batch {
+    struct whisper_context * ctx;
+    whisper_full_params wparams;
+    const whisper_params * params;
+    const std::vector<std::string> * files;
+    
+    std::mutex mutex;
+    std::condition_variable cv;
+    
+    // the files which are read but not yet taken by a state: file index and mono float PCM
+    std::deque<std::pair<int, std::vector<float>>> queue;
+    size_t queue_max;
+    bool read_done;
+    
+    // the states read the files themselves while transcribing them, the next file to take
+    bool streaming;
+    std::atomic<int> next;
+    
+    std::atomic<bool> aborted;
+    
+    // the results and errors by file and the files in the order in which they are done
+    std::vector<std::vector<whisper_transcript_segment>> results;
+    std::vector<std::string> errors;
+    std::vector<int> done;
+};
+
+void whisper_batch_read(whisper_batch & batch) {
+    for (int f = 0; f < (int) batch.files->size() && !batch.aborted; ++f) {
+        std::vector<float> pcmf32;
+        std::vector<std::vector<float>> pcmf32s;
+        const std::string error = read_audio((*batch.files)[f], *batch.params, pcmf32, pcmf32s);
         
-        for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
-            if (params.print_special == false) {
-                const whisper_token id = whisper_full_get_token_id(ctx, i, j);
-                if (id >= whisper_token_eot(ctx)) {
-                    continue;
-                }
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        if (!error.empty()) {
+            batch.errors[f] = error;
+            batch.done.push_back(f);
+        } else {
+            batch.cv.wait(lock, [&batch] { return batch.queue.size() < batch.queue_max || batch.aborted; });
+            batch.queue.emplace_back(f, std::move(pcmf32));
+        }
+        batch.cv.notify_all();
+    }
+    
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.read_done = true;
+    batch.cv.notify_all();
+}
+
+// A state transcribes the files while reading them, there is no reader thread
+void whisper_batch_work_streaming(whisper_batch & batch, struct whisper_state * state) {
+    while (!batch.aborted) {
+        const int f = batch.next++;
+        if (f >= (int) batch.files->size()) {
+            return;
+        }
+        
+        whisper_audio_reader reader;
+        std::vector<whisper_transcript_segment> result;
+        std::string error = reader.open((*batch.files)[f], *batch.params);
+        if (error.empty()) {
+            if (whisper_full_from_audio_reader(batch.ctx, state, batch.wparams, reader) != 0) {
+                error = "failed to process audio: " + (*batch.files)[f];
+            } else if (reader.n_read_total == 0) {
+                error = "Audio file contains no samples: " + (*batch.files)[f];
+            } else {
+                result = whisper_transcript(batch.ctx, state);
             }
-            const char * text = whisper_full_get_token_text(ctx, i, j);
-            const float  p    = whisper_full_get_token_p   (ctx, i, j);
-            token_segment_nr.push_back(i + 1);
-            std::string str(text);
-            token_segment_text.push_back(str);
-            token_segment_probability.push_back(p);
-            if(token_timestamps){
-                whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
-                t0 = token.t0;
-                t1 = token.t1;
-                token_segment_from.push_back(Rcpp::String(to_timestamp(t0).c_str()));
-                token_segment_to.push_back(to_timestamp(token.t1));
+        }
+        
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        batch.results[f] = std::move(result);
+        batch.errors[f] = error;
+        batch.done.push_back(f);
+        batch.cv.notify_all();
+    }
+}
+
+void whisper_batch_work(whisper_batch & batch, struct whisper_state * state) {
+    while (true) {
+        std::pair<int, std::vector<float>> item;
+        {
+            std::unique_lock<std::mutex> lock(batch.mutex);
+            batch.cv.wait(lock, [&batch] { return !batch.queue.empty() || batch.read_done || batch.aborted; });
+            if (batch.queue.empty() || batch.aborted) {
+                return;
             }
+            item = std::move(batch.queue.front());
+            batch.queue.pop_front();
+            batch.cv.notify_all();
+        }
+        
+        const int f = item.first;
+        const auto & pcmf32 = item.second;
+        
+        std::vector<whisper_transcript_segment> result;
+        std::string error;
+        if (whisper_full_with_state(batch.ctx, state, batch.wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            error = "failed to process audio: " + (*batch.files)[f];
+        } else {
+            result = whisper_transcript(batch.ctx, state);
         }
+        
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        batch.results[f] = std::move(result);
+        batch.errors[f] = error;
+        batch.done.push_back(f);
+        batch.cv.notify_all();
     }
-    Rcpp::DataFrame tokens;
-    if(token_timestamps){
-        tokens = Rcpp::DataFrame::create(
-            Rcpp::Named("segment") = token_segment_nr, 
-            Rcpp::Named("token") = token_segment_text, 
-            Rcpp::Named("token_prob") = token_segment_probability,
-            Rcpp::Named("token_from") = token_segment_from,
-            Rcpp::Named("token_to") = token_segment_to,
-            Rcpp::Named("stringsAsFactors") = false);
-    }else{
-        tokens = Rcpp::DataFrame::create(
-            Rcpp::Named("segment") = token_segment_nr, 
-            Rcpp::Named("token") = token_segment_text, 
-            Rcpp::Named("token_prob") = token_segment_probability,
-            Rcpp::Named("stringsAsFactors") = false);
+}
+
+void whisper_check_interrupt(void * dummy) {
+    R_CheckUserInterrupt();
+}
+
+// [[Rcpp::export]]
+Rcpp::List whisper_encode_batch(SEXP model, std::vector<std::string> path, std::string language, 
+                                bool token_timestamps = false, bool translate = false, bool print_special = false, int duration = 0, int offset = 0, bool trace = false,
+                                int n_threads = 1, int n_processors = 1, int beam_width = 1, bool vad = false, int spin_us = 200) {
+    whisper_params params;
+    params.language = language;
+    params.translate = translate;
+    params.print_special = print_special;
+    params.duration_ms = duration;
+    params.offset_t_ms = offset;
+    params.fname_inp = path;
+    params.n_threads = n_threads;
+    params.n_processors = n_processors;
+    params.beam_width = beam_width;
+    params.vad = vad;
+    params.spin_us = spin_us;
+    
+    if (params.fname_inp.empty()) {
+        Rcpp::stop("error: no input files specified");
     }
     
-    //whisper_free(ctx);
-    Rcpp::List output = Rcpp::List::create(Rcpp::Named("n_segments") = n_segments,
-                                           Rcpp::Named("data") = Rcpp::DataFrame::create(
-                                               Rcpp::Named("segment") = segment_nr, 
-                                               Rcpp::Named("from") = transcriptions_from,
-                                               Rcpp::Named("to") = transcriptions_to,
-                                               Rcpp::Named("text") = transcriptions, 
-                                               Rcpp::Named("stringsAsFactors") = false),
-                                           Rcpp::Named("tokens") = tokens,
-                                           Rcpp::Named("params") = Rcpp::List::create(
-                                               Rcpp::Named("audio") = path,
-                                               Rcpp::Named("language") = params.language, 
-                                               Rcpp::Named("offset") = offset,
-                                               Rcpp::Named("duration") = duration,
-                                               Rcpp::Named("translate") = params.translate,
-                                               Rcpp::Named("token_timestamps") = token_timestamps,
-                                               Rcpp::Named("word_threshold") = params.word_thold));
+    if (whisper_lang_id(params.language.c_str()) == -1) {
+        Rcpp::stop("Unknown language");
+    }
+    
+    Rcpp::XPtr<WhisperModel> whispermodel(model);
+    struct whisper_context * ctx = whispermodel->ctx;
+    if (!whisper_is_multilingual(ctx)) {
+        if (params.language != "en" || params.translate) {
+            params.language = "en";
+            params.translate = false;
+            Rcpp::warning("WARNING: model is not multilingual, ignoring language and translation options");
+        }
+    }
+    
+    // the pool of states, no more states than files
+    const int n_files = params.fname_inp.size();
+    const int n_states = std::max(1, std::min(params.n_processors, n_files));
+    std::vector<std::unique_ptr<WhisperState>> states;
+    for (int i = 0; i < n_states; ++i) {
+        states.emplace_back(new WhisperState(ctx));
+        if (states.back()->state == NULL) {
+            Rcpp::stop("Failed to allocate the memory for the transcription");
+        }
+    }
+    
+    // the files in progress encode their windows as one batch, with the threads of all the states
+    WhisperGroup group(params.n_threads*n_states);
+    for (auto & state : states) {
+        whisper_group_add_state(group.group, state->state);
+    }
+    
+    whisper_batch batch;
+    batch.ctx = ctx;
+    batch.params = &params;
+    batch.files = &params.fname_inp;
+    batch.queue_max = n_states;
+    batch.read_done = false;
+    batch.aborted = false;
+    batch.results.resize(n_files);
+    batch.errors.resize(n_files);
+    
+    batch.wparams = whisper_full_params_from(params, token_timestamps);
+    
+    // each state transcribes a whole file, so params.n_processors only sets the number of states
+    whisper_params params_file = params;
+    params_file.n_processors = 1;
+    batch.streaming = whisper_full_params_streaming(params_file, batch.wparams);
+    batch.next = 0;
+    
+    // stop the transcriptions in progress at the next window when the user interrupts
+    batch.wparams.encoder_begin_callback = [](struct whisper_context * ctx, struct whisper_state * state, void * user_data) {
+        return !((std::atomic<bool> *) user_data)->load();
+    };
+    batch.wparams.encoder_begin_callback_user_data = &batch.aborted;
+    
+    std::vector<std::thread> workers;
+    if (batch.streaming) {
+        for (int i = 0; i < n_states; ++i) {
+            workers.emplace_back(whisper_batch_work_streaming, std::ref(batch), states[i]->state);
+        }
+    } else {
+        workers.emplace_back(whisper_batch_read, std::ref(batch));
+        for (int i = 0; i < n_states; ++i) {
+            workers.emplace_back(whisper_batch_work, std::ref(batch), states[i]->state);
+        }
+    }
+    
+    {
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        size_t n_printed = 0;
+        while ((int) batch.done.size() < n_files) {
+            batch.cv.wait_for(lock, std::chrono::milliseconds(100));
+            for (; trace && n_printed < batch.done.size(); ++n_printed) {
+                const int f = batch.done[n_printed];
+                Rcpp::Rcout << "Processed " << params.fname_inp[f] << " (" << n_printed + 1 << "/" << n_files << ")" << (batch.errors[f].empty() ? "" : ": failed") << "\n";
+            }
+            if (!R_ToplevelExec(whisper_check_interrupt, NULL)) {
+                batch.aborted = true;
+                break;
+            }
+        }
+        batch.cv.notify_all();
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+    if (batch.aborted) {
+        Rcpp::stop("Transcription interrupted by the user");
+    }
+    
+    // Get the data back in R, the files which failed give NULL
+    Rcpp::List output(n_files);
+    for (int f = 0; f < n_files; ++f) {
+        if (!batch.errors[f].empty()) {
+            Rcpp::warning(batch.errors[f]);
+            output[f] = R_NilValue;
+        } else {
+            output[f] = whisper_transcript_list(ctx, batch.results[f], params, params.fname_inp[f], duration, offset, token_timestamps);
+        }
+    }
+    output.names() = path;
+    return output;
+}
+
+
+// A streaming transcription, freed by the garbage collector or when the stream is closed
+// It keeps the language string used by the stream and the number of committed segments which were already returned to R
+class WhisperStream {
+    public: 
+        struct whisper_stream * stream;
+        std::string language;
+        int n_returned;
+        WhisperStream(struct whisper_context * ctx, std::string lang, whisper_full_params wparams, int step, int length, int keep) : language(lang), n_returned(0) {
+          wparams.language = language.c_str();
+          stream = whisper_stream_init(ctx, wparams, step, length, keep);
+        }
+        ~WhisperStream(){
+            whisper_stream_free(stream);
+        }
+};
+
+Rcpp::DataFrame whisper_stream_segments(struct whisper_stream * stream, int from, int to) {
+    std::vector<int> segment_nr;
+    std::vector<std::string> transcriptions;
+    std::vector<std::string> transcriptions_from;
+    std::vector<std::string> transcriptions_to;
+    for (int i = from; i < to; ++i) {
+        segment_nr.push_back(i + 1);
+        transcriptions.push_back(whisper_stream_get_segment_text(stream, i));
+        transcriptions_from.push_back(to_timestamp(whisper_stream_get_segment_t0(stream, i)));
+        transcriptions_to.push_back(to_timestamp(whisper_stream_get_segment_t1(stream, i)));
+    }
+    return Rcpp::DataFrame::create(
+        Rcpp::Named("segment") = segment_nr, 
+        Rcpp::Named("from") = transcriptions_from,
+        Rcpp::Named("to") = transcriptions_to,
+        Rcpp::Named("text") = transcriptions, 
+        Rcpp::Named("stringsAsFactors") = false);
+}
+
+Rcpp::List whisper_stream_result(WhisperStream & ws) {
+    // the committed segments which were not returned yet and the current tentative segments
+    const int n_committed = whisper_stream_n_committed(ws.stream);
+    const int n_segments  = whisper_stream_n_segments(ws.stream);
+    Rcpp::List output = Rcpp::List::create(
+        Rcpp::Named("committed") = whisper_stream_segments(ws.stream, ws.n_returned, n_committed),
+        Rcpp::Named("tentative") = whisper_stream_segments(ws.stream, n_committed, n_segments));
+    ws.n_returned = n_committed;
+    return output;
+}
+
+// [[Rcpp::export]]
+SEXP whisper_stream_init_model(SEXP model, std::string language, bool translate = false, 
+                               int step = 3000, int length = 10000, int keep = 200, bool keep_context = true, int n_threads = 1) {
+    if (whisper_lang_id(language.c_str()) == -1) {
+        Rcpp::stop("Unknown language");
+    }
+    Rcpp::XPtr<WhisperModel> whispermodel(model);
+    struct whisper_context * ctx = whispermodel->ctx;
+    if (!whisper_is_multilingual(ctx)) {
+        if (language != "en" || translate) {
+            language = "en";
+            translate = false;
+            Rcpp::warning("WARNING: model is not multilingual, ignoring language and translation options");
+        }
+    }
+    
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.print_realtime   = false;
+    wparams.print_progress   = false;
+    wparams.translate        = translate;
+    wparams.n_threads        = n_threads;
+    wparams.no_context       = !keep_context;
+    
+    WhisperStream * ws = new WhisperStream(ctx, language, wparams, step, length, keep);
+    if (ws->stream == NULL) {
+        delete ws;
+        Rcpp::stop("Failed to allocate the memory for the stream");
+    }
+    Rcpp::XPtr<WhisperStream> ptr(ws, true);
+    return ptr;
+}
+
+// [[Rcpp::export]]
+Rcpp::List whisper_stream_push_audio(SEXP stream, std::vector<float> x) {
+    Rcpp::XPtr<WhisperStream> ws(stream);
+    if (ws->stream == NULL) {
+        Rcpp::stop("The stream is closed");
+    }
+    if (whisper_stream_push(ws->stream, x.data(), x.size()) != 0) {
+        Rcpp::stop("failed to process audio");
+    }
+    return whisper_stream_result(*ws);
+}
+
+// [[Rcpp::export]]
+Rcpp::List whisper_stream_finish_audio(SEXP stream) {
+    Rcpp::XPtr<WhisperStream> ws(stream);
+    if (ws->stream == NULL) {
+        Rcpp::stop("The stream is closed");
+    }
+    if (whisper_stream_finish(ws->stream) != 0) {
+        Rcpp::stop("failed to process audio");
+    }
+    Rcpp::List output = whisper_stream_result(*ws);
+    whisper_stream_free(ws->stream);
+    ws->stream = NULL;
     return output;
 }
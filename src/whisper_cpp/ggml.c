@@ -68,6 +68,42 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    return 0;
+}
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -1160,6 +1196,293 @@ inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
 inline static void ggml_vec_sum_f32     (const int n, float * s, const float * x) { ggml_float sum = 0.0; for (int i = 0; i < n; ++i) sum += x[i]; *s += sum; }
 inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x) { ggml_vec_norm_f32(n, s, x); *s = 1./(*s); }
 
+//
+// quantization
+//
+
+// the quantized types store blocks of QK consecutive values of a row with one scaling factor per block
+#define QK 32
+
+// x[i] = d*(q[i] - 8), two values per byte - the first one in the low nibble
+typedef struct {
+    float   d;
+    uint8_t qs[QK/2];
+} block_q4_0;
+static_assert(sizeof(block_q4_0) == sizeof(float) + QK/2, "wrong q4_0 block size/padding");
+
+// x[i] = d*q[i]
+typedef struct {
+    float  d;
+    int8_t qs[QK];
+} block_q8_0;
+static_assert(sizeof(block_q8_0) == sizeof(float) + QK, "wrong q8_0 block size/padding");
+
+static void quantize_row_q4_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k/QK;
+
+    block_q4_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int l = 0; l < QK; l++) {
+            amax = MAX(amax, fabsf(x[i*QK + l]));
+        }
+
+        const float d  = amax/((1 << 3) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int l = 0; l < QK; l += 2) {
+            const uint8_t vi0 = (int8_t) roundf(x[i*QK + l + 0]*id) + 8;
+            const uint8_t vi1 = (int8_t) roundf(x[i*QK + l + 1]*id) + 8;
+
+            assert(vi0 < 16);
+            assert(vi1 < 16);
+
+            y[i].qs[l/2] = vi0 | (vi1 << 4);
+        }
+    }
+}
+
+static void quantize_row_q8_0(const float * restrict x, void * restrict vy, int k) {
+    assert(k % QK == 0);
+    const int nb = k/QK;
+
+    block_q8_0 * restrict y = vy;
+
+    for (int i = 0; i < nb; i++) {
+        float amax = 0.0f; // absolute max
+
+        for (int l = 0; l < QK; l++) {
+            amax = MAX(amax, fabsf(x[i*QK + l]));
+        }
+
+        const float d  = amax/((1 << 7) - 1);
+        const float id = d ? 1.0f/d : 0.0f;
+
+        y[i].d = d;
+
+        for (int l = 0; l < QK; ++l) {
+            y[i].qs[l] = roundf(x[i*QK + l]*id);
+        }
+    }
+}
+
+static void dequantize_row_q4_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k/QK;
+
+    const block_q4_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = x[i].d;
+
+        for (int l = 0; l < QK; l += 2) {
+            const uint8_t vi = x[i].qs[l/2];
+
+            y[i*QK + l + 0] = ((int8_t) (vi & 0xF) - 8)*d;
+            y[i*QK + l + 1] = ((int8_t) (vi >>  4) - 8)*d;
+        }
+    }
+}
+
+static void dequantize_row_q8_0(const void * restrict vx, float * restrict y, int k) {
+    assert(k % QK == 0);
+    const int nb = k/QK;
+
+    const block_q8_0 * restrict x = vx;
+
+    for (int i = 0; i < nb; i++) {
+        const float d = x[i].d;
+
+        for (int l = 0; l < QK; ++l) {
+            y[i*QK + l] = x[i].qs[l]*d;
+        }
+    }
+}
+
+#if defined(__AVX2__)
+// unpack the 32 4-bit values of a q4_0 block to bytes, in the order in which they were packed
+static inline __m256i bytes_from_nibbles_32(const uint8_t * rsi) {
+    const __m128i tmp = _mm_loadu_si128((const __m128i *) rsi);
+    const __m128i m4b = _mm_set1_epi8(0xF);
+
+    const __m128i lo = _mm_and_si128(tmp, m4b);
+    const __m128i hi = _mm_and_si128(_mm_srli_epi16(tmp, 4), m4b);
+
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi8(lo, hi)), _mm_unpackhi_epi8(lo, hi), 1);
+}
+
+// products of 32 pairs of signed bytes, summed to 8 floats
+static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
+    // _mm256_maddubs_epi16 multiplies unsigned by signed bytes, so move the sign of x to y
+    const __m256i ax = _mm256_sign_epi8(x, x);
+    const __m256i sy = _mm256_sign_epi8(y, x);
+
+    const __m256i dot = _mm256_maddubs_epi16(ax, sy);
+
+    return _mm256_cvtepi32_ps(_mm256_madd_epi16(dot, _mm256_set1_epi16(1)));
+}
+
+static inline float hsum_float_8(const __m256 x) {
+    const __m128 r4 = _mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+    const __m128 r2 = _mm_add_ps(r4, _mm_movehl_ps(r4, r4));
+    const __m128 r1 = _mm_add_ss(r2, _mm_movehdup_ps(r2));
+
+    return _mm_cvtss_f32(r1);
+}
+#elif defined(__ARM_NEON)
+// products of 16 pairs of signed bytes, summed pairwise and accumulated to 4 ints
+static inline int32x4_t ggml_vdotq_s8(int32x4_t acc, const int8x16_t x, const int8x16_t y) {
+    const int16x8_t p0 = vmull_s8(vget_low_s8 (x), vget_low_s8 (y));
+    const int16x8_t p1 = vmull_s8(vget_high_s8(x), vget_high_s8(y));
+
+    return vaddq_s32(acc, vaddq_s32(vpaddlq_s16(p0), vpaddlq_s16(p1)));
+}
+#endif
+
+// the second operand of the quantized dot products is a row quantized with quantize_row_q8_0
+static void ggml_vec_dot_q4_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK == 0);
+    const int nb = n/QK;
+
+    const block_q4_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(x[i].d*y[i].d);
+
+        const __m256i bx = _mm256_sub_epi8(bytes_from_nibbles_32(x[i].qs), _mm256_set1_epi8(8));
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = _mm256_fmadd_ps(d, mul_sum_i8_pairs_float(bx, by), acc);
+    }
+
+    *s = hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    const uint8x16_t m4b = vdupq_n_u8(0xF);
+    const int8x16_t  s8b = vdupq_n_s8(0x8);
+
+    for (int i = 0; i < nb; ++i) {
+        const uint8x16_t v0 = vld1q_u8(x[i].qs);
+
+        // 4-bit -> 8-bit, in the order in which the values were packed
+        const uint8x16x2_t v = vzipq_u8(vandq_u8(v0, m4b), vshrq_n_u8(v0, 4));
+
+        const int8x16_t x0 = vsubq_s8(vreinterpretq_s8_u8(v.val[0]), s8b);
+        const int8x16_t x1 = vsubq_s8(vreinterpretq_s8_u8(v.val[1]), s8b);
+
+        const int8x16_t y0 = vld1q_s8(y[i].qs);
+        const int8x16_t y1 = vld1q_s8(y[i].qs + 16);
+
+        const int32x4_t p = ggml_vdotq_s8(ggml_vdotq_s8(vdupq_n_s32(0), x0, y0), x1, y1);
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), x[i].d*y[i].d);
+    }
+
+    const float32x2_t sumf32 = vadd_f32(vget_low_f32(sumv), vget_high_f32(sumv));
+
+    *s = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+#else
+    // scalar
+    float sumf = 0.0f;
+
+    for (int i = 0; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK/2; j++) {
+            const uint8_t v = x[i].qs[j];
+
+            sumi += ((int) (v & 0xF) - 8)*y[i].qs[2*j + 0];
+            sumi += ((int) (v >>  4) - 8)*y[i].qs[2*j + 1];
+        }
+
+        sumf += x[i].d*y[i].d*sumi;
+    }
+
+    *s = sumf;
+#endif
+}
+
+static void ggml_vec_dot_q8_0_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    assert(n % QK == 0);
+    const int nb = n/QK;
+
+    const block_q8_0 * restrict x = vx;
+    const block_q8_0 * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+
+    for (int i = 0; i < nb; ++i) {
+        const __m256 d = _mm256_set1_ps(x[i].d*y[i].d);
+
+        const __m256i bx = _mm256_loadu_si256((const __m256i *) x[i].qs);
+        const __m256i by = _mm256_loadu_si256((const __m256i *) y[i].qs);
+
+        acc = _mm256_fmadd_ps(d, mul_sum_i8_pairs_float(bx, by), acc);
+    }
+
+    *s = hsum_float_8(acc);
+#elif defined(__ARM_NEON)
+    float32x4_t sumv = vdupq_n_f32(0.0f);
+
+    for (int i = 0; i < nb; ++i) {
+        const int8x16_t x0 = vld1q_s8(x[i].qs);
+        const int8x16_t x1 = vld1q_s8(x[i].qs + 16);
+
+        const int8x16_t y0 = vld1q_s8(y[i].qs);
+        const int8x16_t y1 = vld1q_s8(y[i].qs + 16);
+
+        const int32x4_t p = ggml_vdotq_s8(ggml_vdotq_s8(vdupq_n_s32(0), x0, y0), x1, y1);
+
+        sumv = vmlaq_n_f32(sumv, vcvtq_f32_s32(p), x[i].d*y[i].d);
+    }
+
+    const float32x2_t sumf32 = vadd_f32(vget_low_f32(sumv), vget_high_f32(sumv));
+
+    *s = vget_lane_f32(sumf32, 0) + vget_lane_f32(sumf32, 1);
+#else
+    // scalar
+    float sumf = 0.0f;
+
+    for (int i = 0; i < nb; i++) {
+        int sumi = 0;
+
+        for (int j = 0; j < QK; j++) {
+            sumi += x[i].qs[j]*y[i].qs[j];
+        }
+
+        sumf += x[i].d*y[i].d*sumi;
+    }
+
+    *s = sumf;
+#endif
+}
+
+typedef void (*quantize_row_q_t)  (const float * restrict x, void * restrict y, int k);
+typedef void (*dequantize_row_q_t)(const void * restrict x, float * restrict y, int k);
+typedef void (*vec_dot_q_t)       (const int n, float * restrict s, const void * restrict x, const void * restrict y);
+
+typedef struct {
+    quantize_row_q_t   quantize_row_q;
+    dequantize_row_q_t dequantize_row_q;
+    vec_dot_q_t        vec_dot_q; // dot product with a row quantized to q8_0
+} quantize_fns_t;
+
+static const quantize_fns_t quantize_fns[GGML_TYPE_COUNT] = {
+    [GGML_TYPE_Q4_0] = { quantize_row_q4_0, dequantize_row_q4_0, ggml_vec_dot_q4_0_q8_0, },
+    [GGML_TYPE_Q8_0] = { quantize_row_q8_0, dequantize_row_q8_0, ggml_vec_dot_q8_0_q8_0, },
+};
+
 //
 // logging
 //
@@ -1188,12 +1511,24 @@ inline static void ggml_vec_norm_inv_f32(const int n, float * s, const float * x
 // data types
 //
 
+const int GGML_BLCK_SIZE[GGML_TYPE_COUNT] = {
+    1,
+    1,
+    1,
+    1,
+    1,
+    QK,
+    QK,
+};
+
 const size_t GGML_TYPE_SIZE[GGML_TYPE_COUNT] = {
     sizeof(int8_t ),
     sizeof(int16_t),
     sizeof(int32_t),
     sizeof(ggml_fp16_t),
     sizeof(float  ),
+    sizeof(block_q4_0),
+    sizeof(block_q8_0),
 };
 
 const char * GGML_OP_LABEL[GGML_OP_COUNT] = {
@@ -1302,19 +1637,24 @@ struct ggml_context {
     size_t mem_size;
     void * mem_buffer;
     bool   mem_buffer_owned;
+    bool   no_alloc;
 
     int n_objects;
 
     struct ggml_object * objects_begin;
     struct ggml_object * objects_end;
-};
 
-struct ggml_context_container {
-    bool used;
+    struct ggml_scratch scratch;
+    struct ggml_scratch scratch_save;
 
-    struct ggml_context context;
+    // see ggml_init_measure(): the bytes of the tensor data that would be in the context memory
+    bool   measure;
+    size_t measure_size;
 };
 
+// the data of the tensors of a measure context, an aligned address which is never accessed
+static char * const GGML_MEASURE_DATA = (char *) GGML_MEM_ALIGN;
+
 //
 // compute types
 //
@@ -1339,13 +1679,9 @@ struct ggml_compute_params {
 // ggml state
 //
 
-struct ggml_state {
-    struct ggml_context_container contexts[GGML_MAX_CONTEXTS];
-};
-
-// global state
-struct ggml_state g_state;
-atomic_int g_state_barrier = 0;
+// the first ggml_init() claims the initialization of the f16 tables, the other ones wait until they are ready
+static atomic_int g_tables_claimed = 0;
+static atomic_int g_tables_ready   = 0;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1382,13 +1718,25 @@ int ggml_nrows(const struct ggml_tensor * tensor) {
 size_t ggml_nbytes(const struct ggml_tensor * tensor) {
     static_assert(GGML_MAX_DIMS == 4, "GGML_MAX_DIMS is not 4 - update this function");
 
-    return ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type];
+    return (ggml_nelements(tensor)*GGML_TYPE_SIZE[tensor->type])/GGML_BLCK_SIZE[tensor->type];
+}
+
+int ggml_blck_size(enum ggml_type type) {
+    return GGML_BLCK_SIZE[type];
 }
 
 size_t ggml_type_size(enum ggml_type type) {
     return GGML_TYPE_SIZE[type];
 }
 
+float ggml_type_sizef(enum ggml_type type) {
+    return ((float)(GGML_TYPE_SIZE[type]))/GGML_BLCK_SIZE[type];
+}
+
+bool ggml_is_quantized(enum ggml_type type) {
+    return type == GGML_TYPE_Q4_0 || type == GGML_TYPE_Q8_0;
+}
+
 size_t ggml_element_size(const struct ggml_tensor * tensor) {
     return GGML_TYPE_SIZE[tensor->type];
 }
@@ -1425,7 +1773,7 @@ bool ggml_is_contiguous(const struct ggml_tensor * tensor) {
 
     return
         tensor->nb[0] == GGML_TYPE_SIZE[tensor->type] &&
-        tensor->nb[1] == tensor->nb[0]*tensor->ne[0] &&
+        tensor->nb[1] == (tensor->nb[0]*tensor->ne[0])/GGML_BLCK_SIZE[tensor->type] &&
         tensor->nb[2] == tensor->nb[1]*tensor->ne[1] &&
         tensor->nb[3] == tensor->nb[2]*tensor->ne[2];
 }
@@ -1474,63 +1822,43 @@ int ggml_up64(int n) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-struct ggml_context * ggml_init(struct ggml_init_params params) {
-    // make this function thread safe
-    {
-        int processing = atomic_fetch_add(&g_state_barrier, 1);
-        while (processing > 0) {
-            // wait for other threads to finish
-            atomic_fetch_sub(&g_state_barrier, 1);
-            sched_yield();
-            processing = atomic_fetch_add(&g_state_barrier, 1);
-        }
+static void ggml_init_tables(void) {
+    if (atomic_load(&g_tables_ready)) {
+        return;
     }
 
-    static bool is_first_call = true;
-    if (is_first_call) {
-        const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
-
-        ggml_fp16_t ii;
-        for (int i = 0; i < (1 << 16); ++i) {
-            uint16_t ui = i;
-            memcpy(&ii, &ui, sizeof(ii));
-            const float f = GGML_FP16_TO_FP32(ii);
-            table_gelu_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_f32(f));
-            table_exp_f16[i]  = GGML_FP32_TO_FP16(exp(f));
+    if (atomic_fetch_add(&g_tables_claimed, 1) > 0) {
+        while (!atomic_load(&g_tables_ready)) {
+            sched_yield();
         }
+        return;
+    }
 
-        const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
-
-        GGML_PRINT_DEBUG("%s: GELU and EXP tables initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
+    const uint64_t t_start = ggml_time_us(); UNUSED(t_start);
 
-        is_first_call = false;
+    ggml_fp16_t ii;
+    for (int i = 0; i < (1 << 16); ++i) {
+        uint16_t ui = i;
+        memcpy(&ii, &ui, sizeof(ii));
+        const float f = GGML_FP16_TO_FP32(ii);
+        table_gelu_f16[i] = GGML_FP32_TO_FP16(ggml_gelu_f32(f));
+        table_exp_f16[i]  = GGML_FP32_TO_FP16(exp(f));
     }
 
-    // find non-used context in g_state
-    struct ggml_context * ctx = NULL;
+    const uint64_t t_end = ggml_time_us(); UNUSED(t_end);
 
-    static bool first_time = true;
-    if (first_time) {
-        for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-            g_state.contexts[i].used = false;
-        }
-        first_time = false;
-    }
+    GGML_PRINT_DEBUG("%s: GELU and EXP tables initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
 
-    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-        if (!g_state.contexts[i].used) {
-            g_state.contexts[i].used = true;
-            ctx = &g_state.contexts[i].context;
+    atomic_store(&g_tables_ready, 1);
+}
 
-            GGML_PRINT_DEBUG("%s: found unused context %d\n", __func__, i);
-            break;
-        }
-    }
+struct ggml_context * ggml_init(struct ggml_init_params params) {
+    // thread safe: apart from the one-time tables, a context does not touch any global state
+    ggml_init_tables();
 
+    struct ggml_context * ctx = malloc(sizeof(struct ggml_context));
     if (ctx == NULL) {
-        GGML_PRINT_DEBUG("%s: no unused context found\n", __func__);
-
-        atomic_fetch_sub(&g_state_barrier, 1);
+        GGML_PRINT_DEBUG("%s: failed to allocate the context\n", __func__);
 
         return NULL;
     }
@@ -1539,56 +1867,74 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
         .mem_size         = params.mem_size,
         .mem_buffer       = params.mem_buffer ? params.mem_buffer : malloc(params.mem_size),
         .mem_buffer_owned = params.mem_buffer ? false : true,
+        .no_alloc         = params.no_alloc,
         .n_objects        = 0,
         .objects_begin    = NULL,
         .objects_end      = NULL,
+        .scratch          = { 0, 0, NULL, },
+        .scratch_save     = { 0, 0, NULL, },
+        .measure          = false,
+        .measure_size     = 0,
     };
 
+    if (ctx->mem_buffer == NULL && params.mem_size > 0) {
+        GGML_PRINT_DEBUG("%s: failed to allocate %zu bytes\n", __func__, params.mem_size);
+
+        free(ctx);
+
+        return NULL;
+    }
+
     ggml_assert_aligned(ctx->mem_buffer);
 
     GGML_PRINT_DEBUG("%s: context initialized\n", __func__);
 
-    atomic_fetch_sub(&g_state_barrier, 1);
-
     return ctx;
 }
 
 void ggml_free(struct ggml_context * ctx) {
-    // make this function thread safe
-    {
-        int processing = atomic_fetch_add(&g_state_barrier, 1);
-        while (processing > 0) {
-            // wait for other threads to finish
-            atomic_fetch_sub(&g_state_barrier, 1);
-            sched_yield();
-            processing = atomic_fetch_add(&g_state_barrier, 1);
-        }
+    if (ctx == NULL) {
+        return;
     }
 
-    for (int i = 0; i < GGML_MAX_CONTEXTS; i++) {
-        if (&g_state.contexts[i].context == ctx) {
-            g_state.contexts[i].used = false;
+    GGML_PRINT_DEBUG("%s: context with %d objects has been freed\n", __func__, ctx->n_objects);
 
-            GGML_PRINT_DEBUG("%s: context %d with %d objects has been freed. memory used = %zu\n",
-                    __func__, i, ctx->n_objects, ctx->objects_end->offset + ctx->objects_end->size);
+    if (ctx->mem_buffer_owned) {
+        free(ctx->mem_buffer);
+    }
 
-            if (ctx->mem_buffer_owned) {
-                free(ctx->mem_buffer);
-            }
+    free(ctx);
+}
 
-            atomic_fetch_sub(&g_state_barrier, 1);
+struct ggml_context * ggml_init_measure(size_t mem_size) {
+    struct ggml_init_params params = { mem_size, NULL, false };
 
-            return;
-        }
+    struct ggml_context * ctx = ggml_init(params);
+    if (ctx) {
+        ctx->measure = true;
     }
 
-    GGML_PRINT_DEBUG("%s: context not found\n", __func__);
+    return ctx;
+}
+
+bool ggml_is_measure(const struct ggml_context * ctx) {
+    return ctx->measure;
+}
 
-    atomic_fetch_sub(&g_state_barrier, 1);
+size_t ggml_tensor_overhead(void) {
+    return GGML_OBJECT_SIZE + sizeof(struct ggml_tensor);
 }
 
 size_t ggml_used_mem(const struct ggml_context * ctx) {
-    return ctx->objects_end->offset + ctx->objects_end->size;
+    return ctx->objects_end->offset + ctx->objects_end->size + ctx->measure_size;
+}
+
+size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch) {
+    const size_t result = ctx->scratch.data ? ctx->scratch.offs : 0;
+
+    ctx->scratch = scratch;
+
+    return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1599,6 +1945,9 @@ struct ggml_tensor * ggml_new_tensor_impl(
         int    n_dims,
         const int* ne,
         void*  data) {
+    // rows of quantized types consist of whole blocks
+    GGML_ASSERT(ne[0] % GGML_BLCK_SIZE[type] == 0);
+
     // always insert objects at the end of the context's memory pool
     struct ggml_object * obj_cur = ctx->objects_end;
 
@@ -1608,15 +1957,46 @@ struct ggml_tensor * ggml_new_tensor_impl(
 
     size_t size_needed = 0;
 
-    if (data == NULL) {
-        size_needed += GGML_TYPE_SIZE[type];
-        for (int i = 0; i < n_dims; i++) {
+    if (data == NULL && !ctx->no_alloc) {
+        size_needed += GGML_TYPE_SIZE[type]*(ne[0]/GGML_BLCK_SIZE[type]);
+        for (int i = 1; i < n_dims; i++) {
             size_needed *= ne[i];
         }
         // align to GGML_MEM_ALIGN
         size_needed = ((size_needed + GGML_MEM_ALIGN - 1)/GGML_MEM_ALIGN)*GGML_MEM_ALIGN;
+    }
+
+    char * const mem_buffer = ctx->mem_buffer;
 
+    if (data == NULL && !ctx->no_alloc && ctx->scratch.data != NULL) {
+        // the tensor data goes to the scratch buffer - only the tensor object is stored in the context
+        if (!ctx->measure) {
+            if (ctx->scratch.offs + size_needed > ctx->scratch.size) {
+                GGML_PRINT("%s: not enough space in the scratch memory\n", __func__);
+                assert(false);
+                return NULL;
+            }
+
+            data = (char * const) ctx->scratch.data + ctx->scratch.offs;
+        }
+
+        ctx->scratch.offs += size_needed;
+
+        size_needed = 0;
     }
+
+    if (ctx->measure) {
+        // the data of a tensor of a measure context is only counted
+        ctx->measure_size += size_needed;
+
+        size_needed = 0;
+
+        // the data pointer must not be NULL, else the views of the tensor would count as tensors with their own data
+        if (data == NULL && !ctx->no_alloc) {
+            data = GGML_MEASURE_DATA;
+        }
+    }
+
     size_needed += sizeof(struct ggml_tensor);
 
     if (cur_end + size_needed + GGML_OBJECT_SIZE > ctx->mem_size) {
@@ -1625,8 +2005,6 @@ struct ggml_tensor * ggml_new_tensor_impl(
         return NULL;
     }
 
-    char * const mem_buffer = ctx->mem_buffer;
-
     struct ggml_object * const obj_new = (struct ggml_object *)(mem_buffer + cur_end);
 
     *obj_new = (struct ggml_object) {
@@ -1665,7 +2043,7 @@ struct ggml_tensor * ggml_new_tensor_impl(
         /*.perf_runs    =*/ 0,
         /*.perf_cycles  =*/ 0,
         /*.perf_time_us =*/ 0,
-        /*.data         =*/ data == NULL ? (void *)(result + 1) : data,
+        /*.data         =*/ (data == NULL && !ctx->no_alloc) ? (void *)(result + 1) : data,
         /*.pad          =*/ { 0 },
     };
 
@@ -1676,7 +2054,8 @@ struct ggml_tensor * ggml_new_tensor_impl(
     }
 
     result->nb[0] = GGML_TYPE_SIZE[type];
-    for (int i = 1; i < GGML_MAX_DIMS; i++) {
+    result->nb[1] = result->nb[0]*(result->ne[0]/GGML_BLCK_SIZE[type]);
+    for (int i = 2; i < GGML_MAX_DIMS; i++) {
         result->nb[i] = result->nb[i - 1]*result->ne[i - 1];
     }
 
@@ -1731,17 +2110,32 @@ struct ggml_tensor * ggml_new_tensor_4d(
 }
 
 struct ggml_tensor * ggml_new_i32(struct ggml_context * ctx, int32_t value) {
+    // the value is needed at compute time, so it must not be placed in the scratch buffer
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch.data = NULL;
+
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
 
-    ggml_set_i32(result, value);
+    ctx->scratch = ctx->scratch_save;
+
+    if (!ctx->measure) {
+        ggml_set_i32(result, value);
+    }
 
     return result;
 }
 
 struct ggml_tensor * ggml_new_f32(struct ggml_context * ctx, float value) {
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch.data = NULL;
+
     struct ggml_tensor * result = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
 
-    ggml_set_f32(result, value);
+    ctx->scratch = ctx->scratch_save;
+
+    if (!ctx->measure) {
+        ggml_set_f32(result, value);
+    }
 
     return result;
 }
@@ -1798,6 +2192,8 @@ struct ggml_tensor * ggml_set_i32 (struct ggml_tensor * tensor, int32_t value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1850,6 +2246,8 @@ struct ggml_tensor * ggml_set_f32(struct ggml_tensor * tensor, float value) {
                     ggml_vec_set_f32(nc, (float *)(data + i*n1), value);
                 }
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -1886,6 +2284,8 @@ int32_t ggml_get_i32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1922,6 +2322,8 @@ void ggml_set_i32_1d(const struct ggml_tensor * tensor, int i, int32_t value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1956,6 +2358,8 @@ float ggml_get_f32_1d(const struct ggml_tensor * tensor, int i) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 return ((float *)(tensor->data))[i];
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -1992,6 +2396,8 @@ void ggml_set_f32_1d(const struct ggml_tensor * tensor, int i, float value) {
                 GGML_ASSERT(tensor->nb[0] == sizeof(float));
                 ((float *)(tensor->data))[i] = value;
             } break;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -2011,7 +2417,14 @@ float * ggml_get_data_f32(const struct ggml_tensor * tensor) {
 struct ggml_tensor * ggml_view_tensor(
         struct ggml_context * ctx,
         const struct ggml_tensor * src) {
-    return ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+
+    // keep the strides - the view of a view can be non-contiguous
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        result->nb[i] = src->nb[i];
+    }
+
+    return result;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -2349,7 +2762,7 @@ struct ggml_tensor * ggml_repeat(
     result->op   = GGML_OP_REPEAT;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src0 = a;
-    result->src1 = NULL;
+    result->src1 = b; // only the shape of b is used, but the result must be computed after b when using scratch buffers
 
     return result;
 }
@@ -2833,6 +3246,70 @@ struct ggml_tensor * ggml_view_2d(
     return result;
 }
 
+// ggml_view_3d
+
+struct ggml_tensor * ggml_view_3d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        size_t                nb1,
+        size_t                nb2,
+        size_t                offset) {
+    if (a->grad) {
+        assert(false); // gradient propagation is not supported
+    }
+
+    const int ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, 1 };
+
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 3, ne, (char *) a->data + offset);
+
+    result->nb[1] = nb1;
+    result->nb[2] = nb2;
+    result->nb[3] = result->nb[2]*ne2;
+
+    result->op   = GGML_OP_VIEW;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = NULL;
+
+    return result;
+}
+
+// ggml_view_4d
+
+struct ggml_tensor * ggml_view_4d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        int                   ne3,
+        size_t                nb1,
+        size_t                nb2,
+        size_t                nb3,
+        size_t                offset) {
+    if (a->grad) {
+        assert(false); // gradient propagation is not supported
+    }
+
+    const int ne[GGML_MAX_DIMS] = { ne0, ne1, ne2, ne3 };
+
+    struct ggml_tensor * result = ggml_new_tensor_impl(ctx, a->type, 4, ne, (char *) a->data + offset);
+
+    result->nb[1] = nb1;
+    result->nb[2] = nb2;
+    result->nb[3] = nb3;
+
+    result->op   = GGML_OP_VIEW;
+    result->grad = NULL;
+    result->src0 = a;
+    result->src1 = NULL;
+
+    return result;
+}
+
 // ggml_permute
 
 struct ggml_tensor * ggml_permute(
@@ -2966,8 +3443,16 @@ struct ggml_tensor * ggml_diag_mask_inf(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch.data = NULL;
+
     struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 1);
-    ((int32_t *) b->data)[0] = n_past;
+
+    ctx->scratch = ctx->scratch_save;
+
+    if (!ctx->measure) {
+        ((int32_t *) b->data)[0] = n_past;
+    }
 
     result->op   = GGML_OP_DIAG_MASK_INF;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -3021,10 +3506,18 @@ struct ggml_tensor * ggml_rope(
     //struct ggml_tensor * result = inplace ? ggml_view_tensor(ctx, a) : ggml_dup_tensor(ctx, a);
     struct ggml_tensor * result = ggml_view_tensor(ctx, a);
 
+    ctx->scratch_save = ctx->scratch;
+    ctx->scratch.data = NULL;
+
     struct ggml_tensor * b = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, 3);
-    ((int32_t *) b->data)[0] = n_past;
-    ((int32_t *) b->data)[1] = n_dims;
-    ((int32_t *) b->data)[2] = mode;
+
+    ctx->scratch = ctx->scratch_save;
+
+    if (!ctx->measure) {
+        ((int32_t *) b->data)[0] = n_past;
+        ((int32_t *) b->data)[1] = n_dims;
+        ((int32_t *) b->data)[2] = mode;
+    }
 
     result->op   = GGML_OP_ROPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
@@ -3200,7 +3693,6 @@ void ggml_compute_forward_dup_f32(
         const struct ggml_tensor * src0,
         struct ggml_tensor * dst) {
     GGML_ASSERT(params->ith == 0);
-    GGML_ASSERT(ggml_is_contiguous(dst));
     GGML_ASSERT(ggml_nelements(dst) == ggml_nelements(src0));
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -3217,6 +3709,46 @@ void ggml_compute_forward_dup_f32(
     const size_t nb02 = src0->nb[2];
     const size_t nb03 = src0->nb[3];
 
+    if (!ggml_is_contiguous(dst)) {
+        // the rows of dst are strided - walk the rows of src0 and dst in order
+        GGML_ASSERT(src0->nb[0] == sizeof(float));
+        GGML_ASSERT(dst->nb[0] == GGML_TYPE_SIZE[dst->type]);
+        GGML_ASSERT(dst->ne[0] == ne00);
+
+        int i1 = 0;
+        int i2 = 0;
+        int i3 = 0;
+
+        for (int i03 = 0; i03 < ne03; i03++) {
+            for (int i02 = 0; i02 < ne02; i02++) {
+                for (int i01 = 0; i01 < ne01; i01++) {
+                    const float * src0_ptr = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                    char * dst_ptr = (char *) dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3];
+
+                    if (dst->type == GGML_TYPE_F32) {
+                        memcpy(dst_ptr, src0_ptr, ne00*sizeof(float));
+                    } else if (dst->type == GGML_TYPE_F16) {
+                        for (int i00 = 0; i00 < ne00; i00++) {
+                            ((ggml_fp16_t *) dst_ptr)[i00] = GGML_FP32_TO_FP16(src0_ptr[i00]);
+                        }
+                    } else {
+                        GGML_ASSERT(false); // TODO: implement
+                    }
+
+                    if (++i1 == dst->ne[1]) {
+                        i1 = 0;
+                        if (++i2 == dst->ne[2]) {
+                            i2 = 0;
+                            i3++;
+                        }
+                    }
+                }
+            }
+        }
+
+        return;
+    }
+
     if (ggml_is_contiguous(src0) && src0->type == dst->type) {
         memcpy(dst->data, src0->data, ggml_nelements(dst) * GGML_TYPE_SIZE[src0->type]);
         return;
@@ -3315,6 +3847,8 @@ void ggml_compute_forward_dup(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -3391,6 +3925,8 @@ void ggml_compute_forward_add(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3441,6 +3977,8 @@ void ggml_compute_forward_sub(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3491,6 +4029,8 @@ void ggml_compute_forward_mul(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3541,6 +4081,8 @@ void ggml_compute_forward_div(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3587,6 +4129,8 @@ void ggml_compute_forward_sqr(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3633,6 +4177,8 @@ void ggml_compute_forward_sqrt(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3691,6 +4237,8 @@ void ggml_compute_forward_sum(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3768,6 +4316,8 @@ void ggml_compute_forward_mean(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3830,6 +4380,8 @@ void ggml_compute_forward_repeat(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3876,6 +4428,8 @@ void ggml_compute_forward_abs(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3922,6 +4476,8 @@ void ggml_compute_forward_sgn(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -3968,6 +4524,8 @@ void ggml_compute_forward_neg(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4014,6 +4572,8 @@ void ggml_compute_forward_step(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4060,6 +4620,8 @@ void ggml_compute_forward_relu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4123,6 +4685,8 @@ void ggml_compute_forward_gelu(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4205,6 +4769,8 @@ void ggml_compute_forward_norm(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4739,48 +5305,177 @@ void ggml_compute_forward_mul_mat_f16_f32(
         const int wo = (ne + CACHE_LINE_SIZE_F32)*ith;
         ggml_fp16_t * const wdata = params->wdata;
 
-        for (int i13 = 0; i13 < ne13; ++i13) {
-            for (int i12 = 0; i12 < ne12; ++i12) {
-                for (int i11 = 0; i11 < ne11; ++i11) {
-                    // dst indices
-                    const int i1 = i11;
-                    const int i2 = i12;
-                    const int i3 = i13;
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    // dst indices
+                    const int i1 = i11;
+                    const int i2 = i12;
+                    const int i3 = i13;
+
+                    ggml_fp16_t * dst_row = wdata + wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0;
+
+                    for (int ic = ic0; ic < ic1; ++ic) {
+                        // src1 indices
+                        const int i10 = ic;
+
+                        // src0 indices
+                        const int i03 = i13;
+                        const int i02 = i12;
+                        const int i00 = ic;
+
+                        assert(sizeof(ggml_fp16_t)*(wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0 + ne01) <= params->wsize);
+
+                        ggml_fp16_t * src0_col =  (ggml_fp16_t *) ((char *) src0->data + (i00*nb00 + i02*nb02 + i03*nb03));
+                        float         src1_val = *      (float *) ((char *) src1->data + (i10*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+
+                        ggml_vec_mad_f16(ne01, dst_row, src0_col, src1_val);
+                    }
+                }
+            }
+        }
+    }
+
+    //int64_t t1 = ggml_time_us();
+    //static int64_t acc = 0;
+    //acc += t1 - t0;
+    //if (t1 - t0 > 10) {
+    //    printf("\n");
+    //    printf("ne00 = %5d, ne01 = %5d, ne02 = %5d, ne03 = %5d\n", ne00, ne01, ne02, ne03);
+    //    printf("nb00 = %5d, nb01 = %5d, nb02 = %5d, nb03 = %5d\n", nb00, nb01, nb02, nb03);
+    //    printf("ne10 = %5d, ne11 = %5d, ne12 = %5d, ne13 = %5d\n", ne10, ne11, ne12, ne13);
+
+    //    printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX task %d/%d: %d us, acc = %d\n", ith, nth, (int) (t1 - t0), (int) acc);
+    //}
+}
+
+void ggml_compute_forward_mul_mat_q_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    const int ne00 = src0->ne[0];
+    const int ne01 = src0->ne[1];
+    const int ne02 = src0->ne[2];
+    const int ne03 = src0->ne[3];
+
+    const int ne10 = src1->ne[0];
+    const int ne11 = src1->ne[1];
+    const int ne12 = src1->ne[2];
+    const int ne13 = src1->ne[3];
+
+    const int ne0  = dst->ne[0];
+    const int ne1  = dst->ne[1];
+    const int ne2  = dst->ne[2];
+    const int ne3  = dst->ne[3];
+
+    const int nb00 = src0->nb[0];
+    const int nb01 = src0->nb[1];
+    const int nb02 = src0->nb[2];
+    const int nb03 = src0->nb[3];
+
+    const int nb10 = src1->nb[0];
+    const int nb11 = src1->nb[1];
+    const int nb12 = src1->nb[2];
+    const int nb13 = src1->nb[3];
+
+    const int nb0  = dst->nb[0];
+    const int nb1  = dst->nb[1];
+    const int nb2  = dst->nb[2];
+    const int nb3  = dst->nb[3];
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_ASSERT(ne02 == ne12);
+    GGML_ASSERT(ne03 == ne13);
+    GGML_ASSERT(ne2  == ne12);
+    GGML_ASSERT(ne3  == ne13);
+
+    const enum ggml_type type = src0->type;
+
+    // we don't support transposed or permuted src0 and src1
+    GGML_ASSERT(nb00 == (int) GGML_TYPE_SIZE[type]);
+    GGML_ASSERT(nb10 == sizeof(float));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    GGML_ASSERT(ne0 == ne01);
+    GGML_ASSERT(ne1 == ne11);
+    GGML_ASSERT(ne2 == ne02);
+    GGML_ASSERT(ne3 == ne03);
+
+    GGML_ASSERT(ne00 % QK == 0);
+
+    // the rows of src1 are quantized to q8_0, so that the dot products are computed with integer arithmetic
+    const size_t row_size = (ne10/QK)*sizeof(block_q8_0);
+
+    if (params->type == GGML_TASK_INIT) {
+        char * wdata = params->wdata;
+
+        for (int i13 = 0; i13 < ne13; ++i13) {
+            for (int i12 = 0; i12 < ne12; ++i12) {
+                for (int i11 = 0; i11 < ne11; ++i11) {
+                    quantize_row_q8_0((float *) ((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
+                    wdata += row_size;
+                }
+            }
+        }
+
+        GGML_ASSERT((size_t) (wdata - (char *) params->wdata) <= params->wsize);
+
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const vec_dot_q_t vec_dot_q = quantize_fns[type].vec_dot_q;
+
+    // parallelize by src0 rows using vec_dot_q
+
+    // total rows in src0
+    const int nr = ne01*ne02*ne03;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const char * wdata = params->wdata;
 
-                    ggml_fp16_t * dst_row = wdata + wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0;
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // src0 indices
+        const int i03 = ir/(ne02*ne01);
+        const int i02 = (ir - i03*ne02*ne01)/ne01;
+        const int i01 = (ir - i03*ne02*ne01 - i02*ne01);
 
-                    for (int ic = ic0; ic < ic1; ++ic) {
-                        // src1 indices
-                        const int i10 = ic;
+        const int i13 = i03;
+        const int i12 = i02;
 
-                        // src0 indices
-                        const int i03 = i13;
-                        const int i02 = i12;
-                        const int i00 = ic;
+        const int i0 = i01;
+        const int i2 = i02;
+        const int i3 = i03;
 
-                        assert(sizeof(ggml_fp16_t)*(wo + i3*ne2*ne1*ne0 + i2*ne1*ne0 + i1*ne0 + ne01) <= params->wsize);
+        const void * src0_row = (const void *) ((char *) src0->data + (i01*nb01 + i02*nb02 + i03*nb03));
+        const char * src1_col = wdata + (i13*ne12*ne11 + i12*ne11 + 0)*row_size;
 
-                        ggml_fp16_t * src0_col =  (ggml_fp16_t *) ((char *) src0->data + (i00*nb00 + i02*nb02 + i03*nb03));
-                        float         src1_val = *      (float *) ((char *) src1->data + (i10*nb10 + i11*nb11 + i12*nb12 + i13*nb13));
+        float * dst_col = (float *) ((char *) dst->data + (i0*nb0 + 0*nb1 + i2*nb2 + i3*nb3));
 
-                        ggml_vec_mad_f16(ne01, dst_row, src0_col, src1_val);
-                    }
-                }
-            }
+        for (int ic = 0; ic < ne11; ++ic) {
+            vec_dot_q(ne00, &dst_col[ic*ne0], src0_row, (const void *) (src1_col + ic*row_size));
         }
     }
-
-    //int64_t t1 = ggml_time_us();
-    //static int64_t acc = 0;
-    //acc += t1 - t0;
-    //if (t1 - t0 > 10) {
-    //    printf("\n");
-    //    printf("ne00 = %5d, ne01 = %5d, ne02 = %5d, ne03 = %5d\n", ne00, ne01, ne02, ne03);
-    //    printf("nb00 = %5d, nb01 = %5d, nb02 = %5d, nb03 = %5d\n", nb00, nb01, nb02, nb03);
-    //    printf("ne10 = %5d, ne11 = %5d, ne12 = %5d, ne13 = %5d\n", ne10, ne11, ne12, ne13);
-
-    //    printf("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX task %d/%d: %d us, acc = %d\n", ith, nth, (int) (t1 - t0), (int) acc);
-    //}
 }
 
 void ggml_compute_forward_mul_mat(
@@ -4789,6 +5484,11 @@ void ggml_compute_forward_mul_mat(
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     switch (src0->type) {
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_mul_mat_q_f32(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_F16:
             {
                 ggml_compute_forward_mul_mat_f16_f32(params, src0, src1, dst);
@@ -4858,6 +5558,8 @@ void ggml_compute_forward_scale(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -4918,6 +5620,35 @@ void ggml_compute_forward_transpose(
 
 // ggml_compute_forward_get_rows
 
+void ggml_compute_forward_get_rows_q(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst) {
+    assert(params->ith == 0);
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nelements(src1);
+
+    const dequantize_row_q_t dequantize_row_q = quantize_fns[src0->type].dequantize_row_q;
+
+    assert( dst->ne[0] == nc);
+    assert( dst->ne[1] == nr);
+    assert(src0->nb[0] == GGML_TYPE_SIZE[src0->type]);
+
+    for (int i = 0; i < nr; ++i) {
+        const int r = ((int32_t *) src1->data)[i];
+
+        dequantize_row_q(
+                (const void *) ((char *) src0->data + r*src0->nb[1]),
+                     (float *) ((char *)  dst->data + i*dst->nb[1]), nc);
+    }
+}
+
 void ggml_compute_forward_get_rows_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -4979,6 +5710,11 @@ void ggml_compute_forward_get_rows(
         const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     switch (src0->type) {
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
+            {
+                ggml_compute_forward_get_rows_q(params, src0, src1, dst);
+            } break;
         case GGML_TYPE_F16:
             {
                 ggml_compute_forward_get_rows_f16(params, src0, src1, dst);
@@ -5049,6 +5785,8 @@ void ggml_compute_forward_diag_mask_inf(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5142,6 +5880,8 @@ void ggml_compute_forward_soft_max(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5222,6 +5962,8 @@ void ggml_compute_forward_rope(
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
         case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -5488,6 +6230,8 @@ void ggml_compute_forward_conv_1d_1s(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -5754,6 +6498,8 @@ void ggml_compute_forward_conv_1d_2s(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -6150,6 +6896,8 @@ void ggml_compute_forward_flash_attn(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -6359,6 +7107,8 @@ void ggml_compute_forward_flash_ff(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q8_0:
         case GGML_TYPE_COUNT:
             {
                 assert(false);
@@ -6798,12 +7548,13 @@ void ggml_visit_parents(struct ggml_cgraph * cgraph, struct ggml_tensor * node)
 
     if (node->op == GGML_OP_NONE && node->grad == NULL) {
         // reached a leaf node, not part of the gradient graph (e.g. a constant)
-        assert(cgraph->n_leafs < GGML_MAX_NODES);
+        // the graph is often a local variable, a graph that is too large must not write past its arrays even with NDEBUG
+        GGML_ASSERT(cgraph->n_leafs < GGML_MAX_NODES);
 
         cgraph->leafs[cgraph->n_leafs] = node;
         cgraph->n_leafs++;
     } else {
-        assert(cgraph->n_nodes < GGML_MAX_NODES);
+        GGML_ASSERT(cgraph->n_nodes < GGML_MAX_NODES);
 
         cgraph->nodes[cgraph->n_nodes] = node;
         cgraph->grads[cgraph->n_nodes] = node->grad;
@@ -6840,6 +7591,7 @@ struct ggml_cgraph ggml_build_forward(struct ggml_tensor * tensor) {
         /*.n_nodes      =*/ 0,
         /*.n_leafs      =*/ 0,
         /*.n_threads    =*/ 0,
+        /*.threadpool   =*/ NULL,
         /*.work_size    =*/ 0,
         /*.work         =*/ NULL,
         /*.nodes        =*/ { NULL },
@@ -6896,7 +7648,8 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 //
 // thread data
 //
-// synchronization is done via busy loops
+// synchronization is done via busy loops that fall back to sleeping on a condition variable
+// once the spin budget (ggml_compute_state_shared.spin_us) has been exhausted
 // I tried using spin locks, but not sure how to use them correctly - the things I tried were slower than busy loops
 //
 
@@ -6946,13 +7699,88 @@ struct ggml_compute_state_shared {
     ggml_lock_t spin;
 
     int n_threads;
+    int spin_us; // busy-wait time before a waiting thread goes to sleep (< 0 - never sleep)
 
     // synchronization primitives
     atomic_int  n_ready;
-    atomic_bool has_work;
+    atomic_int  has_work;
     atomic_bool stop; // stop all threads
+
+    // used by the threads that have exhausted their spin budget
+    atomic_int      n_sleeping;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
 };
 
+static void ggml_compute_shared_init(struct ggml_compute_state_shared * shared) {
+    ggml_lock_init(&shared->spin);
+
+    atomic_store(&shared->n_sleeping, 0);
+
+    pthread_mutex_init(&shared->mutex, NULL);
+    pthread_cond_init (&shared->cond,  NULL);
+}
+
+static void ggml_compute_shared_free(struct ggml_compute_state_shared * shared) {
+    ggml_lock_destroy(&shared->spin);
+
+    pthread_cond_destroy (&shared->cond);
+    pthread_mutex_destroy(&shared->mutex);
+}
+
+// wait until *ptr == value or until the computation is stopped
+// returns true if the computation has been stopped
+static bool ggml_compute_wait(struct ggml_compute_state_shared * shared, atomic_int * ptr, int value) {
+    const int spin_us = shared->spin_us;
+
+    int64_t t_start = 0;
+
+    // spin
+    for (int i = 0; ; i++) {
+        if (atomic_load(&shared->stop)) {
+            return true;
+        }
+        if (atomic_load(ptr) == value) {
+            return false;
+        }
+        if (spin_us >= 0 && (i & 63) == 0) {
+            const int64_t t_now = ggml_time_us();
+            if (i == 0) {
+                t_start = t_now;
+            }
+            if (t_now - t_start >= spin_us) {
+                break;
+            }
+        }
+        ggml_lock_lock  (&shared->spin);
+        ggml_lock_unlock(&shared->spin);
+    }
+
+    // park
+    // n_sleeping is incremented before the final check, so ggml_compute_notify() can not miss this thread
+    pthread_mutex_lock(&shared->mutex);
+    atomic_fetch_add(&shared->n_sleeping, 1);
+
+    bool stop;
+    while (!(stop = atomic_load(&shared->stop)) && atomic_load(ptr) != value) {
+        pthread_cond_wait(&shared->cond, &shared->mutex);
+    }
+
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+    pthread_mutex_unlock(&shared->mutex);
+
+    return stop;
+}
+
+// wake up the parked threads - must be called after each change of the synchronization state
+static void ggml_compute_notify(struct ggml_compute_state_shared * shared) {
+    if (atomic_load(&shared->n_sleeping) > 0) {
+        pthread_mutex_lock(&shared->mutex);
+        pthread_cond_broadcast(&shared->cond);
+        pthread_mutex_unlock(&shared->mutex);
+    }
+}
+
 struct ggml_compute_state {
     pthread_t thrd;
 
@@ -6960,6 +7788,24 @@ struct ggml_compute_state {
     struct ggml_tensor * node;
 
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool; // NULL if the thread lives only for a single graph computation
+};
+
+struct ggml_threadpool {
+    int n_threads;
+    int spin_us;
+
+    // the workers sleep on the condition variable in-between graph computations
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    int  n_graph; // incremented each time a new graph is submitted to the workers
+    bool stop;    // terminate the worker threads
+
+    atomic_int n_active; // number of workers that are still busy with the current graph
+
+    struct ggml_compute_state_shared shared;
+    struct ggml_compute_state * workers;
 };
 
 // function used by each compute thread
@@ -6979,25 +7825,19 @@ thread_ret_t ggml_graph_compute_thread(void * data) {
     while (true) {
         if (atomic_fetch_add(&state->shared->n_ready, 1) == n_threads - 1) {
             atomic_store(&state->shared->has_work, false);
+            ggml_compute_notify(state->shared);
         } else {
-            while (atomic_load(&state->shared->has_work)) {
-                if (atomic_load(&state->shared->stop)) {
-                    return 0;
-                }
-                ggml_lock_lock  (&state->shared->spin);
-                ggml_lock_unlock(&state->shared->spin);
+            if (ggml_compute_wait(state->shared, &state->shared->has_work, false)) {
+                return 0;
             }
         }
 
         atomic_fetch_sub(&state->shared->n_ready, 1);
+        ggml_compute_notify(state->shared);
 
         // wait for work
-        while (!atomic_load(&state->shared->has_work)) {
-            if (atomic_load(&state->shared->stop)) {
-                return 0;
-            }
-            ggml_lock_lock  (&state->shared->spin);
-            ggml_lock_unlock(&state->shared->spin);
+        if (ggml_compute_wait(state->shared, &state->shared->has_work, true)) {
+            return 0;
         }
 
         // check if we should stop
@@ -7016,231 +7856,378 @@ thread_ret_t ggml_graph_compute_thread(void * data) {
     return 0;
 }
 
-void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
-    if (cgraph->n_threads <= 0) {
-        cgraph->n_threads = 8;
+// function used by the threads of a ggml_threadpool
+thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * pool = state->pool;
+
+    int n_graph = 0;
+
+    while (true) {
+        // wait for the next graph
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->n_graph == n_graph && !pool->stop) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        n_graph = pool->n_graph;
+        const bool stop = pool->stop;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (stop) {
+            break;
+        }
+
+        ggml_graph_compute_thread(state);
+
+        atomic_fetch_sub(&pool->n_active, 1);
     }
 
-    const int n_threads = cgraph->n_threads;
+    return 0;
+}
 
-    struct ggml_compute_state_shared state_shared = {
-        /*.spin      =*/ GGML_LOCK_INITIALIZER,
-        /*.n_threads =*/ n_threads,
-        /*.n_ready   =*/ 0,
-        /*.has_work  =*/ false,
-        /*.stop      =*/ false,
-    };
-    struct ggml_compute_state * workers = n_threads > 1 ? alloca(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = 8;
+    }
 
-    // create thread pool
-    if (n_threads > 1) {
-        ggml_lock_init(&state_shared.spin);
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
 
-        atomic_store(&state_shared.has_work, true);
+    pool->n_threads = n_threads;
+    pool->spin_us   = GGML_DEFAULT_SPIN_US;
+    pool->n_graph   = 0;
+    pool->stop      = false;
+    pool->workers   = n_threads > 1 ? malloc(sizeof(struct ggml_compute_state)*(n_threads - 1)) : NULL;
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .params = {
-                    .type  = GGML_TASK_COMPUTE,
-                    .ith   = j + 1,
-                    .nth   = n_threads,
-                    .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
-                    .wdata = cgraph->work ? cgraph->work->data : NULL,
-                },
-                .node   = NULL,
-                .shared = &state_shared,
-            };
-            int rc = pthread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            assert(rc == 0);
-            UNUSED(rc);
-        }
+    atomic_store(&pool->n_active, 0);
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond,  NULL);
+
+    ggml_compute_shared_init(&pool->shared);
+
+    for (int j = 0; j < n_threads - 1; j++) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .node   = NULL,
+            .shared = &pool->shared,
+            .pool   = pool,
+        };
+        int rc = pthread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+        assert(rc == 0);
+        UNUSED(rc);
     }
 
-    // initialize tasks + work buffer
-    {
-        size_t work_size = 0;
-
-        // thread scheduling for the different operations
-        for (int i = 0; i < cgraph->n_nodes; i++) {
-            struct ggml_tensor * node = cgraph->nodes[i];
-
-            switch (node->op) {
-                case GGML_OP_DUP:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_ADD:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_SUB:
-                case GGML_OP_MUL:
-                case GGML_OP_DIV:
-                case GGML_OP_SQR:
-                case GGML_OP_SQRT:
-                case GGML_OP_SUM:
-                case GGML_OP_MEAN:
-                case GGML_OP_REPEAT:
-                case GGML_OP_ABS:
-                case GGML_OP_SGN:
-                case GGML_OP_NEG:
-                case GGML_OP_STEP:
-                case GGML_OP_RELU:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_GELU:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_NORM:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        // TODO: use different scheduling for different matrix sizes
-                        node->n_tasks = n_threads;
-
-                        size_t cur = 0;
-
-                        // TODO: better way to determine if the matrix is transposed
-                        if (node->src0->nb[1] < node->src0->nb[0]) {
-                            cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
-                        } else {
-                            if (node->src0->type == GGML_TYPE_F16 &&
-                                node->src1->type == GGML_TYPE_F32) {
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                                if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
-                                    cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
-                                } else {
-                                    cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-                                }
-#else
-                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
-#endif
-                            } else if (node->src0->type == GGML_TYPE_F32 &&
-                                       node->src1->type == GGML_TYPE_F32) {
-                                cur = 0;
-                            } else {
-                                GGML_ASSERT(false);
-                            }
-                        }
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 0; j < pool->n_threads - 1; j++) {
+        int rc = pthread_join(pool->workers[j].thrd, NULL);
+        assert(rc == 0);
+        UNUSED(rc);
+    }
+
+    ggml_compute_shared_free(&pool->shared);
+
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
+void ggml_threadpool_set_spin_us(struct ggml_threadpool * pool, int spin_us) {
+    pool->spin_us = spin_us;
+}
+
+// the number of tasks of each node and the work buffer of the graph, which is allocated in the context memory
+static void ggml_graph_compute_plan(struct ggml_context * ctx, struct ggml_cgraph * cgraph, const int n_threads) {
+    size_t work_size = 0;
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_SCALE:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_CPY:
-                case GGML_OP_RESHAPE:
-                case GGML_OP_VIEW:
-                case GGML_OP_PERMUTE:
-                case GGML_OP_TRANSPOSE:
-                case GGML_OP_GET_ROWS:
-                case GGML_OP_DIAG_MASK_INF:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                    {
-                        node->n_tasks = n_threads;
-                    } break;
-                case GGML_OP_ROPE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_CONV_1D_1S:
-                case GGML_OP_CONV_1D_2S:
-                    {
-                        node->n_tasks = n_threads;
-
-                        GGML_ASSERT(node->src0->ne[3] == 1);
-                        GGML_ASSERT(node->src1->ne[2] == 1);
-                        GGML_ASSERT(node->src1->ne[3] == 1);
-
-                        size_t cur = 0;
-                        const int nk = node->src0->ne[0];
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
+        switch (node->op) {
+            case GGML_OP_DUP:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_ADD:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_SUB:
+            case GGML_OP_MUL:
+            case GGML_OP_DIV:
+            case GGML_OP_SQR:
+            case GGML_OP_SQRT:
+            case GGML_OP_SUM:
+            case GGML_OP_MEAN:
+            case GGML_OP_REPEAT:
+            case GGML_OP_ABS:
+            case GGML_OP_SGN:
+            case GGML_OP_NEG:
+            case GGML_OP_STEP:
+            case GGML_OP_RELU:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_GELU:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_NORM:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    // TODO: use different scheduling for different matrix sizes
+                    node->n_tasks = n_threads;
+
+                    size_t cur = 0;
+
+                    // TODO: better way to determine if the matrix is transposed
+                    if (node->src0->nb[1] < node->src0->nb[0]) {
+                        cur = ggml_nbytes(node)*node->n_tasks; // TODO: this can become (n_tasks-1)
+                    } else if (ggml_is_quantized(node->src0->type)) {
+                        // src1 quantized to q8_0
+                        cur = (GGML_TYPE_SIZE[GGML_TYPE_Q8_0]*ggml_nelements(node->src1))/GGML_BLCK_SIZE[GGML_TYPE_Q8_0];
+                    } else {
                         if (node->src0->type == GGML_TYPE_F16 &&
                             node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(ggml_fp16_t)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                            if (ggml_compute_forward_mul_mat_use_blas(node->src0, node->src1, node)) {
+                                cur = sizeof(float)*(node->src0->ne[0]*node->src0->ne[1]);
+                            } else {
+                                cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+                            }
+#else
+                            cur = sizeof(ggml_fp16_t)*ggml_nelements(node->src1);
+#endif
                         } else if (node->src0->type == GGML_TYPE_F32 &&
                                    node->src1->type == GGML_TYPE_F32) {
-                            cur = sizeof(float)*(
-                                    nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
-                                    ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
-                                    );
+                            cur = 0;
                         } else {
                             GGML_ASSERT(false);
                         }
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_ATTN:
-                    {
-                        node->n_tasks = n_threads;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_CPY:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+            case GGML_OP_GET_ROWS:
+            case GGML_OP_DIAG_MASK_INF:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_SOFT_MAX:
+                {
+                    node->n_tasks = n_threads;
+                } break;
+            case GGML_OP_ROPE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_CONV_1D_1S:
+            case GGML_OP_CONV_1D_2S:
+                {
+                    node->n_tasks = n_threads;
+
+                    GGML_ASSERT(node->src0->ne[3] == 1);
+                    GGML_ASSERT(node->src1->ne[2] == 1);
+                    GGML_ASSERT(node->src1->ne[3] == 1);
+
+                    size_t cur = 0;
+                    const int nk = node->src0->ne[0];
+
+                    if (node->src0->type == GGML_TYPE_F16 &&
+                        node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(ggml_fp16_t)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else if (node->src0->type == GGML_TYPE_F32 &&
+                               node->src1->type == GGML_TYPE_F32) {
+                        cur = sizeof(float)*(
+                                nk*ggml_up32(node->src0->ne[1])*node->src0->ne[2] +
+                                ( 2*(nk/2) + node->src1->ne[0])*node->src1->ne[1]
+                                );
+                    } else {
+                        GGML_ASSERT(false);
+                    }
 
-                        size_t cur = 0;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN:
+                {
+                    node->n_tasks = n_threads;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_FLASH_FF:
-                    {
-                        node->n_tasks = n_threads;
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        size_t cur = 0;
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_FF:
+                {
+                    node->n_tasks = n_threads;
 
-                        if (node->src1->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    size_t cur = 0;
 
-                        if (node->src1->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
-                        }
+                    if (node->src1->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
 
-                        work_size = MAX(work_size, cur);
-                    } break;
-                case GGML_OP_NONE:
-                    {
-                        node->n_tasks = 1;
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        assert(false);
-                    } break;
-            };
+                    if (node->src1->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*node->src1->ne[1]*node->n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*node->src1->ne[1]*node->n_tasks; // this is overestimated by x2
+                    }
+
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_NONE:
+                {
+                    node->n_tasks = 1;
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    assert(false);
+                } break;
+        };
+    }
+
+    if (cgraph->work != NULL && work_size > cgraph->work_size) {
+        assert(false); // TODO: better handling
+    }
+
+    if (work_size > 0 && cgraph->work == NULL) {
+        cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+
+        GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
+        cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+    }
+}
+
+void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph) {
+    if (cgraph->n_threads <= 0) {
+        cgraph->n_threads = 8;
+    }
+
+    struct ggml_threadpool * pool = cgraph->threadpool;
+
+    // the number of threads is determined by the pool, if one is provided
+    if (pool) {
+        cgraph->n_threads = pool->n_threads;
+    }
+
+    const int n_threads = cgraph->n_threads;
+
+    // a measure context only adds the work buffer to the memory of the graph
+    if (ctx->measure) {
+        ggml_graph_compute_plan(ctx, cgraph, n_threads);
+        return;
+    }
+
+    // the mutex and the condition variable are initialized by ggml_compute_shared_init() when threads are started
+    struct ggml_compute_state_shared state_shared_local = {
+        .spin       = GGML_LOCK_INITIALIZER,
+        .n_threads  = n_threads,
+        .spin_us    = GGML_DEFAULT_SPIN_US,
+        .n_ready    = 0,
+        .has_work   = false,
+        .stop       = false,
+        .n_sleeping = 0,
+    };
+
+    struct ggml_compute_state_shared * state_shared = pool ? &pool->shared : &state_shared_local;
+
+    struct ggml_compute_state * workers = NULL;
+    if (n_threads > 1) {
+        workers = pool ? pool->workers : alloca(sizeof(struct ggml_compute_state)*(n_threads - 1));
+    }
+
+    // create thread pool or wake up the threads of the persistent pool
+    if (n_threads > 1) {
+        if (pool) {
+            state_shared->n_threads = n_threads;
+            state_shared->spin_us   = pool->spin_us;
+            atomic_store(&state_shared->n_ready, 0);
+            atomic_store(&state_shared->stop,    false);
+        } else {
+            ggml_compute_shared_init(state_shared);
         }
 
-        if (cgraph->work != NULL && work_size > cgraph->work_size) {
-            assert(false); // TODO: better handling
+        atomic_store(&state_shared->has_work, true);
+
+        for (int j = 0; j < n_threads - 1; j++) {
+            // the thread and the pool of a persistent worker are not written, the worker reads them while it waits
+            if (!pool) {
+                workers[j].thrd = 0;
+                workers[j].pool = NULL;
+            }
+
+            workers[j].params = (struct ggml_compute_params) {
+                .type  = GGML_TASK_COMPUTE,
+                .ith   = j + 1,
+                .nth   = n_threads,
+                .wsize = cgraph->work ? ggml_nbytes(cgraph->work) : 0,
+                .wdata = cgraph->work ? cgraph->work->data : NULL,
+            };
+            workers[j].node   = NULL;
+            workers[j].shared = state_shared;
         }
 
-        if (work_size > 0 && cgraph->work == NULL) {
-            cgraph->work_size = work_size + CACHE_LINE_SIZE*(n_threads - 1);
+        if (pool) {
+            atomic_store(&pool->n_active, n_threads - 1);
 
-            GGML_PRINT_DEBUG("%s: allocating work buffer for graph (%zu bytes)\n", __func__, cgraph->work_size);
-            cgraph->work = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, cgraph->work_size);
+            pthread_mutex_lock(&pool->mutex);
+            pool->n_graph++;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->mutex);
+        } else {
+            for (int j = 0; j < n_threads - 1; j++) {
+                int rc = pthread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                assert(rc == 0);
+                UNUSED(rc);
+            }
         }
     }
 
+    // initialize tasks + work buffer
+    ggml_graph_compute_plan(ctx, cgraph, n_threads);
+
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
@@ -7270,14 +8257,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
         // COMPUTE
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+            if (atomic_fetch_add(&state_shared->n_ready, 1) == n_threads - 1) {
+                atomic_store(&state_shared->has_work, false);
+                ggml_compute_notify(state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->has_work, false);
 
             // launch thread pool
             for (int j = 0; j < n_threads - 1; j++) {
@@ -7291,14 +8276,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 workers[j].node = node;
             }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+            atomic_fetch_sub(&state_shared->n_ready, 1);
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->n_ready, 0);
 
-            atomic_store(&state_shared.has_work, true);
+            atomic_store(&state_shared->has_work, true);
+            ggml_compute_notify(state_shared);
         }
 
         params.type = GGML_TASK_COMPUTE;
@@ -7306,33 +8289,26 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
         // wait for thread pool
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+            if (atomic_fetch_add(&state_shared->n_ready, 1) == n_threads - 1) {
+                atomic_store(&state_shared->has_work, false);
+                ggml_compute_notify(state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->has_work, false);
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+            atomic_fetch_sub(&state_shared->n_ready, 1);
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->n_ready, 0);
         }
 
         // FINALIZE
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+            if (atomic_fetch_add(&state_shared->n_ready, 1) == n_threads - 1) {
+                atomic_store(&state_shared->has_work, false);
+                ggml_compute_notify(state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->has_work, false);
 
             // launch thread pool
             for (int j = 0; j < n_threads - 1; j++) {
@@ -7346,14 +8322,12 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
                 workers[j].node = node;
             }
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+            atomic_fetch_sub(&state_shared->n_ready, 1);
 
-            while (atomic_load(&state_shared.n_ready) > 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->n_ready, 0);
 
-            atomic_store(&state_shared.has_work, true);
+            atomic_store(&state_shared->has_work, true);
+            ggml_compute_notify(state_shared);
         }
 
         params.type = GGML_TASK_FINALIZE;
@@ -7361,21 +8335,16 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
         // wait for thread pool
         if (node->n_tasks > 1) {
-            if (atomic_fetch_add(&state_shared.n_ready, 1) == n_threads - 1) {
-                atomic_store(&state_shared.has_work, false);
+            if (atomic_fetch_add(&state_shared->n_ready, 1) == n_threads - 1) {
+                atomic_store(&state_shared->has_work, false);
+                ggml_compute_notify(state_shared);
             }
 
-            while (atomic_load(&state_shared.has_work)) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->has_work, false);
 
-            atomic_fetch_sub(&state_shared.n_ready, 1);
+            atomic_fetch_sub(&state_shared->n_ready, 1);
 
-            while (atomic_load(&state_shared.n_ready) != 0) {
-                ggml_lock_lock  (&state_shared.spin);
-                ggml_lock_unlock(&state_shared.spin);
-            }
+            ggml_compute_wait(state_shared, &state_shared->n_ready, 0);
         }
 
         // performance stats (node)
@@ -7391,16 +8360,24 @@ void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph)
 
     // join thread pool
     if (n_threads > 1) {
-        atomic_store(&state_shared.stop, true);
-        atomic_store(&state_shared.has_work, true);
+        atomic_store(&state_shared->stop, true);
+        atomic_store(&state_shared->has_work, true);
+        ggml_compute_notify(state_shared);
+
+        if (pool) {
+            // the persistent threads go back to sleep - wait until none of them touches the shared state anymore
+            while (atomic_load(&pool->n_active) > 0) {
+                sched_yield();
+            }
+        } else {
+            for (int j = 0; j < n_threads - 1; j++) {
+                int rc = pthread_join(workers[j].thrd, NULL);
+                assert(rc == 0);
+                UNUSED(rc);
+            }
 
-        for (int j = 0; j < n_threads - 1; j++) {
-            int rc = pthread_join(workers[j].thrd, NULL);
-            assert(rc == 0);
-            UNUSED(rc);
+            ggml_compute_shared_free(state_shared);
         }
-
-        ggml_lock_destroy(&state_shared.spin);
     }
 
     // performance stats (graph)
@@ -8241,6 +9218,7 @@ enum ggml_opt_result ggml_opt(
         struct ggml_init_params params_ctx = {
             .mem_size   = 16*1024*1024,
             .mem_buffer = NULL,
+            .no_alloc   = false,
         };
 
         ctx = ggml_init(params_ctx);
@@ -8287,6 +9265,17 @@ enum ggml_opt_result ggml_opt(
 
 ////////////////////////////////////////////////////////////////////////////////
 
+size_t ggml_quantize(enum ggml_type type, const float * src, void * dst, int n) {
+    GGML_ASSERT(ggml_is_quantized(type));
+    GGML_ASSERT(n % GGML_BLCK_SIZE[type] == 0);
+
+    quantize_fns[type].quantize_row_q(src, dst, n);
+
+    return (n/GGML_BLCK_SIZE[type])*GGML_TYPE_SIZE[type];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int ggml_cpu_has_avx(void) {
 #if defined(__AVX__)
     return 1;
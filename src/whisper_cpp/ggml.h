@@ -35,6 +35,7 @@
 //       struct ggml_init_params params = {
 //           .mem_size   = 16*1024*1024,
 //           .mem_buffer = NULL,
+//           .no_alloc   = false,
 //       };
 //
 //       // memory allocation happens here
@@ -181,9 +182,11 @@ extern "C" {
 #define GGML_MAX_DIMS     4
 #define GGML_MAX_NODES    4096
 #define GGML_MAX_PARAMS   16
-#define GGML_MAX_CONTEXTS 64
 #define GGML_MAX_OPT      4
 
+// time (in microseconds) a compute thread busy-waits for the other threads before it goes to sleep
+#define GGML_DEFAULT_SPIN_US 200
+
 #ifdef __ARM_NEON
 // we use the built-in 16-bit float type
 typedef __fp16 ggml_fp16_t;
@@ -197,6 +200,7 @@ ggml_fp16_t ggml_fp32_to_fp16(float x);
 
 struct ggml_object;
 struct ggml_context;
+struct ggml_threadpool;
 
 enum ggml_type {
     GGML_TYPE_I8,
@@ -204,6 +208,8 @@ enum ggml_type {
     GGML_TYPE_I32,
     GGML_TYPE_F16,
     GGML_TYPE_F32,
+    GGML_TYPE_Q4_0, // blocks of 32 4-bit values with a float scale
+    GGML_TYPE_Q8_0, // blocks of 32 8-bit values with a float scale
     GGML_TYPE_COUNT,
 };
 
@@ -289,6 +295,10 @@ struct ggml_cgraph {
     int n_leafs;
     int n_threads;
 
+    // optional pool of persistent worker threads (see ggml_threadpool_new())
+    // if NULL, the worker threads are created and joined in each ggml_graph_compute() call
+    struct ggml_threadpool * threadpool;
+
     size_t work_size;
     struct ggml_tensor * work;
 
@@ -306,6 +316,15 @@ struct ggml_init_params {
     // memory pool
     size_t mem_size;   // bytes
     void * mem_buffer; // if NULL, memory will be allocated internally
+    bool   no_alloc;   // don't allocate memory for the tensor data, the caller sets tensor->data
+};
+
+// scratch buffer for the data of intermediate results
+// the tensor objects are still allocated in the context's memory pool
+struct ggml_scratch {
+    size_t offs;
+    size_t size;
+    void * data;
 };
 
 void    ggml_time_init(void); // call this once at the beginning of the program
@@ -320,14 +339,33 @@ void ggml_print_objects(const struct ggml_context * ctx);
 int    ggml_nelements(const struct ggml_tensor * tensor);
 size_t ggml_nbytes   (const struct ggml_tensor * tensor);
 
-size_t ggml_type_size   (enum ggml_type type);
+int    ggml_blck_size   (enum ggml_type type);
+size_t ggml_type_size   (enum ggml_type type); // size of a block - the number of bytes of ggml_blck_size() elements
+float  ggml_type_sizef  (enum ggml_type type); // ggml_type_size()/ggml_blck_size() as float
 size_t ggml_element_size(const struct ggml_tensor * tensor);
 
+bool ggml_is_quantized(enum ggml_type type);
+
 struct ggml_context * ggml_init(struct ggml_init_params params);
 void ggml_free(struct ggml_context * ctx);
 
+// a context to measure the memory of a graph before it is allocated: the data of the tensors is not allocated and must
+// not be accessed, it only adds to ggml_used_mem() or, with a scratch buffer set, to the bytes used in the scratch buffer
+// the scratch buffers are not accessed, any data pointer other than NULL selects one
+// ggml_graph_compute() does not compute the graph, it only adds its work buffer to the context memory
+// mem_size is the memory for the tensor objects, ggml_tensor_overhead() bytes per tensor
+struct ggml_context * ggml_init_measure(size_t mem_size);
+bool ggml_is_measure(const struct ggml_context * ctx);
+
+size_t ggml_tensor_overhead(void);
+
 size_t ggml_used_mem(const struct ggml_context * ctx);
 
+// the data of all tensors created after this call is placed in the given scratch buffer (data == NULL to disable)
+// setting a scratch buffer again overwrites its contents, so it can be reused once its old tensors are no longer needed
+// returns the number of bytes used in the previous scratch buffer
+size_t ggml_set_scratch(struct ggml_context * ctx, struct ggml_scratch scratch);
+
 struct ggml_tensor * ggml_new_tensor(
         struct ggml_context * ctx,
         enum   ggml_type type,
@@ -527,6 +565,28 @@ struct ggml_tensor * ggml_view_2d(
         size_t                nb1, // row stride in bytes
         size_t                offset);
 
+struct ggml_tensor * ggml_view_3d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        size_t                nb1, // row   stride in bytes
+        size_t                nb2, // slice stride in bytes
+        size_t                offset);
+
+struct ggml_tensor * ggml_view_4d(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   ne0,
+        int                   ne1,
+        int                   ne2,
+        int                   ne3,
+        size_t                nb1, // row   stride in bytes
+        size_t                nb2, // slice stride in bytes
+        size_t                nb3,
+        size_t                offset);
+
 struct ggml_tensor * ggml_permute(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
@@ -613,6 +673,18 @@ struct ggml_cgraph ggml_build_backward(struct ggml_context * ctx, struct ggml_cg
 void ggml_graph_compute(struct ggml_context * ctx, struct ggml_cgraph * cgraph);
 void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+// pool of n_threads - 1 worker threads that is reused by all graph computations that reference it
+// the calling thread acts as the remaining worker, so a pool with n_threads == 1 has no threads
+// a pool can be used by only one ggml_graph_compute() call at a time
+struct ggml_threadpool * ggml_threadpool_new (int n_threads);
+void                     ggml_threadpool_free(struct ggml_threadpool * threadpool);
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
+// set the time (in microseconds) the threads busy-wait at the synchronization points before sleeping
+// 0 - sleep right away, < 0 - never sleep
+void ggml_threadpool_set_spin_us(struct ggml_threadpool * threadpool, int spin_us);
+
 // print info and performance information for the graph
 void ggml_graph_print(const struct ggml_cgraph * cgraph);
 
@@ -720,6 +792,14 @@ enum ggml_opt_result ggml_opt(
         struct ggml_opt_params params,
         struct ggml_tensor * f);
 
+//
+// quantization
+//
+
+// quantizes n values (a multiple of the block size) to the given quantized type
+// returns the number of bytes written to dst
+size_t ggml_quantize(enum ggml_type type, const float * src, void * dst, int n);
+
 //
 // system info
 //
@@ -8,17 +8,51 @@
 #include <cassert>
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define USE_FLASH_ATTN
 //#define USE_FLASH_FF
 
+// number of scratch buffers used for the intermediate results of the encoder and the decoder graphs
+#define WHISPER_MAX_SCRATCH_BUFFERS 4
+
+// number of frames of the log-mel spectrogram computed together, see log_mel_block()
+#define WHISPER_MEL_BLOCK 32
+
+// the number of key/value entries read by the decoder self-attention is rounded up to a multiple of this
+// so that the cached decoder graph can be reused for several consecutive tokens
+#define WHISPER_KV_PAD 32
+
+// model file magics
+// 'ggjt' files have the same layout as 'ggml' files, except that the data of each tensor is preceded by zero padding
+// so that it starts at a multiple of WHISPER_FILE_ALIGN bytes - this allows to use the tensor data in place from a mapped file
+#define WHISPER_FILE_MAGIC_GGML 0x67676d6c
+#define WHISPER_FILE_MAGIC_GGJT 0x67676a74
+#define WHISPER_FILE_ALIGN 32
+
 // available whisper models
 enum e_model {
     MODEL_UNKNOWN,
@@ -133,52 +167,44 @@ static const std::map<std::string, std::pair<int, std::string>> g_lang = {
 
 static const size_t MB = 1024*1024;
 
-static const std::map<e_model, size_t> MEM_REQ_MODEL = {
-    { MODEL_TINY,     74ull*MB },
-    { MODEL_BASE,    142ull*MB },
-    { MODEL_SMALL,   466ull*MB },
-    { MODEL_MEDIUM, 1464ull*MB },
-    { MODEL_LARGE,  2952ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_MEMORY = {
-    { MODEL_TINY,     12ull*MB },
-    { MODEL_BASE,     24ull*MB },
-    { MODEL_SMALL,    70ull*MB },
-    { MODEL_MEDIUM,  184ull*MB },
-    { MODEL_LARGE,   306ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_ENCODE = {
-    { MODEL_TINY,     80ull*MB },
-    { MODEL_BASE,    128ull*MB },
-    { MODEL_SMALL,   300ull*MB },
-    { MODEL_MEDIUM,  680ull*MB },
-    { MODEL_LARGE,  1100ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_ENCODE_LAYER = {
-    { MODEL_TINY,    104ull*MB },
-    { MODEL_BASE,    138ull*MB },
-    { MODEL_SMALL,   208ull*MB },
-    { MODEL_MEDIUM,  280ull*MB },
-    { MODEL_LARGE,   354ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE = {
-    { MODEL_TINY,    200ull*MB },
-    { MODEL_BASE,    202ull*MB },
-    { MODEL_SMALL,   204ull*MB },
-    { MODEL_MEDIUM,  206ull*MB },
-    { MODEL_LARGE,   208ull*MB },
-};
-
-static const std::map<e_model, size_t> MEM_REQ_DECODE_LAYER = {
-    { MODEL_TINY,     32ull*MB },
-    { MODEL_BASE,     44ull*MB },
-    { MODEL_SMALL,    64ull*MB },
-    { MODEL_MEDIUM,   84ull*MB },
-    { MODEL_LARGE,   110ull*MB },
+// by the type of the weights of the linear layers
+static const std::map<ggml_type, std::map<e_model, size_t>> MEM_REQ_MODEL = {
+    { GGML_TYPE_F32,
+        {
+            { MODEL_TINY,    146ull*MB },
+            { MODEL_BASE,    279ull*MB },
+            { MODEL_SMALL,   924ull*MB },
+            { MODEL_MEDIUM, 2916ull*MB },
+            { MODEL_LARGE,  5890ull*MB },
+        },
+    },
+    { GGML_TYPE_F16,
+        {
+            { MODEL_TINY,     74ull*MB },
+            { MODEL_BASE,    142ull*MB },
+            { MODEL_SMALL,   466ull*MB },
+            { MODEL_MEDIUM, 1464ull*MB },
+            { MODEL_LARGE,  2952ull*MB },
+        },
+    },
+    { GGML_TYPE_Q4_0,
+        {
+            { MODEL_TINY,     27ull*MB },
+            { MODEL_BASE,     50ull*MB },
+            { MODEL_SMALL,   154ull*MB },
+            { MODEL_MEDIUM,  470ull*MB },
+            { MODEL_LARGE,   940ull*MB },
+        },
+    },
+    { GGML_TYPE_Q8_0,
+        {
+            { MODEL_TINY,     44ull*MB },
+            { MODEL_BASE,     83ull*MB },
+            { MODEL_SMALL,   267ull*MB },
+            { MODEL_MEDIUM,  832ull*MB },
+            { MODEL_LARGE,  1672ull*MB },
+        },
+    },
 };
 
 struct whisper_mel {
@@ -193,6 +219,22 @@ struct whisper_filters {
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // range [beg, end) of the non-zero weights of each filter
+    std::vector<int32_t> beg;
+    std::vector<int32_t> end;
+};
+
+// precomputed plan for the real FFT of a fixed size window
+// the real input of size n is transformed as a complex sequence of size n/2
+struct whisper_fft_plan {
+    int n = 0;
+
+    std::vector<int>   factors;       // radices of the n/2 complex transform
+    std::vector<float> twiddles;      // exp(-2*pi*i*k/(n/2)), k = 0 .. n/2 - 1, interleaved re/im
+    std::vector<float> twiddles_real; // exp(-2*pi*i*k/n),     k = 0 .. n/2,     interleaved re/im
+
+    std::vector<float> window; // Hann window applied to the frames before the transform
 };
 
 struct whisper_vocab {
@@ -255,7 +297,7 @@ struct whisper_hparams {
     int32_t n_text_head   = 6;
     int32_t n_text_layer  = 4;
     int32_t n_mels        = 80;
-    int32_t f16           = 1;
+    int32_t ftype         = 1;
 };
 
 // audio encoding layer
@@ -379,37 +421,152 @@ struct whisper_model {
     std::vector<whisper_layer_encoder> layers_encoder;
     std::vector<whisper_layer_decoder> layers_decoder;
 
-    // key + value memory
-    struct ggml_tensor * memory_k;
-    struct ggml_tensor * memory_v;
-
-    struct ggml_tensor * memory_cross_k;
-    struct ggml_tensor * memory_cross_v;
-
     // context
-    struct ggml_context * ctx;
-    struct ggml_context * ctx_mem;
+    struct ggml_context * ctx = nullptr;
 
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
 };
 
-struct whisper_context {
-    int64_t t_load_us   = 0;
+// decoder graph kept between the calls of whisper_decode
+// it is rebuilt only when its shape changes - the position dependent inputs are patched in place
+struct whisper_decoder_graph {
+    struct ggml_context * ctx = nullptr;
+    struct ggml_cgraph    gf  = {};
+
+    int n_tokens    = 0;
+    int n_seq       = 0; // number of sequences, each in its own slot of the self-attention memory
+    int n_kv        = 0; // number of key/value entries read by the self-attention
+    int n_audio_ctx = 0;
+    int n_threads   = 0;
+
+    struct ggml_tensor * embd     = nullptr;
+    struct ggml_tensor * position = nullptr;
+    struct ggml_tensor * logits   = nullptr;
+    struct ggml_tensor * probs    = nullptr;
+
+    std::vector<struct ggml_tensor *> n_past;  // the n_past parameters of the self-attention masks
+    std::vector<struct ggml_tensor *> store_k; // the copies of the new keys to the memory
+    std::vector<struct ggml_tensor *> store_v; // the copies of the new values to the memory
+};
+
+// read-only mapping of a model file
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+};
+
+static bool whisper_mmap_open(whisper_mmap & mm, const std::string & fname) {
+#if defined(_WIN32)
+    HANDLE hfile = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hfile, &size) || size.QuadPart == 0) {
+        CloseHandle(hfile);
+        return false;
+    }
+
+    HANDLE hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hfile);
+    if (hmap == NULL) {
+        return false;
+    }
+
+    void * addr = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmap);
+    if (addr == NULL) {
+        return false;
+    }
+
+    mm.addr = addr;
+    mm.size = (size_t) size.QuadPart;
+#else
+    const int fd = open(fname.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+#ifdef POSIX_MADV_WILLNEED
+    // start reading the file in the background, the pages are faulted in on first use anyway
+    posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED);
+#endif
+
+    mm.addr = addr;
+    mm.size = (size_t) st.st_size;
+#endif
+
+    return true;
+}
+
+static void whisper_mmap_close(whisper_mmap & mm) {
+    if (mm.addr) {
+#if defined(_WIN32)
+        UnmapViewOfFile(mm.addr);
+#else
+        munmap(mm.addr, mm.size);
+#endif
+    }
+
+    mm = whisper_mmap();
+}
+
+// a span of speech found by the voice activity detection, in samples
+struct whisper_vad_span {
+    int64_t i_speech; // start in the transcribed audio, which holds the speech spans one after the other
+    int64_t i_input;  // start in the input audio
+    int64_t n;        // number of samples
+};
+
+// the mutable state of a transcription
+// several states can be used concurrently with the same model, each state must be used by one thread at a time
+struct whisper_state {
     int64_t t_mel_us    = 0;
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
     int64_t t_decode_us = 0;
-    int64_t t_start_us  = 0;
 
-    std::vector<uint8_t> * buf_model; // the model buffer is read-only and can be shared between processors
-    std::vector<uint8_t>   buf_memory;
-    std::vector<uint8_t>   buf_compute;
-    std::vector<uint8_t>   buf_compute_layer;
+    // key + value memory
+    struct ggml_tensor * memory_k       = nullptr;
+    struct ggml_tensor * memory_v       = nullptr;
+    struct ggml_tensor * memory_cross_k = nullptr;
+    struct ggml_tensor * memory_cross_v = nullptr;
 
-    whisper_model model;
-    whisper_vocab vocab;
+    // the self-attention memory holds kv_n_slots sequences (e.g. the beams of a beam search) one after the other,
+    // each of kv_n_ctx text positions, all sequences read the same cross-attention memory of kv_cross_n_ctx audio positions
+    // both are allocated when first needed, for the context in use, see whisper_kv_self_init() and whisper_kv_cross_init()
+    int kv_n_slots     = 0;
+    int kv_n_ctx       = 0;
+    int kv_cross_n_ctx = 0;
+
+    struct ggml_context * ctx_mem = nullptr; // cross-attention memory
+    struct ggml_context * ctx_kv  = nullptr; // self-attention memory
+
+    std::vector<uint8_t> buf_memory;
+    std::vector<uint8_t> buf_kv;
+
+    // the compute buffers fit the largest graph measured so far, see whisper_graph_reserve()
+    std::vector<uint8_t> buf_compute;
+    std::vector<uint8_t> buf_scratch[WHISPER_MAX_SCRATCH_BUFFERS];
+
+    // the scratch buffer in use and the bytes used in each scratch buffer by the graph being measured
+    int    buf_last = 0;
+    size_t buf_max_size[WHISPER_MAX_SCRATCH_BUFFERS] = { 0 };
 
     whisper_mel mel;
 
@@ -418,6 +575,9 @@ struct whisper_context {
 
     std::vector<whisper_segment> result_all;
 
+    // [EXPERIMENTAL] voice activity detection: the spans of the input audio which were transcribed, one after the other
+    std::vector<whisper_vad_span> vad_map;
+
     std::vector<whisper_token> prompt_past;
 
     // [EXPERIMENTAL] token-level timestamps data
@@ -427,7 +587,36 @@ struct whisper_context {
     std::vector<float> energy; // PCM signal energy
 
     // [EXPERIMENTAL] speed-up techniques
-    int32_t exp_n_audio_ctx; // 0 - use default
+    int32_t exp_n_audio_ctx = 0; // 0 - use default
+
+    // worker threads reused by all graph computations of this state
+    struct ggml_threadpool * threadpool = nullptr;
+    int32_t spin_us = GGML_DEFAULT_SPIN_US;
+
+    // the states of a group encode their windows and decode their tokens together, see whisper_group_run()
+    struct whisper_group * group = nullptr;
+
+    // lives in buf_compute, so it is invalidated by the encoder
+    whisper_decoder_graph decoder_graph;
+};
+
+// the loaded model - it is not modified after loading and can be shared by any number of states
+struct whisper_context {
+    int64_t t_load_us  = 0;
+    int64_t t_start_us = 0;
+
+    std::vector<uint8_t> * buf_model = nullptr; // the model buffer is read-only and can be shared between processors
+    whisper_mmap         * mapping = nullptr; // the mapped model file holding the tensor data, if any - shared like buf_model
+
+    whisper_model model;
+    whisper_vocab vocab;
+
+    // FFT plans for the mel spectrogram: regular window and the doubled window of the phase vocoder
+    whisper_fft_plan fft_plan;
+    whisper_fft_plan fft_plan_x2;
+
+    // the state used by the functions without a state argument, NULL for contexts from whisper_init_no_state()
+    whisper_state * state = nullptr;
 };
 
 template<typename T>
@@ -436,6 +625,28 @@ static void read_safe(std::ifstream& fin, T& dest)
   fin.read((char*)& dest, sizeof(T));
 }
 
+// the type of the tensor data for the given whisper_ftype value, GGML_TYPE_COUNT if it is not supported
+static ggml_type whisper_ftype_to_type(int32_t ftype) {
+    switch (ftype) {
+        case WHISPER_FTYPE_F32:  return GGML_TYPE_F32;
+        case WHISPER_FTYPE_F16:  return GGML_TYPE_F16;
+        case WHISPER_FTYPE_Q4_0: return GGML_TYPE_Q4_0;
+        case WHISPER_FTYPE_Q8_0: return GGML_TYPE_Q8_0;
+    }
+
+    return GGML_TYPE_COUNT;
+}
+
+// the number of tensors whisper_model_load() creates in the model context
+static int whisper_model_n_tensors(const whisper_hparams & hparams) {
+    const int n_encoder       = 7;  // e_pe, e_conv_1_w/b, e_conv_2_w/b, e_ln_w/b
+    const int n_encoder_layer = 15; // mlp_ln_w/b, mlp_0_w/b, mlp_1_w/b, attn_ln_0_w/b, attn_q_w/b, attn_k_w, attn_v_w/b, attn_ln_1_w/b
+    const int n_decoder       = 4;  // d_pe, d_te, d_ln_w/b
+    const int n_decoder_layer = n_encoder_layer + 9; // + cross_attn_ln_0_w/b, cross_attn_q_w/b, cross_attn_k_w, cross_attn_v_w/b, cross_attn_ln_1_w/b
+
+    return n_encoder + n_encoder_layer*hparams.n_audio_layer + n_decoder + n_decoder_layer*hparams.n_text_layer;
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -447,6 +658,9 @@ static void read_safe(std::ifstream& fin, T& dest)
 //
 // see the convert-pt-to-ggml.py script for details
 //
+// the tensor data of 'ggjt' files is aligned and is used in place from a read-only mapping of the file,
+// so the weights are not copied and their pages are shared by all the processes using the same model file
+//
 static bool whisper_model_load(const std::string & fname, whisper_context & wctx) {
     Rprintf("%s: loading model from '%s'\n", __func__, fname.c_str());
 
@@ -460,13 +674,25 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
     }
 
     // verify magic
+    bool aligned = false;
     {
         uint32_t magic;
         read_safe(fin, magic);
-        if (magic != 0x67676d6c) {
+        if (magic != WHISPER_FILE_MAGIC_GGML && magic != WHISPER_FILE_MAGIC_GGJT) {
             Rprintf("%s: invalid model file '%s' (bad magic)\n", __func__, fname.c_str());
             return false;
         }
+
+        aligned = magic == WHISPER_FILE_MAGIC_GGJT;
+    }
+
+    if (aligned) {
+        wctx.mapping = new whisper_mmap();
+        if (!whisper_mmap_open(*wctx.mapping, fname)) {
+            Rprintf("%s: failed to map '%s', reading the weights instead\n", __func__, fname.c_str());
+            delete wctx.mapping;
+            wctx.mapping = nullptr;
+        }
     }
 
     //load hparams
@@ -483,7 +709,7 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         read_safe(fin, hparams.n_text_head);
         read_safe(fin, hparams.n_text_layer);
         read_safe(fin, hparams.n_mels);
-        read_safe(fin, hparams.f16);
+        read_safe(fin, hparams.ftype);
 
         assert(hparams.n_text_state == hparams.n_audio_state);
 
@@ -517,14 +743,22 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         Rprintf("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
         Rprintf("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
         Rprintf("%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        Rprintf("%s: f16           = %d\n", __func__, hparams.f16);
+        Rprintf("%s: ftype         = %d\n", __func__, hparams.ftype);
         Rprintf("%s: type          = %d\n", __func__, model.type);
 
+        const ggml_type wtype = whisper_ftype_to_type(hparams.ftype);
+        if (wtype == GGML_TYPE_COUNT) {
+            Rprintf("%s: invalid model file '%s' (bad ftype value %d)\n", __func__, fname.c_str(), hparams.ftype);
+            return false;
+        }
+
         wctx.buf_model = new std::vector<uint8_t>();
-        wctx.buf_model->resize(MEM_REQ_MODEL.at(model.type));
-        wctx.buf_memory.resize(MEM_REQ_MEMORY.at(model.type));
-        wctx.buf_compute.resize(std::max(MEM_REQ_ENCODE.at(model.type), MEM_REQ_DECODE.at(model.type)));
-        wctx.buf_compute_layer.resize(std::max(MEM_REQ_ENCODE_LAYER.at(model.type), MEM_REQ_DECODE_LAYER.at(model.type)));
+        if (wctx.mapping) {
+            // only the tensor objects, the data stays in the mapped file
+            wctx.buf_model->resize(whisper_model_n_tensors(hparams)*ggml_tensor_overhead());
+        } else {
+            wctx.buf_model->resize(MEM_REQ_MODEL.at(wtype).at(model.type));
+        }
     }
 
     // load mel filters
@@ -536,6 +770,25 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
 
         filters.data.resize(filters.n_mel * filters.n_fft);
         fin.read((char *) filters.data.data(), filters.data.size() * sizeof(float));
+
+        // the filters are triangular and overlap only with their neighbours
+        filters.beg.resize(filters.n_mel);
+        filters.end.resize(filters.n_mel);
+        for (int j = 0; j < filters.n_mel; j++) {
+            const float * row = filters.data.data() + j*filters.n_fft;
+
+            int beg = 0;
+            int end = filters.n_fft;
+            while (beg < end && row[beg] == 0.0f) {
+                beg++;
+            }
+            while (end > beg && row[end - 1] == 0.0f) {
+                end--;
+            }
+
+            filters.beg[j] = beg;
+            filters.end[j] = end;
+        }
     }
 
     // load vocab
@@ -599,22 +852,24 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
     }
 
     {
-        // this is the total memory required to run the inference
-        const size_t mem_required =
-                   wctx.buf_model->size() +
-                   wctx.buf_memory.size() +
-                   wctx.buf_compute.size() +
-                   wctx.buf_compute_layer.size();
+        // the memory of the model, each state adds its key/value memory and the compute buffers measured for its graphs
+        const size_t mem_required = wctx.buf_model->size();
+
+        Rprintf("%s: mem_required  = %7.2f MB (+ state)\n", __func__, mem_required / 1024.0 / 1024.0);
 
-        Rprintf("%s: mem_required  = %7.2f MB\n", __func__, mem_required / 1024.0 / 1024.0);
+        if (wctx.mapping) {
+            Rprintf("%s: mapped model  = %7.2f MB\n", __func__, wctx.mapping->size / 1024.0 / 1024.0);
+        }
     }
 
-    // for the big tensors, we have the option to store the data in 16-bit floats
+    // for the big tensors, we have the option to store the data in 16-bit floats or quantized
     // in order to save memory and also to speed up the computation
-    const ggml_type wtype = model.hparams.f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    const ggml_type wtype = whisper_ftype_to_type(model.hparams.ftype);
+
+    // the convolution weights are never quantized
+    const ggml_type vtype = wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
 
     size_t ctx_size = 0;
-    size_t ctx_mem_size = 0;
 
     {
         const auto & hparams = model.hparams;
@@ -636,10 +891,10 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             // TODO: F16 .. maybe not?
             ctx_size += n_audio_ctx*n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_pe;
 
-            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(wtype);         // e_conv_1_w
+            ctx_size += 3*n_mels*n_audio_state*ggml_type_size(vtype);         // e_conv_1_w
             ctx_size +=          n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_1_b
 
-            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(wtype);         // e_conv_2_w
+            ctx_size += 3*n_audio_state*n_audio_state*ggml_type_size(vtype);         // e_conv_2_w
             ctx_size +=                 n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_conv_2_b
 
             ctx_size += n_audio_state*ggml_type_size(GGML_TYPE_F32); // e_ln_w;
@@ -651,7 +906,7 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             // TODO: F16 .. maybe not?
             ctx_size += n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F32); // d_pe;
 
-            ctx_size += n_vocab*n_text_state*ggml_type_size(wtype); // d_te;
+            ctx_size += n_vocab*n_text_state*ggml_type_sizef(wtype); // d_te;
 
             ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_w;
             ctx_size += n_text_state*ggml_type_size(GGML_TYPE_F32); // d_ln_b;
@@ -662,24 +917,24 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_0_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_0_w
             ctx_size += n_audio_layer*(              4*n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_size(wtype));         // mlp_1_w
+            ctx_size += n_audio_layer*(4*n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // mlp_1_w
             ctx_size += n_audio_layer*(                n_audio_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_audio_layer*(n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_q_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_q_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype)); // attn_k_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype)); // attn_k_w
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_v_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_v_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_size(wtype));         // attn_ln_1_w
+            ctx_size += n_audio_layer*(n_audio_state*n_audio_state*ggml_type_sizef(wtype));         // attn_ln_1_w
             ctx_size += n_audio_layer*(              n_audio_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
         }
 
@@ -688,48 +943,42 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_ln_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_0_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_0_w
             ctx_size += n_text_layer*(             4*n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_0_b
 
-            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_size(wtype));         // mlp_1_w
+            ctx_size += n_text_layer*(4*n_text_state*n_text_state*ggml_type_sizef(wtype));         // mlp_1_w
             ctx_size += n_text_layer*(               n_text_state*ggml_type_size(GGML_TYPE_F32)); // mlp_1_b
 
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // attn_ln_1_b
                                                                                                 //
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_w
             ctx_size += n_text_layer*(n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_0_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_q_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_q_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_q_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype)); // cross_attn_k_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype)); // cross_attn_k_w
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_v_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_v_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_v_b
 
-            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_size(wtype));         // cross_attn_ln_1_w
+            ctx_size += n_text_layer*(n_text_state*n_text_state*ggml_type_sizef(wtype));         // cross_attn_ln_1_w
             ctx_size += n_text_layer*(             n_text_state*ggml_type_size(GGML_TYPE_F32)); // cross_attn_ln_1_b
         }
 
-        ctx_mem_size += n_text_layer*n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_k
-        ctx_mem_size += n_text_layer*n_text_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_v
-
-        ctx_mem_size += n_text_layer*n_audio_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_cross_k
-        ctx_mem_size += n_text_layer*n_audio_ctx*n_text_state*ggml_type_size(GGML_TYPE_F16); // memory_cross_v
-
-        ctx_size += (15 + 15*n_audio_layer + 24*n_text_layer)*256; // object overhead
+        ctx_size += whisper_model_n_tensors(hparams)*ggml_tensor_overhead(); // tensor objects
 
         Rprintf("%s: ggml ctx size = %7.2f MB\n", __func__, ctx_size/(1024.0*1024.0));
     }
@@ -739,6 +988,7 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
       struct ggml_init_params params;
       params.mem_size   = wctx.buf_model->size();
       params.mem_buffer = wctx.buf_model->data();
+      params.no_alloc   = wctx.mapping != nullptr;
       
       model.ctx = ggml_init(params);
       if (!model.ctx) {
@@ -772,10 +1022,10 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         {
             model.e_pe = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_audio_state, n_audio_ctx);
 
-            model.e_conv_1_w = ggml_new_tensor_3d(ctx, wtype,         3, n_mels, n_audio_state);
+            model.e_conv_1_w = ggml_new_tensor_3d(ctx, vtype,         3, n_mels, n_audio_state);
             model.e_conv_1_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
-            model.e_conv_2_w = ggml_new_tensor_3d(ctx, wtype,         3, n_audio_state, n_audio_state);
+            model.e_conv_2_w = ggml_new_tensor_3d(ctx, vtype,         3, n_audio_state, n_audio_state);
             model.e_conv_2_b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 1, n_audio_state);
 
             model.e_ln_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_audio_state);
@@ -943,56 +1193,6 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
         }
     }
 
-    // create the ggml memory context
-    {
-      struct ggml_init_params params;
-      params.mem_size   = wctx.buf_memory.size();
-      params.mem_buffer = wctx.buf_memory.data();
-      
-      model.ctx_mem = ggml_init(params);
-      if (!model.ctx_mem) {
-        Rprintf("%s: ggml_init() failed\n", __func__);
-        return false;
-      }
-    }
-
-    // key + value memory
-    {
-        auto & ctx = model.ctx_mem;
-
-        const auto & hparams = model.hparams;
-
-        const int n_text_state = hparams.n_text_state;
-        const int n_text_layer = hparams.n_text_layer;
-        const int n_text_ctx   = hparams.n_text_ctx;
-
-        // key/value memory for the self-attention layer
-        {
-            const int n_mem      = n_text_layer*n_text_ctx;
-            const int n_elements = n_text_state*n_mem;
-
-            model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-            model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-        }
-
-        // key/value memory for the cross-attention layer
-        {
-            const int n_audio_ctx = hparams.n_audio_ctx;
-
-            const int n_mem      = n_text_layer*n_audio_ctx;
-            const int n_elements = n_text_state*n_mem;
-
-            model.memory_cross_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-            model.memory_cross_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-        }
-
-        const size_t memory_size =
-            ggml_nbytes(model.memory_k)       + ggml_nbytes(model.memory_v) +
-            ggml_nbytes(model.memory_cross_k) + ggml_nbytes(model.memory_cross_v);
-
-        Rprintf("%s: memory size   = %7.2f MB\n", __func__, memory_size/1024.0/1024.0);
-    }
-
     // load weights
     {
         size_t total_size = 0;
@@ -1041,15 +1241,39 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
                 return false;
             }
 
-            const size_t bpe = (ftype == 0) ? sizeof(float) : sizeof(ggml_fp16_t);
+            const ggml_type ttype = whisper_ftype_to_type(ftype);
+
+            if (ttype != tensor->type) {
+                Rprintf("%s: tensor '%s' has wrong type in model file: got %d, expected %d\n",
+                        __func__, name.data(), ttype, tensor->type);
+                return false;
+            }
 
-            if (nelements*bpe != ggml_nbytes(tensor)) {
+            if ((nelements*ggml_type_size(ttype))/ggml_blck_size(ttype) != ggml_nbytes(tensor)) {
                 Rprintf("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                        __func__, name.data(), ggml_nbytes(tensor), (nelements*ggml_type_size(ttype))/ggml_blck_size(ttype));
                 return false;
             }
 
-            fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            if (aligned) {
+                const size_t offset = fin.tellg();
+                const size_t pad    = (WHISPER_FILE_ALIGN - offset % WHISPER_FILE_ALIGN) % WHISPER_FILE_ALIGN;
+
+                if (wctx.mapping) {
+                    if (offset + pad + ggml_nbytes(tensor) > wctx.mapping->size) {
+                        Rprintf("%s: tensor '%s' is out of the bounds of the model file\n", __func__, name.data());
+                        return false;
+                    }
+
+                    tensor->data = (char *) wctx.mapping->addr + offset + pad;
+                }
+
+                fin.seekg(pad + (wctx.mapping ? ggml_nbytes(tensor) : 0), std::ios::cur);
+            }
+
+            if (!wctx.mapping) {
+                fin.read(reinterpret_cast<char *>(tensor->data), ggml_nbytes(tensor));
+            }
 
             //printf("%48s - [%5d, %5d, %5d], type = %6s, %6.2f MB\n", name.data(), ne[0], ne[1], ne[2], ftype == 0 ? "float" : "f16", ggml_nbytes(tensor)/1024.0/1024.0);
             total_size += ggml_nbytes(tensor);
@@ -1058,7 +1282,7 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
 
         Rprintf("%s: model size    = %7.2f MB\n", __func__, total_size/1024.0/1024.0);
 
-        if (model.n_loaded == 0) {
+        if (model.n_loaded == 0 && !wctx.mapping) {
             Rprintf("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
             Rprintf("%s: ERROR not all tensors loaded from model file - expected %zu, got %d\n", __func__, model.tensors.size(), model.n_loaded);
@@ -1071,253 +1295,565 @@ static bool whisper_model_load(const std::string & fname, whisper_context & wctx
     return true;
 }
 
-// evaluate the encoder
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode(
-              whisper_context & wctx,
-        const int n_threads,
-        const int mel_offset) {
-    const auto & model   = wctx.model;
-    const auto & mel_inp = wctx.mel;
-    const auto & hparams = model.hparams;
+// returns the worker thread pool of the state
+// the pool is created on first use and re-created if the requested number of threads changes
+static struct ggml_threadpool * whisper_get_threadpool(whisper_state & wstate, int n_threads) {
+    if (wstate.threadpool && ggml_threadpool_n_threads(wstate.threadpool) != n_threads) {
+        ggml_threadpool_free(wstate.threadpool);
+        wstate.threadpool = nullptr;
+    }
 
-    const int n_ctx   = wctx.exp_n_audio_ctx > 0 ? wctx.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state;
-    const int n_head  = hparams.n_audio_head;
-    const int n_layer = hparams.n_audio_layer;
+    if (wstate.threadpool == nullptr) {
+        wstate.threadpool = ggml_threadpool_new(n_threads);
+    }
 
-    const int n_mels = hparams.n_mels;
-    assert(mel_inp.n_mel == n_mels);
+    ggml_threadpool_set_spin_us(wstate.threadpool, wstate.spin_us);
 
-    struct ggml_init_params params;
-    params.mem_size   = wctx.buf_compute.size();
-    params.mem_buffer = wctx.buf_compute.data();  
+    return wstate.threadpool;
+}
 
-    struct ggml_context * ctx0 = ggml_init(params);
+// the data of the tensors created from now on goes to scratch buffer i (-1 - the context memory)
+// the previous contents of the buffer are overwritten, so a buffer can be reused only when all tensors
+// that read its old contents are either already in the graph or ancestors of all tensors created later
+static void whisper_use_buf(whisper_state & wstate, struct ggml_context * ctx, int i) {
+    size_t last_size = 0;
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    assert(mel->type == GGML_TYPE_F32);
-    {
-        float * dst = (float *) mel->data;
-        memset(dst, 0, ggml_nbytes(mel));
+    if (i == -1) {
+        last_size = ggml_set_scratch(ctx, { 0, 0, nullptr, });
+    } else {
+        auto & buf = wstate.buf_scratch[i];
 
-        const int i0 = std::min(mel_offset, mel_inp.n_len);
-        const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+        // a measure context does not access the buffer, which may not be allocated yet
+        void * data = ggml_is_measure(ctx) ? (void *) &buf : (void *) buf.data();
 
-        for (int j = 0; j < mel_inp.n_mel; ++j) {
-            for (int i = i0; i < i1; ++i) {
-                dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-            }
-        }
+        last_size = ggml_set_scratch(ctx, { 0, buf.size(), data, });
     }
 
-    struct ggml_tensor * cur;
+    if (wstate.buf_last >= 0) {
+        wstate.buf_max_size[wstate.buf_last] = std::max(wstate.buf_max_size[wstate.buf_last], last_size);
+    }
 
-    // convolution + gelu
-    {
-        cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mel);
-        cur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    model.e_conv_1_b,
-                    cur),
-                cur);
+    wstate.buf_last = i;
+}
 
-        cur = ggml_gelu(ctx0, cur);
+static void whisper_decoder_graph_free(whisper_decoder_graph & dg) {
+    if (dg.ctx) {
+        ggml_free(dg.ctx);
+    }
 
-        cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
-        cur = ggml_add(ctx0,
-                ggml_repeat(ctx0,
-                    model.e_conv_2_b,
-                    cur),
-                cur);
+    dg = whisper_decoder_graph();
+}
+
+// the context of a graph: the compute buffer of the state, or when measuring, a context which adds up the memory the
+// graph needs in the compute buffer and in each scratch buffer
+static struct ggml_context * whisper_graph_init(whisper_state & wstate, const bool measure) {
+    if (measure) {
+        wstate.buf_last = -1;
+        for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+            wstate.buf_max_size[i] = 0;
+        }
 
-        cur = ggml_gelu(ctx0, cur);
+        return ggml_init_measure(4*GGML_MAX_NODES*ggml_tensor_overhead());
     }
 
-    // ===================================================================
-    // NOTE: experimenting with partial evaluation of the encoder (ignore)
-    //static int iter = -1;
-    //const int n_iter = 1500/n_ctx;
+    struct ggml_init_params params;
+    params.mem_size   = wstate.buf_compute.size();
+    params.mem_buffer = wstate.buf_compute.data();
+    params.no_alloc   = false;
 
-    //iter = (iter + 1) % n_iter;
+    return ggml_init(params);
+}
 
-    //if (iter == 0) {
-    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-    //}
+// grow the compute buffers of the state to the memory of the graph measured in ctx
+// ggml_graph_compute() must have added the work buffer of the graph
+static void whisper_graph_reserve(whisper_state & wstate, const struct ggml_context * ctx) {
+    bool grow = wstate.buf_compute.size() < ggml_used_mem(ctx);
+    for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+        grow = grow || wstate.buf_scratch[i].size() < wstate.buf_max_size[i];
+    }
 
-    static int iter = 0;
+    if (!grow) {
+        return;
+    }
 
-    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+    // the cached decoder graph lives in the buffers
+    whisper_decoder_graph_free(wstate.decoder_graph);
 
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    wstate.buf_compute.resize(std::max(wstate.buf_compute.size(), ggml_used_mem(ctx)));
+    for (int i = 0; i < WHISPER_MAX_SCRATCH_BUFFERS; ++i) {
+        wstate.buf_scratch[i].resize(std::max(wstate.buf_scratch[i].size(), wstate.buf_max_size[i]));
+    }
+}
 
-    cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
-    // ===================================================================
+// (re)allocate the self-attention memory of the state for n_slots sequences of n_ctx text positions
+// the content of the memory is lost
+static bool whisper_kv_self_init(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_slots,
+        const int n_ctx) {
+    const auto & hparams = wctx.model.hparams;
 
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+    const int n_mem      = hparams.n_text_layer*n_ctx;
+    const int n_elements = hparams.n_text_state*n_mem;
 
-    struct ggml_tensor * inpL = cur;
+    // the cached decoder graph holds views of the memory
+    whisper_decoder_graph_free(wstate.decoder_graph);
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_encoder[il];
+    if (wstate.ctx_kv) {
+        ggml_free(wstate.ctx_kv);
+        wstate.ctx_kv = nullptr;
+    }
 
-        // create separate context for each layer to reduce memory usage
+    wstate.kv_n_slots = 0;
+    wstate.kv_n_ctx   = 0;
+    wstate.memory_k   = nullptr;
+    wstate.memory_v   = nullptr;
 
-        struct ggml_init_params paramsL;
-        paramsL.mem_size   = wctx.buf_compute_layer.size();
-        paramsL.mem_buffer = wctx.buf_compute_layer.data();
+    // the old buffer is released first, so that a smaller memory also takes less space
+    std::vector<uint8_t>().swap(wstate.buf_kv);
+    wstate.buf_kv.resize(2*ggml_type_size(GGML_TYPE_F16)*n_elements*n_slots + 2*256);
 
-        struct ggml_context * ctxL = ggml_init(paramsL);
+    struct ggml_init_params params;
+    params.mem_size   = wstate.buf_kv.size();
+    params.mem_buffer = wstate.buf_kv.data();
+    params.no_alloc   = false;
 
-        // norm
-        {
-            cur = ggml_norm(ctxL, inpL);
+    wstate.ctx_kv = ggml_init(params);
+    if (!wstate.ctx_kv) {
+        Rprintf("%s: ggml_init() failed\n", __func__);
+        return false;
+    }
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctxL,
-                    ggml_mul(ctxL,
-                        ggml_repeat(ctxL, layer.attn_ln_0_w, cur),
-                        cur),
-                    ggml_repeat(ctxL, layer.attn_ln_0_b, cur));
-        }
+    wstate.memory_k = ggml_new_tensor_1d(wstate.ctx_kv, GGML_TYPE_F16, n_elements*n_slots);
+    wstate.memory_v = ggml_new_tensor_1d(wstate.ctx_kv, GGML_TYPE_F16, n_elements*n_slots);
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctxL,
-                    layer.attn_q_w,
-                    cur);
+    wstate.kv_n_slots = n_slots;
+    wstate.kv_n_ctx   = n_ctx;
 
-            Qcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.attn_q_b,
-                        Qcur),
-                    Qcur);
+    return true;
+}
 
-            //Qcur = ggml_scale(ctxL, Qcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+// (re)allocate the cross-attention memory of the state for n_ctx audio positions, unless it already has that size
+// the content of the memory is lost
+static bool whisper_kv_cross_init(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_ctx) {
+    const auto & hparams = wctx.model.hparams;
 
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctxL,
-                    layer.attn_k_w,
-                    cur);
+    if (wstate.ctx_mem && wstate.kv_cross_n_ctx == n_ctx) {
+        return true;
+    }
 
-            //Kcur = ggml_scale(ctxL, Kcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+    const int n_mem      = hparams.n_text_layer*n_ctx;
+    const int n_elements = hparams.n_text_state*n_mem;
 
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctxL,
-                    layer.attn_v_w,
-                    cur);
+    // the cached decoder graph holds views of the memory
+    whisper_decoder_graph_free(wstate.decoder_graph);
 
-            Vcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
-                        layer.attn_v_b,
-                        Vcur),
-                    Vcur);
+    if (wstate.ctx_mem) {
+        ggml_free(wstate.ctx_mem);
+        wstate.ctx_mem = nullptr;
+    }
 
-            // ------
+    wstate.kv_cross_n_ctx = 0;
+    wstate.memory_cross_k = nullptr;
+    wstate.memory_cross_v = nullptr;
 
-#ifdef USE_FLASH_ATTN
-            struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx)),
-                        0, 2, 1, 3);
+    std::vector<uint8_t>().swap(wstate.buf_memory);
+    wstate.buf_memory.resize(2*ggml_type_size(GGML_TYPE_F16)*n_elements + 2*256);
 
-            struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Kcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx)),
+    struct ggml_init_params params;
+    params.mem_size   = wstate.buf_memory.size();
+    params.mem_buffer = wstate.buf_memory.data();
+    params.no_alloc   = false;
+
+    wstate.ctx_mem = ggml_init(params);
+    if (!wstate.ctx_mem) {
+        Rprintf("%s: ggml_init() failed\n", __func__);
+        return false;
+    }
+
+    wstate.memory_cross_k = ggml_new_tensor_1d(wstate.ctx_mem, GGML_TYPE_F16, n_elements);
+    wstate.memory_cross_v = ggml_new_tensor_1d(wstate.ctx_mem, GGML_TYPE_F16, n_elements);
+
+    wstate.kv_cross_n_ctx = n_ctx;
+
+    return true;
+}
+
+// copy the first n positions of the self-attention memory of slot src to slot dst
+static void whisper_kv_self_copy(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int src,
+        const int dst,
+        const int n) {
+    const auto & hparams = wctx.model.hparams;
+
+    const int n_ctx   = wstate.kv_n_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
+
+    const size_t es = ggml_element_size(wstate.memory_k);
+
+    const size_t nb_layer = es*n_state*n_ctx;
+    const size_t nb_slot  = nb_layer*n_layer;
+
+    for (int il = 0; il < n_layer; ++il) {
+        memcpy((char *) wstate.memory_k->data + dst*nb_slot + il*nb_layer, (char *) wstate.memory_k->data + src*nb_slot + il*nb_layer, es*n_state*n);
+        memcpy((char *) wstate.memory_v->data + dst*nb_slot + il*nb_layer, (char *) wstate.memory_v->data + src*nb_slot + il*nb_layer, es*n_state*n);
+    }
+}
+
+// add the position encoding to the output of the convolutions of one window
+static struct ggml_tensor * whisper_encode_pe(
+        const whisper_context & wctx,
+        struct ggml_context * ctx0,
+        struct ggml_tensor * cur,
+        const int n_ctx) {
+    const auto & model = wctx.model;
+
+    // ===================================================================
+    // NOTE: experimenting with partial evaluation of the encoder (ignore)
+    //static int iter = -1;
+    //const int n_iter = 1500/n_ctx;
+
+    //iter = (iter + 1) % n_iter;
+
+    //if (iter == 0) {
+    //    memset(wstate.memory_cross_k->data, 0, ggml_nbytes(wstate.memory_cross_k));
+    //    memset(wstate.memory_cross_v->data, 0, ggml_nbytes(wstate.memory_cross_v));
+    //}
+
+    static int iter = 0;
+
+    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+
+    cur = ggml_add(ctx0, e_pe, ggml_transpose(ctx0, cur));
+    // ===================================================================
+
+    // original:
+    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+    return cur;
+}
+
+// evaluate the encoder
+//
+// given audio recordings (more specifically, their log mel spectrograms), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+// the windows are evaluated as a single graph: the convolutions and the attention are computed per window,
+// the other layers multiply the weights with the columns of all the windows at once
+//
+//   - wctx:        the model
+//   - wstates:     the states holding the spectrograms, the results are stored in their cross-attention memory
+//                  the graph is computed with the buffers and the threads of the first state
+//   - n_threads:   number of threads to use
+//   - mel_offsets: offset in the mel spectrogram of each state (i.e. audio offset)
+//   - n_batch:     number of windows, one per state
+//   - measure:     only grow the compute buffers of the first state to the memory of the graph
+//
+static bool whisper_encode_batch(
+        const whisper_context & wctx,
+              whisper_state * const * wstates,
+        const int n_threads,
+        const int * mel_offsets,
+        const int n_batch,
+        const bool measure) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    auto & wstate = *wstates[0];
+
+    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+
+    const int n_mels = hparams.n_mels;
+
+    for (int b = 0; b < n_batch; ++b) {
+        const auto & ws = *wstates[b];
+        assert(ws.mel.n_mel == n_mels);
+
+        if ((ws.exp_n_audio_ctx > 0 ? ws.exp_n_audio_ctx : hparams.n_audio_ctx) != n_ctx) {
+            Rprintf("%s: the states of a batch must use the same audio context\n", __func__);
+            return false;
+        }
+        for (int b1 = 0; b1 < b; ++b1) {
+            if (wstates[b1] == wstates[b]) {
+                Rprintf("%s: each window of a batch needs its own state\n", __func__);
+                return false;
+            }
+        }
+    }
+
+    if (!measure) {
+        // the cross-attention memory of each state holds the audio context of this window
+        for (int b = 0; b < n_batch; ++b) {
+            if (!whisper_kv_cross_init(wctx, *wstates[b], n_ctx)) {
+                return false;
+            }
+        }
+
+        // the graph is measured before it is built in the compute buffers
+        if (!whisper_encode_batch(wctx, wstates, n_threads, mel_offsets, n_batch, true)) {
+            return false;
+        }
+    }
+
+    struct ggml_threadpool * threadpool = whisper_get_threadpool(wstate, n_threads);
+
+    // the encoder overwrites the compute buffer
+    whisper_decoder_graph_free(wstate.decoder_graph);
+
+    struct ggml_context * ctx0 = whisper_graph_init(wstate, measure);
+
+    // the encoder and the cross-attention memory are evaluated as a single graph
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
+    gf.threadpool = threadpool;
+
+    std::vector<struct ggml_tensor *> mels(n_batch);
+    for (int b = 0; b < n_batch; ++b) {
+        const auto & mel_inp = wstates[b]->mel;
+
+        struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        assert(mel->type == GGML_TYPE_F32);
+
+        if (!measure) {
+            float * dst = (float *) mel->data;
+            memset(dst, 0, ggml_nbytes(mel));
+
+            const int i0 = std::min(mel_offsets[b], mel_inp.n_len);
+            const int i1 = std::min(mel_offsets[b] + 2*n_ctx, mel_inp.n_len);
+
+            for (int j = 0; j < mel_inp.n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+                }
+            }
+        }
+
+        mels[b] = mel;
+    }
+
+    // the input of the first layer: the columns of window b are [b*n_ctx, (b + 1)*n_ctx)
+    struct ggml_tensor * inpL = nullptr;
+
+    if (n_batch > 1) {
+        whisper_use_buf(wstate, ctx0, 3);
+
+        inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch*n_ctx);
+    }
+
+    // the windows are computed one after the other, so that they can reuse the same scratch memory
+    for (int b = 0; b < n_batch; ++b) {
+        struct ggml_tensor * cur;
+
+        // convolution + gelu
+        {
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_conv_1d_1s(ctx0, model.e_conv_1_w, mels[b]);
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        model.e_conv_1_b,
+                        cur),
+                    cur);
+
+            whisper_use_buf(wstate, ctx0, 1);
+
+            cur = ggml_gelu(ctx0, cur);
+
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_conv_1d_2s(ctx0, model.e_conv_2_w, cur);
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        model.e_conv_2_b,
+                        cur),
+                    cur);
+
+            whisper_use_buf(wstate, ctx0, 1);
+
+            cur = ggml_gelu(ctx0, cur);
+        }
+
+        whisper_use_buf(wstate, ctx0, n_batch > 1 ? 0 : 3);
+
+        cur = whisper_encode_pe(wctx, ctx0, cur, n_ctx);
+
+        if (n_batch > 1) {
+            cur = ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, inpL, n_state, n_ctx, inpL->nb[1], b*n_ctx*inpL->nb[1]));
+
+            ggml_build_forward_expand(&gf, cur);
+        } else {
+            inpL = cur;
+        }
+    }
+
+    struct ggml_tensor * cur;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_encoder[il];
+
+        // norm
+        {
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_norm(ctx0, inpL);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
+                        cur),
+                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+        }
+
+        // self-attention
+        {
+            whisper_use_buf(wstate, ctx0, 1);
+
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_q_b,
+                        Qcur),
+                    Qcur);
+
+            //Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            //Kcur = ggml_scale(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_v_b,
+                        Vcur),
+                    Vcur);
+
+            // ------
+
+            whisper_use_buf(wstate, ctx0, 2);
+
+            // the windows are the 4th dimension of the attention
+            struct ggml_tensor * Vcur4 =
+                ggml_view_4d(ctx0, Vcur, n_state/n_head, n_head, n_ctx, n_batch,
+                        ggml_element_size(Vcur)*n_state/n_head, ggml_element_size(Vcur)*n_state, ggml_element_size(Vcur)*n_state*n_ctx, 0);
+
+#ifdef USE_FLASH_ATTN
+            struct ggml_tensor * Q =
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
+                            Qcur,
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx, n_batch)),
+                        0, 2, 1, 3);
+
+            struct ggml_tensor * K =
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
+                            Kcur,
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * V =
-                ggml_cpy(ctxL,
-                        ggml_permute(ctxL,
-                            ggml_reshape_3d(ctxL,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                ggml_cpy(ctx0,
+                        ggml_permute(ctx0,
+                            Vcur4,
                             1, 2, 0, 3),
-                        ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_ctx, n_state/n_head, n_head)
+                        ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, n_ctx, n_state/n_head, n_head, n_batch)
                         );
 
-            struct ggml_tensor * KQV = ggml_flash_attn(ctxL, Q, K, V, false);
+            struct ggml_tensor * KQV = ggml_flash_attn(ctx0, Q, K, V, false);
 #else
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Kcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx)),
+                            ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx, n_batch)),
                         0, 2, 1, 3);
 
             // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
             struct ggml_tensor * KQ_scaled =
-                ggml_scale(ctxL,
+                ggml_scale(ctx0,
                         KQ,
-                        ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+                        ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
                         );
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_scaled);
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_scaled);
 
             //struct ggml_tensor * V_trans =
-            //    ggml_permute(ctxL,
-            //            ggml_cpy(ctxL,
+            //    ggml_permute(ctx0,
+            //            ggml_cpy(ctx0,
             //                Vcur,
-            //                ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx)),
+            //                ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, n_state/n_head, n_head, n_ctx)),
             //            1, 2, 0, 3);
 
-            //struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            //struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
             struct ggml_tensor * V =
-                ggml_cpy(ctxL,
-                        ggml_permute(ctxL,
-                            ggml_reshape_3d(ctxL,
-                                Vcur,
-                                n_state/n_head, n_head, n_ctx),
+                ggml_cpy(ctx0,
+                        ggml_permute(ctx0,
+                            Vcur4,
                             0, 2, 1, 3),
-                        ggml_new_tensor_3d(ctxL, GGML_TYPE_F16, n_state/n_head, n_ctx, n_head)
+                        ggml_new_tensor_4d(ctx0, GGML_TYPE_F16, n_state/n_head, n_ctx, n_head, n_batch)
                         );
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, ggml_transpose(ctxL, V), KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, ggml_transpose(ctx0, V), KQ_soft_max);
 #endif
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            cur = ggml_cpy(ctxL,
+            cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, n_ctx));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_batch*n_ctx));
         }
 
         // projection
         {
-            cur = ggml_mul_mat(ctxL,
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.attn_ln_1_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
                     cur);
         }
 
+        whisper_use_buf(wstate, ctx0, 2);
+
         // add the input
-        cur = ggml_add(ctxL, cur, inpL);
+        cur = ggml_add(ctx0, cur, inpL);
 
         struct ggml_tensor * inpFF = cur;
 
@@ -1325,73 +1861,64 @@ static bool whisper_encode(
         {
             // norm
             {
-                cur = ggml_norm(ctxL, inpFF);
+                whisper_use_buf(wstate, ctx0, 0);
+
+                cur = ggml_norm(ctx0, inpFF);
 
                 // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctxL,
-                        ggml_mul(ctxL,
-                            ggml_repeat(ctxL, layer.mlp_ln_w, cur),
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
                             cur),
-                        ggml_repeat(ctxL, layer.mlp_ln_b, cur));
+                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
             }
 
+            whisper_use_buf(wstate, ctx0, 1);
+
 #ifdef USE_FLASH_FF
-            cur = ggml_flash_ff(ctxL,
-                    ggml_cpy(ctxL, cur, ggml_new_tensor_2d(ctxL, GGML_TYPE_F16, n_state, N)),
+            cur = ggml_flash_ff(ctx0,
+                    ggml_cpy(ctx0, cur, ggml_new_tensor_2d(ctx0, GGML_TYPE_F16, n_state, n_batch*n_ctx)),
                     layer.mlp_0_w, layer.mlp_0_b, layer.mlp_1_w, layer.mlp_1_b);
 #else
             // fully connected
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_0_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
                     cur);
 
+            whisper_use_buf(wstate, ctx0, 0);
+
             // GELU activation
-            cur = ggml_gelu(ctxL, cur);
+            cur = ggml_gelu(ctx0, cur);
+
+            whisper_use_buf(wstate, ctx0, 1);
 
             // projection
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_1_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
                     cur);
 #endif
         }
 
-        // output from this layer
-        struct ggml_tensor * inpO = ggml_add(ctxL, cur, inpFF);
-
-        {
-            struct ggml_cgraph gf = {};
-            gf.n_threads = n_threads;
-
-            ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
-
-            //ggml_graph_print(&gf);
-        }
-
-        // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
-        // input for next layer (inpO -> inpL)
-        memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
-        inpL->op = GGML_OP_NONE;
-        inpL->src0 = NULL;
-        inpL->src1 = NULL;
+        whisper_use_buf(wstate, ctx0, 3);
 
-        //printf("%s: - used_mem(%d) = %f MB\n", __func__, il, ggml_used_mem(ctxL)/1024.0/1024.0);
-
-        ggml_free(ctxL);
+        // output from this layer
+        inpL = ggml_add(ctx0, cur, inpFF);
     }
 
     cur = inpL;
 
     // norm
     {
+        whisper_use_buf(wstate, ctx0, 0);
+
         cur = ggml_norm(ctx0, cur);
 
         // cur = ln_f_g*cur + ln_f_b
@@ -1402,44 +1929,15 @@ static bool whisper_encode(
                 ggml_repeat(ctx0, model.e_ln_b, cur));
     }
 
-    // run the computation
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
-
-        //ggml_graph_print(&gf);
-    }
-
-    // cur
-    //{
-    //    Rprintf("ne0 = %d\n", cur->ne[0]);
-    //    Rprintf("ne1 = %d\n", cur->ne[1]);
-    //    for (int i = 0; i < 10; ++i) {
-    //        Rprintf("%8.4f ", ((float *)(cur->data))[i]);
-    //    }
-    //    Rprintf("... ");
-    //    for (int i = cur->ne[0] - 10; i < cur->ne[0]; ++i) {
-    //        Rprintf("%8.4f ", ((float *)(cur->data))[i]);
-    //    }
-    //    Rprintf("\n");
-    //}
+    ggml_build_forward_expand(&gf, cur);
 
     // pre-compute cross-attention memory
     {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
-        // TODO: hack to disconnect the encoded features from the previous graph
-        cur->op = GGML_OP_NONE;
-        cur->src0 = NULL;
-        cur->src1 = NULL;
-
         for (int il = 0; il < model.hparams.n_text_layer; ++il) {
             auto & layer = model.layers_decoder[il];
 
+            whisper_use_buf(wstate, ctx0, 1);
+
             struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
                     layer.cross_attn_k_w,
                     cur);
@@ -1456,18 +1954,52 @@ static bool whisper_encode(
                         Vcross),
                     Vcross);
 
-            //struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_cross_k, n_state*n_ctx, (ggml_element_size(model.memory_cross_k)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
-            //struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_cross_v, n_state*n_ctx, (ggml_element_size(model.memory_cross_v)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
-            struct ggml_tensor * k = ggml_view_1d(ctx0, model.memory_cross_k, n_state*n_ctx, (ggml_element_size(model.memory_cross_k)*n_state)*(il*n_ctx));
-            struct ggml_tensor * v = ggml_view_1d(ctx0, model.memory_cross_v, n_state*n_ctx, (ggml_element_size(model.memory_cross_v)*n_state)*(il*n_ctx));
+            // each window goes to the memory of its own state
+            for (int b = 0; b < n_batch; ++b) {
+                const auto & ws = *wstates[b];
+
+                //struct ggml_tensor * k = ggml_view_1d(ctx0, ws.memory_cross_k, n_state*n_ctx, (ggml_element_size(ws.memory_cross_k)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
+                //struct ggml_tensor * v = ggml_view_1d(ctx0, ws.memory_cross_v, n_state*n_ctx, (ggml_element_size(ws.memory_cross_v)*n_state)*(il*hparams.n_audio_ctx + iter*n_ctx));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, ws.memory_cross_k, n_state*n_ctx, (ggml_element_size(ws.memory_cross_k)*n_state)*(il*n_ctx));
+                struct ggml_tensor * v = ggml_view_1d(ctx0, ws.memory_cross_v, n_state*n_ctx, (ggml_element_size(ws.memory_cross_v)*n_state)*(il*n_ctx));
+
+                struct ggml_tensor * Kcross_b = n_batch > 1 ? ggml_view_1d(ctx0, Kcross, n_state*n_ctx, b*n_ctx*Kcross->nb[1]) : Kcross;
+                struct ggml_tensor * Vcross_b = n_batch > 1 ? ggml_view_1d(ctx0, Vcross, n_state*n_ctx, b*n_ctx*Vcross->nb[1]) : Vcross;
 
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross, k));
-            ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross, v));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Kcross_b, k));
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, Vcross_b, v));
+            }
         }
+    }
 
+    // the work buffer of the graph is allocated in the context memory
+    whisper_use_buf(wstate, ctx0, -1);
+
+    // run the computation
+    {
         ggml_graph_compute(ctx0, &gf);
+
+        //ggml_graph_print(&gf);
+    }
+
+    if (measure) {
+        whisper_graph_reserve(wstate, ctx0);
     }
 
+    // cur
+    //{
+    //    Rprintf("ne0 = %d\n", cur->ne[0]);
+    //    Rprintf("ne1 = %d\n", cur->ne[1]);
+    //    for (int i = 0; i < 10; ++i) {
+    //        Rprintf("%8.4f ", ((float *)(cur->data))[i]);
+    //    }
+    //    Rprintf("... ");
+    //    for (int i = cur->ne[0] - 10; i < cur->ne[0]; ++i) {
+    //        Rprintf("%8.4f ", ((float *)(cur->data))[i]);
+    //    }
+    //    Rprintf("\n");
+    //}
+
     ////////////////////////////////////////////////////////////////////////////
 
     //printf("%s: used_mem = %f MB\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0);
@@ -1477,51 +2009,71 @@ static bool whisper_encode(
     return true;
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> predicts the probabilities for the next token
+// evaluate the encoder on the window at mel_offset of the spectrogram of the state
+static bool whisper_encode(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_threads,
+        const int mel_offset) {
+    whisper_state * wstates[1] = { &wstate };
+
+    return whisper_encode_batch(wctx, wstates, n_threads, &mel_offset, 1, false);
+}
+
+// build the decoder graph for N tokens reading n_kv key/value entries from the memory
 //
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
+// the tokens are split evenly between n_seq sequences, sequence i uses slot i of the self-attention memory
+// the graph is built for n_past = 0 - the inputs that depend on the position are set by whisper_decode
+// with measure, the graph is built in a measure context, see whisper_graph_init()
 //
-static bool whisper_decode(
-              whisper_context & wctx,
+static void whisper_decoder_graph_build(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+              whisper_decoder_graph & dg,
         const int n_threads,
-        const whisper_token * tokens,
-        const int n_tokens,
-        const int n_past) {
+        const int N,
+        const int n_seq,
+        const int n_kv,
+        const bool measure) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    auto & logits_out = wctx.logits;
-    auto & probs_out  = wctx.probs;
-
-    const int n_vocab = hparams.n_vocab;
-
-    const int n_ctx   = hparams.n_text_ctx;
+    const int n_ctx   = wstate.kv_n_ctx;
     const int n_state = hparams.n_text_state;
     const int n_head  = hparams.n_text_head;
     const int n_layer = hparams.n_text_layer;
 
-    const int N = n_tokens;
-    const int M = wctx.exp_n_audio_ctx > 0 ? wctx.exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int M = wstate.kv_cross_n_ctx;
 
-    struct ggml_init_params params;
-    params.mem_size   = wctx.buf_compute.size();
-    params.mem_buffer = wctx.buf_compute.data();
+    const int n_past = 0;
 
-    struct ggml_context * ctx0 = ggml_init(params);
+    // tokens per sequence
+    const int T = N/n_seq;
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    memcpy(embd->data, tokens, N*ggml_element_size(embd));
+    // strides of the self-attention memory
+    const size_t es       = ggml_element_size(wstate.memory_k);
+    const size_t nb_layer = es*n_state*n_ctx;
+    const size_t nb_slot  = nb_layer*n_layer;
 
+    struct ggml_context * ctx0 = whisper_graph_init(wstate, measure);
+
+    dg.ctx         = ctx0;
+    dg.n_tokens    = N;
+    dg.n_seq       = n_seq;
+    dg.n_kv        = n_kv;
+    dg.n_audio_ctx = M;
+    dg.n_threads   = n_threads;
+
+    struct ggml_cgraph & gf = dg.gf;
+    gf.n_threads = n_threads;
+
+    struct ggml_tensor * embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
     struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-    for (int i = 0; i < N; ++i) {
-        ((int32_t *) position->data)[i] = n_past + i;
-    }
+
+    dg.embd     = embd;
+    dg.position = position;
+
+    whisper_use_buf(wstate, ctx0, 3);
 
     // token encoding + position encoding
     struct ggml_tensor * cur =
@@ -1534,211 +2086,228 @@ static bool whisper_decode(
     for (int il = 0; il < n_layer; ++il) {
         const auto & layer = model.layers_decoder[il];
 
-        struct ggml_init_params paramsL;
-        paramsL.mem_size   = wctx.buf_compute_layer.size();
-        paramsL.mem_buffer = wctx.buf_compute_layer.data();
-
-        struct ggml_context * ctxL = ggml_init(paramsL);
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
-
         // norm
         {
-            cur = ggml_norm(ctxL, inpL);
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_norm(ctx0, inpL);
 
             // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctxL,
-                    ggml_mul(ctxL,
-                        ggml_repeat(ctxL, layer.attn_ln_0_w, cur),
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
                         cur),
-                    ggml_repeat(ctxL, layer.attn_ln_0_b, cur));
+                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
         }
 
         // self-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctxL,
+            whisper_use_buf(wstate, ctx0, 1);
+
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
                         layer.attn_q_b,
                         Qcur),
                     Qcur);
 
-            Qcur = ggml_scale(ctxL, Qcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
             // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctxL,
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
                     layer.attn_k_w,
                     cur);
 
-            Kcur = ggml_scale(ctxL, Kcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            Kcur = ggml_scale(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-            struct ggml_tensor * Vcur = ggml_mul_mat(ctxL,
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
                     layer.attn_v_w,
                     cur);
 
-            Vcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
+            Vcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
                         layer.attn_v_b,
                         Vcur),
                     Vcur);
 
             // store key and value to memory
             {
-                struct ggml_tensor * k = ggml_view_1d(ctxL, model.memory_k, N*n_state, (ggml_element_size(model.memory_k)*n_state)*(il*n_ctx + n_past));
-                struct ggml_tensor * v = ggml_view_1d(ctxL, model.memory_v, N*n_state, (ggml_element_size(model.memory_v)*n_state)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_3d(ctx0, wstate.memory_k, n_state, T, n_seq, es*n_state, nb_slot, il*nb_layer + es*n_state*n_past);
+                struct ggml_tensor * v = ggml_view_3d(ctx0, wstate.memory_v, n_state, T, n_seq, es*n_state, nb_slot, il*nb_layer + es*n_state*n_past);
+
+                dg.store_k.push_back(ggml_cpy(ctx0, Kcur, k));
+                dg.store_v.push_back(ggml_cpy(ctx0, Vcur, v));
 
-                ggml_build_forward_expand(&gf, ggml_cpy(ctxL, Kcur, k));
-                ggml_build_forward_expand(&gf, ggml_cpy(ctxL, Vcur, v));
+                ggml_build_forward_expand(&gf, dg.store_k.back());
+                ggml_build_forward_expand(&gf, dg.store_v.back());
             }
 
             // ------
 
+            whisper_use_buf(wstate, ctx0, 2);
+
+            // the sequences are the 4th dimension of the attention
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
-                            Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                ggml_permute(ctx0,
+                        ggml_view_4d(ctx0, Qcur, n_state/n_head, n_head, T, n_seq,
+                            ggml_element_size(Qcur)*n_state/n_head, ggml_element_size(Qcur)*n_state, ggml_element_size(Qcur)*n_state*T, 0),
                         0, 2, 1, 3);
 
             struct ggml_tensor * K =
-                ggml_permute(ctxL,
-                        ggml_reshape_3d(ctxL,
-                            ggml_view_1d(ctxL, model.memory_k, (n_past + N)*n_state, il*n_ctx*ggml_element_size(model.memory_k)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                ggml_permute(ctx0,
+                        ggml_view_4d(ctx0, wstate.memory_k, n_state/n_head, n_head, n_kv, n_seq,
+                            es*n_state/n_head, es*n_state, nb_slot, il*nb_layer),
                         0, 2, 1, 3);
 
             // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
             //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctxL,
+            //    ggml_scale(ctx0,
             //            KQ,
-            //            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
             //            );
 
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctxL, KQ, n_past);
+            // the entries after n_past + N are masked as well
+            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ_masked);
+            // the value of n_past is stored in the second source of the mask
+            dg.n_past.push_back(KQ_masked->src1);
+
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
 
             struct ggml_tensor * V_trans =
-                ggml_permute(ctxL,
-                        ggml_reshape_3d(ctxL,
-                            ggml_view_1d(ctxL, model.memory_v, (n_past + N)*n_state, il*n_ctx*ggml_element_size(model.memory_v)*n_state),
-                            n_state/n_head, n_head, n_past + N),
+                ggml_permute(ctx0,
+                        ggml_view_4d(ctx0, wstate.memory_v, n_state/n_head, n_head, n_kv, n_seq,
+                            es*n_state/n_head, es*n_state, nb_slot, il*nb_layer),
                         1, 2, 0, 3);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-            cur = ggml_cpy(ctxL,
+            cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
         }
 
         {
-            cur = ggml_mul_mat(ctxL,
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
                     layer.attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.attn_ln_1_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
                     cur);
         }
 
+        whisper_use_buf(wstate, ctx0, 1);
+
         // add the input
-        struct ggml_tensor * inpCA = ggml_add(ctxL, cur, inpL);
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
 
         // norm
         {
-            cur = ggml_norm(ctxL, inpCA); // note: we use inpCA here
+            whisper_use_buf(wstate, ctx0, 2);
+
+            cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
 
             // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctxL,
-                    ggml_mul(ctxL,
-                        ggml_repeat(ctxL, layer.cross_attn_ln_0_w, cur),
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.cross_attn_ln_0_w, cur),
                         cur),
-                    ggml_repeat(ctxL, layer.cross_attn_ln_0_b, cur));
+                    ggml_repeat(ctx0, layer.cross_attn_ln_0_b, cur));
         }
 
         // cross-attention
         {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctxL,
+            whisper_use_buf(wstate, ctx0, 0);
+
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.cross_attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctxL,
-                    ggml_repeat(ctxL,
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
                         layer.cross_attn_q_b,
                         Qcur),
                     Qcur);
 
-            Qcur = ggml_scale(ctxL, Qcur, ggml_new_f32(ctxL, pow(float(n_state)/n_head, -0.25)));
+            Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
             // Kcross is already scaled
             struct ggml_tensor * Kcross =
-                ggml_reshape_3d(ctxL,
-                        ggml_view_1d(ctxL, model.memory_cross_k, M*n_state, il*M*ggml_element_size(model.memory_cross_k)*n_state),
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, wstate.memory_cross_k, M*n_state, il*M*ggml_element_size(wstate.memory_cross_k)*n_state),
                         n_state/n_head, n_head, M);
 
             struct ggml_tensor * Vcross =
-                ggml_reshape_3d(ctxL,
-                        ggml_view_1d(ctxL, model.memory_cross_v, M*n_state, il*M*ggml_element_size(model.memory_cross_v)*n_state),
+                ggml_reshape_3d(ctx0,
+                        ggml_view_1d(ctx0, wstate.memory_cross_v, M*n_state, il*M*ggml_element_size(wstate.memory_cross_v)*n_state),
                         n_state/n_head, n_head, M);
 
             // ------
 
+            whisper_use_buf(wstate, ctx0, 2);
+
             struct ggml_tensor * Q =
-                ggml_permute(ctxL,
-                        ggml_cpy(ctxL,
+                ggml_permute(ctx0,
+                        ggml_cpy(ctx0,
                             Qcur,
-                            ggml_new_tensor_3d(ctxL, GGML_TYPE_F32, n_state/n_head, n_head, N)),
+                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_state/n_head, n_head, N)),
                         0, 2, 1, 3);
 
-            struct ggml_tensor * K = ggml_permute(ctxL, Kcross, 0, 2, 1, 3);
+            struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
 
             // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctxL, K, Q);
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
             //struct ggml_tensor * KQ_scaled =
-            //    ggml_scale(ctxL,
+            //    ggml_scale(ctx0,
             //            KQ,
-            //            ggml_new_f32(ctxL, 1.0f/sqrt(float(n_state)/n_head))
+            //            ggml_new_f32(ctx0, 1.0f/sqrt(float(n_state)/n_head))
             //            );
 
             // no masking for cross-attention
-            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctxL, KQ_scaled, n_past);
+            //struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled, n_past);
 
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctxL, KQ);
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
 
-            struct ggml_tensor * V_trans = ggml_permute(ctxL, Vcross, 1, 2, 0, 3);
+            struct ggml_tensor * V_trans = ggml_permute(ctx0, Vcross, 1, 2, 0, 3);
 
-            struct ggml_tensor * KQV = ggml_mul_mat(ctxL, V_trans, KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
 
-            struct ggml_tensor * KQV_merged = ggml_permute(ctxL, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
             // cur = KQV_merged.contiguous().view(n_state, N)
-            cur = ggml_cpy(ctxL,
+            cur = ggml_cpy(ctx0,
                     KQV_merged,
-                    ggml_new_tensor_2d(ctxL, GGML_TYPE_F32, n_state, N));
+                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N));
         }
 
         // projection
         {
-            cur = ggml_mul_mat(ctxL,
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
                     layer.cross_attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.cross_attn_ln_1_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
                     cur);
         }
 
+        whisper_use_buf(wstate, ctx0, 2);
+
         // add the input
-        cur = ggml_add(ctxL, cur, inpCA);
+        cur = ggml_add(ctx0, cur, inpCA);
 
         struct ggml_tensor * inpFF = cur;
 
@@ -1746,66 +2315,63 @@ static bool whisper_decode(
         {
             // norm
             {
-                cur = ggml_norm(ctxL, inpFF);
+                whisper_use_buf(wstate, ctx0, 0);
+
+                cur = ggml_norm(ctx0, inpFF);
 
                 // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctxL,
-                        ggml_mul(ctxL,
-                            ggml_repeat(ctxL, layer.mlp_ln_w, cur),
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
                             cur),
-                        ggml_repeat(ctxL, layer.mlp_ln_b, cur));
+                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
             }
 
+            whisper_use_buf(wstate, ctx0, 1);
+
             // fully connected
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_0_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_0_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
                     cur);
 
+            whisper_use_buf(wstate, ctx0, 0);
+
             // GELU activation
-            cur = ggml_gelu(ctxL, cur);
+            cur = ggml_gelu(ctx0, cur);
+
+            whisper_use_buf(wstate, ctx0, 1);
 
             // projection
-            cur = ggml_mul_mat(ctxL,
+            cur = ggml_mul_mat(ctx0,
                     layer.mlp_1_w,
                     cur);
 
-            cur = ggml_add(ctxL,
-                    ggml_repeat(ctxL, layer.mlp_1_b, cur),
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
                     cur);
         }
 
-        // output from this layer
-        struct ggml_tensor * inpO = ggml_add(ctxL, cur, inpFF);
-
-        {
-            ggml_build_forward_expand(&gf, inpO);
-            ggml_graph_compute       (ctxL, &gf);
-
-            //ggml_graph_print(&gf);
-        }
-
-        // TODO: this is a hack to have per-layer computation graphs - need to come up with something better
-        // input for next layer (inpO -> inpL)
-        memcpy(inpL->data, inpO->data, ggml_nbytes(inpL));
-        inpL->op = GGML_OP_NONE;
-        inpL->src0 = NULL;
-        inpL->src1 = NULL;
-
-        if (N > 1) {
-            //printf("%s: - used_mem(%d) = %f MB\n", __func__, il, ggml_used_mem(ctxL)/1024.0/1024.0);
-        }
+        whisper_use_buf(wstate, ctx0, 3);
 
-        ggml_free(ctxL);
+        // output from this layer
+        inpL = ggml_add(ctx0, cur, inpFF);
     }
 
-    cur = inpL;
+    // only the last position of each sequence is used to predict its next token
+    if (n_seq == 1) {
+        cur = ggml_view_1d(ctx0, inpL, n_state, (N - 1)*n_state*ggml_element_size(inpL));
+    } else {
+        cur = ggml_view_2d(ctx0, inpL, n_state, n_seq, T*n_state*ggml_element_size(inpL), (T - 1)*n_state*ggml_element_size(inpL));
+    }
 
     // norm
     {
+        whisper_use_buf(wstate, ctx0, 0);
+
         cur = ggml_norm(ctx0, cur);
 
         cur = ggml_add(ctx0,
@@ -1815,474 +2381,2040 @@ static bool whisper_decode(
                 ggml_repeat(ctx0, model.d_ln_b, cur));
     }
 
+    // the logits and the probabilities are read after the computation, together with the work buffer
+    // they are allocated in the context memory
+    whisper_use_buf(wstate, ctx0, -1);
+
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
     // logits -> probs
     cur = ggml_dup(ctx0, logits);
     cur = ggml_soft_max(ctx0, cur); // in-place
 
-    // run the computation
-    {
-        struct ggml_cgraph gf = {};
-        gf.n_threads = n_threads;
+    ggml_build_forward_expand(&gf, cur);
 
-        ggml_build_forward_expand(&gf, cur);
-        ggml_graph_compute       (ctx0, &gf);
-    }
+    //ggml_graph_print(&gf);
+
+    dg.logits = logits;
+    dg.probs  = cur;
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> predicts the probabilities for the next token
+//
+//   - wctx:       the model
+//   - wstate:     the state holding the key/value memory, the results are stored in its logits and probs
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//   - n_seq:      number of sequences the prompt is split in, the probabilities are computed for each of them
+//
+static bool whisper_decode(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_threads,
+        const whisper_token * tokens,
+        const int n_tokens,
+        const int n_past,
+        const int n_seq) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-    logits_out.resize(N*n_vocab);
-    memcpy(logits_out.data(), ggml_get_data(logits), sizeof(float)*N*n_vocab);
+    auto & logits_out = wstate.logits;
+    auto & probs_out  = wstate.probs;
 
-    probs_out.resize(N*n_vocab);
-    memcpy(probs_out.data(), ggml_get_data(cur), sizeof(float)*N*n_vocab);
+    const int n_vocab = hparams.n_vocab;
 
-    if (N > 1) {
-        //const float mem_per_token = ggml_used_mem(ctx0)/1024.0/1024.0/N;
-        //printf("%s: used_mem = %f MB / %f per token\n", __func__, ggml_used_mem(ctx0)/1024.0/1024.0, mem_per_token);
-        //printf("%s: max mem = %f MB\n", __func__, mem_per_token*model.hparams.n_text_ctx);
+    // without whisper_full(), the self-attention memory holds 1 sequence of the full text context
+    if (wstate.kv_n_slots == 0 && !whisper_kv_self_init(wctx, wstate, 1, hparams.n_text_ctx)) {
+        return false;
     }
 
-    ggml_free(ctx0);
+    const int n_ctx   = wstate.kv_n_ctx;
+    const int n_state = hparams.n_text_state;
+    const int n_layer = hparams.n_text_layer;
 
-    return true;
-}
+    const int N = n_tokens;
+    const int M = wstate.kv_cross_n_ctx;
 
-// the most basic sampling scheme - select the top token
-static whisper_token_data whisper_sample_best(
-        const whisper_vocab & vocab,
-        const float * probs,
-              bool force_timestamp,
-              bool is_initial) {
-    whisper_token_data result = {
-        0, 0, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
-    };
+    // tokens per sequence
+    const int T = N/n_seq;
 
-    int n_logits = vocab.id_to_token.size();
+    if (T*n_seq != N) {
+        Rprintf("%s: cannot split %d tokens in %d sequences\n", __func__, N, n_seq);
+        return false;
+    }
 
-    std::vector<std::pair<double, whisper_vocab::id>> probs_id;
-    probs_id.reserve(n_logits);
+    if (n_seq > wstate.kv_n_slots) {
+        Rprintf("%s: the memory holds %d sequences, %d requested\n", __func__, wstate.kv_n_slots, n_seq);
+        return false;
+    }
 
-    for (int i = 0; i < n_logits; i++) {
-        probs_id.push_back(std::make_pair(probs[i], i));
+    if (n_past < 0 || n_past + T > n_ctx) {
+        Rprintf("%s: the memory holds %d text positions, %d requested\n", __func__, n_ctx, n_past + T);
+        return false;
     }
 
-    {
-        double sum_ts =  0.0;
-        double max_ts = -1.0;
-        double max_tx = -1.0;
+    if (M == 0) {
+        Rprintf("%s: the audio has not been encoded\n", __func__);
+        return false;
+    }
 
-        for (int i = 0; i < vocab.token_beg; i++) {
-            max_tx = std::max(max_tx, probs_id[i].first);
-        }
+    const int n_kv = std::min(n_ctx, ((n_past + T + WHISPER_KV_PAD - 1)/WHISPER_KV_PAD)*WHISPER_KV_PAD);
 
-        const auto i0 = is_initial ? vocab.token_beg + 101 : vocab.token_beg;
-        const auto i1 = is_initial ? vocab.token_beg + 101 : n_logits;
+    struct ggml_threadpool * threadpool = whisper_get_threadpool(wstate, n_threads);
 
-        // the initial timestamp cannot be larger than 100
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
-        if (is_initial) {
-            for (int i = i0; i < n_logits; ++ i) {
-                probs_id[i].first = -INFINITY;
-            }
-        }
+    auto & dg = wstate.decoder_graph;
 
-        for (int i = vocab.token_beg; i < i1; i++) {
-            sum_ts += probs_id[i].first;
-            if  (probs_id[i].first > max_ts) {
-                max_ts = probs_id[i].first;
-                result.tid = probs_id[i].second;
-            }
-        }
+    if (dg.ctx == nullptr || dg.n_tokens != N || dg.n_seq != n_seq || dg.n_kv != n_kv || dg.n_audio_ctx != M || dg.n_threads != n_threads) {
+        whisper_decoder_graph_free(dg);
 
-        // if the probability sum of all timestamp tokens is higher than the max probability of the text tokens - sample a
-        // timestamp token
-        if (sum_ts > max_tx || force_timestamp) {
-            // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L430-L438
-            for (int i = 0; i < vocab.token_beg; i++) {
-                probs_id[i].first = -INFINITY;
-            }
+        // the graph is measured before it is built in the compute buffers
+        {
+            whisper_decoder_graph dg_measure;
+            whisper_decoder_graph_build(wctx, wstate, dg_measure, n_threads, N, n_seq, n_kv, true);
+
+            ggml_graph_compute(dg_measure.ctx, &dg_measure.gf);
+
+            whisper_graph_reserve(wstate, dg_measure.ctx);
+            whisper_decoder_graph_free(dg_measure);
         }
 
-        result.pt = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+        whisper_decoder_graph_build(wctx, wstate, dg, n_threads, N, n_seq, n_kv, false);
     }
 
-    // find the top K tokens
-    const int top_k = 4;
+    // set the inputs of the graph
+    memcpy(dg.embd->data, tokens, N*ggml_element_size(dg.embd));
 
-    std::partial_sort(
-            probs_id.begin(),
-            probs_id.begin() + top_k, probs_id.end(),
-            [](const std::pair<double, whisper_vocab::id> & a, const std::pair<double, whisper_vocab::id> & b) {
-        return a.first > b.first;
-    });
+    for (int i = 0; i < N; ++i) {
+        ((int32_t *) dg.position->data)[i] = n_past + i%T;
+    }
 
-    probs_id.resize(top_k);
+    for (int il = 0; il < n_layer; ++il) {
+        ((int32_t *) dg.n_past[il]->data)[0] = n_past;
 
-    //printf("\n");
-    //for (int i = 0; i < (int) probs_id.size(); i++) {
-    //    Rprintf("%d: '%s' %f, %d\n", i, vocab.id_to_token.at(probs_id[i].second).c_str(), probs_id[i].first, probs_id[i].second);
-    //}
+        // the copies write to their view of the memory
+        struct ggml_tensor * k = dg.store_k[il];
+        struct ggml_tensor * v = dg.store_v[il];
 
-    int res = 0;
-    while ((probs_id[res].second == vocab.token_sot ||
-            probs_id[res].second == vocab.token_solm ||
-            probs_id[res].second == vocab.token_not) &&
-            res < (int) probs_id.size() - 1) {
-        res++;
+        k->data = k->src1->data = (char *) wstate.memory_k->data + (ggml_element_size(wstate.memory_k)*n_state)*(il*n_ctx + n_past);
+        v->data = v->src1->data = (char *) wstate.memory_v->data + (ggml_element_size(wstate.memory_v)*n_state)*(il*n_ctx + n_past);
     }
 
-    result.id = probs_id[res].second;
-    result.p  = probs_id[res].first;
+    // run the computation
+    {
+        dg.gf.threadpool = threadpool;
 
-    return result;
+        ggml_graph_compute(dg.ctx, &dg.gf);
+    }
+
+    logits_out.resize(n_vocab*n_seq);
+    memcpy(logits_out.data(), ggml_get_data(dg.logits), sizeof(float)*n_vocab*n_seq);
+
+    probs_out.resize(n_vocab*n_seq);
+    memcpy(probs_out.data(), ggml_get_data(dg.probs), sizeof(float)*n_vocab*n_seq);
+
+    return true;
 }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
-    msec = msec - min * (1000 * 60);
-    int64_t sec = msec / 1000;
-    msec = msec - sec * 1000;
+// a sequence of a batched decoder call
+struct whisper_decode_seq {
+    whisper_state * state; // holds the cross-attention memory and the self-attention memory of the sequence
+    int slot;              // slot of the self-attention memory
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    const whisper_token * tokens;
+    int n_tokens;
+    int n_past;
+};
 
-    return std::string(buf);
+// number of sequences whose graph fits in GGML_MAX_NODES nodes
+// the layers have about 48 nodes that all the sequences share and 33 nodes of attention for each sequence
+static int whisper_decode_batch_n_seq_max(const whisper_hparams & hparams) {
+    const int n_layer = hparams.n_text_layer;
+
+    return std::max(1, (GGML_MAX_NODES - 48*n_layer - 32)/(33*n_layer));
 }
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const std::vector<float> & in, std::vector<float> & out) {
-    int N = in.size();
+// evaluate the decoder on independent sequences
+//
+// each sequence continues the decoding of its own state and slot, with its own number of past tokens and its own
+// cross-attention memory, so the sequences can come from different windows, files or beams
+// the weights multiply the tokens of all the sequences at once, the attention is computed per sequence
+//
+//   - wctx:      the model
+//   - wstate:    the state whose buffers and threads are used for the computation
+//   - n_threads: number of threads to use
+//   - seqs:      the sequences, the probabilities of the next token of a sequence are stored in the row 'slot'
+//                of the logits and probs of its state
+//   - measure:   only grow the compute buffers of wstate to the memory of the graph
+//
+static bool whisper_decode_batch(
+        const whisper_context & wctx,
+              whisper_state & wstate,
+        const int n_threads,
+        const std::vector<whisper_decode_seq> & seqs,
+        const bool measure) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-    out.resize(N*2);
+    const int n_vocab = hparams.n_vocab;
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
 
-        for (int n = 0; n < N; n++) {
-            float angle = 2*M_PI*k*n/N;
-            re += in[n]*cos(angle);
-            im -= in[n]*sin(angle);
-        }
+    const int n_seq = seqs.size();
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+    // the tokens of sequence i are [seq_off[i], seq_off[i + 1])
+    std::vector<int> seq_off(n_seq + 1, 0);
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(const std::vector<float> & in, std::vector<float> & out) {
-    out.resize(in.size()*2);
+    for (int i = 0; i < n_seq; ++i) {
+        const auto & seq = seqs[i];
 
-    int N = in.size();
+        // without whisper_full(), the self-attention memory holds 1 sequence of the full text context
+        if (seq.state->kv_n_slots == 0 && !whisper_kv_self_init(wctx, *seq.state, 1, hparams.n_text_ctx)) {
+            return false;
+        }
 
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+        if (seq.n_tokens < 1 || seq.n_past < 0 || seq.n_past + seq.n_tokens > seq.state->kv_n_ctx) {
+            Rprintf("%s: sequence %d does not fit in the text context\n", __func__, i);
+            return false;
+        }
+        if (seq.state->kv_cross_n_ctx == 0) {
+            Rprintf("%s: the audio of sequence %d has not been encoded\n", __func__, i);
+            return false;
+        }
+        if (seq.slot < 0 || seq.slot >= seq.state->kv_n_slots) {
+            Rprintf("%s: the memory holds %d sequences, slot %d requested\n", __func__, seq.state->kv_n_slots, seq.slot);
+            return false;
+        }
+        for (int j = 0; j < i; ++j) {
+            if (seqs[j].state == seq.state && seqs[j].slot == seq.slot) {
+                Rprintf("%s: each sequence of a batch needs its own slot\n", __func__);
+                return false;
+            }
+        }
+
+        seq_off[i + 1] = seq_off[i] + seq.n_tokens;
     }
 
-    if (N%2 == 1) {
-        dft(in, out);
-        return;
+    // the attention is built for each sequence, larger batches are computed in parts that fit in a graph
+    const int n_seq_max = whisper_decode_batch_n_seq_max(hparams);
+    if (n_seq > n_seq_max) {
+        for (int i0 = 0; i0 < n_seq; i0 += n_seq_max) {
+            const std::vector<whisper_decode_seq> part(seqs.begin() + i0, seqs.begin() + std::min(n_seq, i0 + n_seq_max));
+            if (!whisper_decode_batch(wctx, wstate, n_threads, part, measure)) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    std::vector<float> even;
-    std::vector<float> odd;
+    const int N = seq_off[n_seq];
 
-    for (int i = 0; i < N; i++) {
-        if (i % 2 == 0) {
-            even.push_back(in[i]);
-        } else {
-            odd.push_back(in[i]);
-        }
+    // the graph is measured before it is built in the compute buffers
+    if (!measure && !whisper_decode_batch(wctx, wstate, n_threads, seqs, true)) {
+        return false;
     }
 
-    std::vector<float> even_fft;
-    std::vector<float> odd_fft;
+    struct ggml_threadpool * threadpool = whisper_get_threadpool(wstate, n_threads);
+
+    // the graph is built in the compute buffer
+    whisper_decoder_graph_free(wstate.decoder_graph);
 
-    fft(even, even_fft);
-    fft(odd, odd_fft);
+    struct ggml_context * ctx0 = whisper_graph_init(wstate, measure);
 
-    for (int k = 0; k < N/2; k++) {
-        float theta = 2*M_PI*k/N;
+    struct ggml_cgraph gf = {};
+    gf.n_threads = n_threads;
+    gf.threadpool = threadpool;
 
-        float re = cos(theta);
-        float im = -sin(theta);
+    struct ggml_tensor * embd     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    struct ggml_tensor * last     = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_seq);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+    for (int i = 0; i < n_seq && !measure; ++i) {
+        const auto & seq = seqs[i];
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        for (int j = 0; j < seq.n_tokens; ++j) {
+            ((int32_t *) embd->data)[seq_off[i] + j]     = seq.tokens[j];
+            ((int32_t *) position->data)[seq_off[i] + j] = seq.n_past + j;
+        }
 
-        out[2*(k + N/2) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + N/2) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        ((int32_t *) last->data)[i] = seq_off[i + 1] - 1;
     }
-}
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
-static bool log_mel_spectrogram(
-    const float * samples,
-    const int n_samples,
-    const int sample_rate,
-    const int fft_size,
-    const int fft_step,
-    const int n_mel,
-    const int n_threads,
-    const whisper_filters & filters,
-    const bool speed_up,
-    whisper_mel & mel) {
+    whisper_use_buf(wstate, ctx0, 3);
 
-    // Hanning window
-    std::vector<float> hann;
-    hann.resize(fft_size);
-    for (int i = 0; i < fft_size; i++) {
-        hann[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(fft_size)));
-    }
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
 
-    mel.n_mel = n_mel;
-    mel.n_len = (n_samples)/fft_step;
-    mel.data.resize(mel.n_mel*mel.n_len);
+    struct ggml_tensor * inpL = cur;
 
-    const int n_fft = 1 + (speed_up ? fft_size/4 : fft_size/2);
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
 
-    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
-    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+        // norm
+        {
+            whisper_use_buf(wstate, ctx0, 0);
 
-    std::vector<std::thread> workers(n_threads);
-    for (int iw = 0; iw < n_threads; ++iw) {
-        workers[iw] = std::thread([&](int ith) {
-            std::vector<float> fft_in;
-            fft_in.resize(fft_size);
-            for (int i = 0; i < fft_size; i++) {
-                fft_in[i] = 0.0;
-            }
+            cur = ggml_norm(ctx0, inpL);
 
-            std::vector<float> fft_out;
-            fft_out.resize(2*fft_size);
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.attn_ln_0_w, cur),
+                        cur),
+                    ggml_repeat(ctx0, layer.attn_ln_0_b, cur));
+        }
 
-            for (int i = ith; i < mel.n_len; i += n_threads) {
-                const int offset = i*fft_step;
+        // self-attention
+        {
+            whisper_use_buf(wstate, ctx0, 1);
 
-                // apply Hanning window
-                for (int j = 0; j < fft_size; j++) {
-                    if (offset + j < n_samples) {
-                        fft_in[j] = hann[j]*samples[offset + j];
-                    } else {
-                        fft_in[j] = 0.0;
-                    }
-                }
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
 
-                // FFT -> mag^2
-                fft(fft_in, fft_out);
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_q_b,
+                        Qcur),
+                    Qcur);
 
-                for (int j = 0; j < fft_size; j++) {
-                    fft_out[j] = (fft_out[2*j + 0]*fft_out[2*j + 0] + fft_out[2*j + 1]*fft_out[2*j + 1]);
-                }
-                for (int j = 1; j < fft_size/2; j++) {
-                    //if (i == 0) {
-                    //    Rprintf("%d: %f %f\n", j, fft_out[j], fft_out[fft_size - j]);
-                    //}
-                    fft_out[j] += fft_out[fft_size - j];
-                }
-                if (i == 0) {
-                    //for (int j = 0; j < fft_size; j++) {
-                    //    Rprintf("%d: %e\n", j, fft_out[j]);
-                    //}
-                }
+            Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
 
-                if (speed_up) {
-                    // scale down in the frequency domain results in a speed up in the time domain
-                    for (int j = 0; j < n_fft; j++) {
-                        fft_out[j] = 0.5*(fft_out[2*j] + fft_out[2*j + 1]);
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.attn_v_b,
+                        Vcur),
+                    Vcur);
+
+            // ------
+
+            whisper_use_buf(wstate, ctx0, 2);
+
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
+
+            for (int i = 0; i < n_seq; ++i) {
+                const auto & seq = seqs[i];
+                const auto & ws  = *seq.state;
+
+                const int T      = seq.n_tokens;
+                const int n_past = seq.n_past;
+
+                const size_t es       = ggml_element_size(ws.memory_k);
+                const size_t offs_mem = es*n_state*ws.kv_n_ctx*(seq.slot*n_layer + il);
+
+                // store key and value to memory, before they are read by the attention of the sequence
+                {
+                    struct ggml_tensor * k = ggml_view_1d(ctx0, ws.memory_k, n_state*T, offs_mem + es*n_state*n_past);
+                    struct ggml_tensor * v = ggml_view_1d(ctx0, ws.memory_v, n_state*T, offs_mem + es*n_state*n_past);
+
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_1d(ctx0, Kcur, n_state*T, seq_off[i]*Kcur->nb[1]), k));
+                    ggml_build_forward_expand(&gf, ggml_cpy(ctx0, ggml_view_1d(ctx0, Vcur, n_state*T, seq_off[i]*Vcur->nb[1]), v));
+                }
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, Qcur, n_state/n_head, n_head, T,
+                                ggml_element_size(Qcur)*n_state/n_head, Qcur->nb[1], seq_off[i]*Qcur->nb[1]),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, ws.memory_k, n_state/n_head, n_head, n_past + T,
+                                es*n_state/n_head, es*n_state, offs_mem),
+                            0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ, n_past);
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ_masked);
+
+                struct ggml_tensor * V_trans =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, ws.memory_v, n_state/n_head, n_head, n_past + T,
+                                es*n_state/n_head, es*n_state, offs_mem),
+                            1, 2, 0, 3);
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, KQV_merged, ggml_view_2d(ctx0, cur, n_state, T, cur->nb[1], seq_off[i]*cur->nb[1])));
+            }
+        }
+
+        {
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.attn_ln_1_b, cur),
+                    cur);
+        }
+
+        whisper_use_buf(wstate, ctx0, 1);
+
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+
+        // norm
+        {
+            whisper_use_buf(wstate, ctx0, 2);
+
+            cur = ggml_norm(ctx0, inpCA); // note: we use inpCA here
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        ggml_repeat(ctx0, layer.cross_attn_ln_0_w, cur),
+                        cur),
+                    ggml_repeat(ctx0, layer.cross_attn_ln_0_b, cur));
+        }
+
+        // cross-attention
+        {
+            whisper_use_buf(wstate, ctx0, 0);
+
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                    ggml_repeat(ctx0,
+                        layer.cross_attn_q_b,
+                        Qcur),
+                    Qcur);
+
+            Qcur = ggml_scale(ctx0, Qcur, ggml_new_f32(ctx0, pow(float(n_state)/n_head, -0.25)));
+
+            // ------
+
+            whisper_use_buf(wstate, ctx0, 2);
+
+            cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, N);
+
+            for (int i = 0; i < n_seq; ++i) {
+                const auto & ws = *seqs[i].state;
+
+                const int T = seqs[i].n_tokens;
+                const int M = ws.kv_cross_n_ctx;
+
+                // Kcross is already scaled
+                struct ggml_tensor * Kcross =
+                    ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, ws.memory_cross_k, M*n_state, il*M*ggml_element_size(ws.memory_cross_k)*n_state),
+                            n_state/n_head, n_head, M);
+
+                struct ggml_tensor * Vcross =
+                    ggml_reshape_3d(ctx0,
+                            ggml_view_1d(ctx0, ws.memory_cross_v, M*n_state, il*M*ggml_element_size(ws.memory_cross_v)*n_state),
+                            n_state/n_head, n_head, M);
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, Qcur, n_state/n_head, n_head, T,
+                                ggml_element_size(Qcur)*n_state/n_head, Qcur->nb[1], seq_off[i]*Qcur->nb[1]),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K = ggml_permute(ctx0, Kcross, 0, 2, 1, 3);
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                // no masking for cross-attention
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max(ctx0, KQ);
+
+                struct ggml_tensor * V_trans = ggml_permute(ctx0, Vcross, 1, 2, 0, 3);
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_trans, KQ_soft_max);
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                ggml_build_forward_expand(&gf, ggml_cpy(ctx0, KQV_merged, ggml_view_2d(ctx0, cur, n_state, T, cur->nb[1], seq_off[i]*cur->nb[1])));
+            }
+        }
+
+        // projection
+        {
+            whisper_use_buf(wstate, ctx0, 0);
+
+            cur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.cross_attn_ln_1_b, cur),
+                    cur);
+        }
+
+        whisper_use_buf(wstate, ctx0, 2);
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                whisper_use_buf(wstate, ctx0, 0);
+
+                cur = ggml_norm(ctx0, inpFF);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            ggml_repeat(ctx0, layer.mlp_ln_w, cur),
+                            cur),
+                        ggml_repeat(ctx0, layer.mlp_ln_b, cur));
+            }
+
+            whisper_use_buf(wstate, ctx0, 1);
+
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_0_b, cur),
+                    cur);
+
+            whisper_use_buf(wstate, ctx0, 0);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            whisper_use_buf(wstate, ctx0, 1);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    ggml_repeat(ctx0, layer.mlp_1_b, cur),
+                    cur);
+        }
+
+        whisper_use_buf(wstate, ctx0, 3);
+
+        // output from this layer
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    // norm
+    {
+        whisper_use_buf(wstate, ctx0, 0);
+
+        // only the last position of each sequence is used to predict its next token
+        cur = ggml_get_rows(ctx0, inpL, last);
+
+        cur = ggml_norm(ctx0, cur);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    ggml_repeat(ctx0, model.d_ln_w, cur),
+                    cur),
+                ggml_repeat(ctx0, model.d_ln_b, cur));
+    }
+
+    // the logits and the probabilities are read after the computation, together with the work buffer
+    // they are allocated in the context memory
+    whisper_use_buf(wstate, ctx0, -1);
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+
+    // logits -> probs
+    cur = ggml_dup(ctx0, logits);
+    cur = ggml_soft_max(ctx0, cur); // in-place
+
+    ggml_build_forward_expand(&gf, cur);
+
+    // run the computation
+    {
+        ggml_graph_compute(ctx0, &gf);
+    }
+
+    if (measure) {
+        whisper_graph_reserve(wstate, ctx0);
+        ggml_free(ctx0);
+
+        return true;
+    }
+
+    for (int i = 0; i < n_seq; ++i) {
+        auto & ws = *seqs[i].state;
+
+        const size_t n_out = n_vocab*(seqs[i].slot + 1);
+
+        if (ws.logits.size() < n_out) {
+            ws.logits.resize(n_out);
+        }
+        if (ws.probs.size() < n_out) {
+            ws.probs.resize(n_out);
+        }
+
+        memcpy(ws.logits.data() + n_vocab*seqs[i].slot, (float *) ggml_get_data(logits) + n_vocab*i, sizeof(float)*n_vocab);
+        memcpy(ws.probs.data()  + n_vocab*seqs[i].slot, (float *) ggml_get_data(cur)    + n_vocab*i, sizeof(float)*n_vocab);
+    }
+
+    ggml_free(ctx0);
+
+    return true;
+}
+
+// apply the timestamp rules to the probabilities of the next token and return the top_k tokens
+// the timestamp data of the position (tid, pt, ptsum) is the same in all of them
+static std::vector<whisper_token_data> whisper_sample_top_k(
+        const whisper_vocab & vocab,
+        const float * probs,
+              bool force_timestamp,
+              bool is_initial,
+              int top_k) {
+    whisper_token_data result = {
+        0, 0, 0.0f, 0.0f, 0.0f, -1, -1, 0.0f,
+    };
+
+    int n_logits = vocab.id_to_token.size();
+
+    std::vector<std::pair<double, whisper_vocab::id>> probs_id;
+    probs_id.reserve(n_logits);
+
+    for (int i = 0; i < n_logits; i++) {
+        probs_id.push_back(std::make_pair(probs[i], i));
+    }
+
+    {
+        double sum_ts =  0.0;
+        double max_ts = -1.0;
+        double max_tx = -1.0;
+
+        for (int i = 0; i < vocab.token_beg; i++) {
+            max_tx = std::max(max_tx, probs_id[i].first);
+        }
+
+        const auto i0 = is_initial ? vocab.token_beg + 101 : vocab.token_beg;
+        const auto i1 = is_initial ? vocab.token_beg + 101 : n_logits;
+
+        // the initial timestamp cannot be larger than 100
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
+        if (is_initial) {
+            for (int i = i0; i < n_logits; ++ i) {
+                probs_id[i].first = -INFINITY;
+            }
+        }
+
+        for (int i = vocab.token_beg; i < i1; i++) {
+            sum_ts += probs_id[i].first;
+            if  (probs_id[i].first > max_ts) {
+                max_ts = probs_id[i].first;
+                result.tid = probs_id[i].second;
+            }
+        }
+
+        // if the probability sum of all timestamp tokens is higher than the max probability of the text tokens - sample a
+        // timestamp token
+        if (sum_ts > max_tx || force_timestamp) {
+            // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L430-L438
+            for (int i = 0; i < vocab.token_beg; i++) {
+                probs_id[i].first = -INFINITY;
+            }
+        }
+
+        result.pt = max_ts/(sum_ts + 1e-10);
+        result.ptsum = sum_ts;
+    }
+
+    // find the top K tokens
+    top_k = std::min(top_k, n_logits);
+
+    std::partial_sort(
+            probs_id.begin(),
+            probs_id.begin() + top_k, probs_id.end(),
+            [](const std::pair<double, whisper_vocab::id> & a, const std::pair<double, whisper_vocab::id> & b) {
+        return a.first > b.first;
+    });
+
+    probs_id.resize(top_k);
+
+    //printf("\n");
+    //for (int i = 0; i < (int) probs_id.size(); i++) {
+    //    Rprintf("%d: '%s' %f, %d\n", i, vocab.id_to_token.at(probs_id[i].second).c_str(), probs_id[i].first, probs_id[i].second);
+    //}
+
+    std::vector<whisper_token_data> res(top_k, result);
+
+    for (int i = 0; i < top_k; i++) {
+        res[i].id = probs_id[i].second;
+        res[i].p  = probs_id[i].first;
+    }
+
+    return res;
+}
+
+// the start of transcript, start of LM and no timestamps tokens are never sampled
+static bool whisper_is_sampled(const whisper_vocab & vocab, whisper_token id) {
+    return id != vocab.token_sot && id != vocab.token_solm && id != vocab.token_not;
+}
+
+// the most basic sampling scheme - select the top token
+static whisper_token_data whisper_sample_best(
+        const whisper_vocab & vocab,
+        const float * probs,
+              bool force_timestamp,
+              bool is_initial) {
+    const auto top = whisper_sample_top_k(vocab, probs, force_timestamp, is_initial, 4);
+
+    int res = 0;
+    while (!whisper_is_sampled(vocab, top[res].id) && res < (int) top.size() - 1) {
+        res++;
+    }
+
+    return top[res];
+}
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
+    msec = msec - min * (1000 * 60);
+    int64_t sec = msec / 1000;
+    msec = msec - sec * 1000;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+
+    return std::string(buf);
+}
+
+// prepare the FFT plan for real input of size n (n must be even)
+static void whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    const int N = n/2;
+
+    plan.n = n;
+
+    // prefer radix 4, then 2, then the odd prime factors
+    plan.factors.clear();
+    {
+        int m = N;
+        while (m % 4 == 0) {
+            plan.factors.push_back(4);
+            m /= 4;
+        }
+        while (m % 2 == 0) {
+            plan.factors.push_back(2);
+            m /= 2;
+        }
+        for (int p = 3; m > 1; p += 2) {
+            while (m % p == 0) {
+                plan.factors.push_back(p);
+                m /= p;
+            }
+        }
+    }
+
+    plan.twiddles.resize(2*N);
+    for (int k = 0; k < N; k++) {
+        const double theta = 2*M_PI*k/N;
+        plan.twiddles[2*k + 0] =  cos(theta);
+        plan.twiddles[2*k + 1] = -sin(theta);
+    }
+
+    plan.twiddles_real.resize(2*(N + 1));
+    for (int k = 0; k <= N; k++) {
+        const double theta = 2*M_PI*k/n;
+        plan.twiddles_real[2*k + 0] =  cos(theta);
+        plan.twiddles_real[2*k + 1] = -sin(theta);
+    }
+
+    plan.window.resize(n);
+    for (int i = 0; i < n; i++) {
+        plan.window[i] = 0.5*(1.0 - cos((2.0*M_PI*i)/(n)));
+    }
+}
+
+// mixed-radix Stockham FFT of n/2 complex values (interleaved re/im)
+// x holds the input, x and y are both used as work buffers
+// returns the buffer holding the result (either x or y)
+static float * whisper_fft_complex(const whisper_fft_plan & plan, float * x, float * y) {
+    const int N = plan.n/2;
+
+    const float * w = plan.twiddles.data();
+
+    int n = N; // length of the sub-transforms at the current pass
+    int s = 1; // stride between the sub-transforms
+
+    for (const int p : plan.factors) {
+        const int m = n/p;
+
+        for (int j = 0; j < m; j++) {
+            // twiddle factor exp(-2*pi*i*j/n), the k-th power is at index j*k*s
+            const int jt = j*s;
+
+            for (int q = 0; q < s; q++) {
+                const float * a = x + 2*(q + s*j);
+                float       * b = y + 2*(q + s*p*j);
+
+                const int ia = 2*s*m; // distance between the inputs of a butterfly
+                const int ib = 2*s;   // distance between the outputs of a butterfly
+
+                switch (p) {
+                    case 2:
+                        {
+                            const float r0 = a[0] + a[ia + 0];
+                            const float i0 = a[1] + a[ia + 1];
+                            const float r1 = a[0] - a[ia + 0];
+                            const float i1 = a[1] - a[ia + 1];
+
+                            const float wr = w[2*jt + 0];
+                            const float wi = w[2*jt + 1];
+
+                            b[0]      = r0;
+                            b[1]      = i0;
+                            b[ib + 0] = r1*wr - i1*wi;
+                            b[ib + 1] = r1*wi + i1*wr;
+                        } break;
+                    case 4:
+                        {
+                            const float t0r = a[0]      + a[2*ia + 0];
+                            const float t0i = a[1]      + a[2*ia + 1];
+                            const float t1r = a[0]      - a[2*ia + 0];
+                            const float t1i = a[1]      - a[2*ia + 1];
+                            const float t2r = a[ia + 0] + a[3*ia + 0];
+                            const float t2i = a[ia + 1] + a[3*ia + 1];
+                            // (a1 - a3)*(-i)
+                            const float t3r = a[ia + 1] - a[3*ia + 1];
+                            const float t3i = a[3*ia + 0] - a[ia + 0];
+
+                            const float y1r = t1r + t3r;
+                            const float y1i = t1i + t3i;
+                            const float y2r = t0r - t2r;
+                            const float y2i = t0i - t2i;
+                            const float y3r = t1r - t3r;
+                            const float y3i = t1i - t3i;
+
+                            const float * w1 = w + 2*(1*jt);
+                            const float * w2 = w + 2*(2*jt);
+                            const float * w3 = w + 2*(3*jt);
+
+                            b[0]        = t0r + t2r;
+                            b[1]        = t0i + t2i;
+                            b[ib + 0]   = y1r*w1[0] - y1i*w1[1];
+                            b[ib + 1]   = y1r*w1[1] + y1i*w1[0];
+                            b[2*ib + 0] = y2r*w2[0] - y2i*w2[1];
+                            b[2*ib + 1] = y2r*w2[1] + y2i*w2[0];
+                            b[3*ib + 0] = y3r*w3[0] - y3i*w3[1];
+                            b[3*ib + 1] = y3r*w3[1] + y3i*w3[0];
+                        } break;
+                    default:
+                        {
+                            // generic radix: direct DFT of the p inputs, exp(-2*pi*i/p) is at index N/p
+                            const int wp = N/p;
+
+                            for (int k = 0; k < p; k++) {
+                                float re = 0.0f;
+                                float im = 0.0f;
+
+                                for (int r = 0; r < p; r++) {
+                                    const float * wk = w + 2*(((r*k) % p)*wp);
+
+                                    const float ar = a[r*ia + 0];
+                                    const float ai = a[r*ia + 1];
+
+                                    re += ar*wk[0] - ai*wk[1];
+                                    im += ar*wk[1] + ai*wk[0];
+                                }
+
+                                const float * wk = w + 2*(k*jt);
+
+                                b[k*ib + 0] = re*wk[0] - im*wk[1];
+                                b[k*ib + 1] = re*wk[1] + im*wk[0];
+                            }
+                        } break;
+                }
+            }
+        }
+
+        n  = m;
+        s *= p;
+
+        std::swap(x, y);
+    }
+
+    return x;
+}
+
+// FFT of plan.n real values
+// out receives the plan.n/2 + 1 non-negative frequency bins (interleaved re/im)
+// work must hold 2*plan.n floats
+static void whisper_fft_real(const whisper_fft_plan & plan, const float * in, float * out, float * work) {
+    const int N = plan.n/2;
+
+    // pack the even and odd samples as the real and imaginary parts of a half-size sequence
+    float * x = work;
+    float * y = work + 2*N;
+    for (int i = 0; i < 2*N; i++) {
+        x[i] = in[i];
+    }
+
+    const float * z = whisper_fft_complex(plan, x, y);
+
+    // separate the spectra of the even and odd samples and combine them
+    const float * w = plan.twiddles_real.data();
+    for (int k = 0; k <= N; k++) {
+        const int k0 = k % N;
+        const int k1 = (N - k) % N;
+
+        // Z[k] and conj(Z[N - k])
+        const float zr = z[2*k0 + 0];
+        const float zi = z[2*k0 + 1];
+        const float cr = z[2*k1 + 0];
+        const float ci = -z[2*k1 + 1];
+
+        // even = (Z[k] + conj(Z[N - k]))/2, odd = -i*(Z[k] - conj(Z[N - k]))/2
+        const float er = 0.5f*(zr + cr);
+        const float ei = 0.5f*(zi + ci);
+        const float orr = 0.5f*(zi - ci);
+        const float oi = -0.5f*(zr - cr);
+
+        out[2*k + 0] = er + orr*w[2*k + 0] - oi*w[2*k + 1];
+        out[2*k + 1] = ei + orr*w[2*k + 1] + oi*w[2*k + 0];
+    }
+}
+
+// floats of work memory needed by log_mel_block()
+static size_t log_mel_work_size(const whisper_fft_plan & fft_plan) {
+    return 4*fft_plan.n + 4 + (size_t) (1 + fft_plan.n/2)*WHISPER_MEL_BLOCK;
+}
+
+// power spectrum of the frame starting at samples, the samples beyond n_samples are zero
+// bin k goes to power[k*WHISPER_MEL_BLOCK], work must hold 4*fft_plan.n + 4 floats
+static void log_mel_power(
+    const float * samples,
+    const int n_samples,
+    const whisper_fft_plan & fft_plan,
+    const bool speed_up,
+    float * work,
+    float * power) {
+    const int fft_size = fft_plan.n;
+    const int n_fft    = 1 + (speed_up ? fft_size/4 : fft_size/2);
+
+    // bins 0 .. fft_size/2 as complex values, reused for the power spectrum
+    float * fft_in   = work;
+    float * fft_out  = work + fft_size;
+    float * fft_work = work + 2*fft_size + 4;
+
+    // apply Hanning window
+    const float * hann = fft_plan.window.data();
+    for (int j = 0; j < fft_size; j++) {
+        if (j < n_samples) {
+            fft_in[j] = hann[j]*samples[j];
+        } else {
+            fft_in[j] = 0.0;
+        }
+    }
+
+    // FFT -> mag^2
+    whisper_fft_real(fft_plan, fft_in, fft_out, fft_work);
+
+    for (int j = 0; j <= fft_size/2; j++) {
+        fft_out[j] = (fft_out[2*j + 0]*fft_out[2*j + 0] + fft_out[2*j + 1]*fft_out[2*j + 1]);
+    }
+
+    // the input is real so |X[fft_size - j]| == |X[j]|
+    // fold the negative frequencies onto the positive ones and keep bin fft_size/2 + 1 for the speed up
+    fft_out[fft_size/2 + 1] = fft_out[fft_size/2 - 1];
+    for (int j = 1; j < fft_size/2; j++) {
+        fft_out[j] += fft_out[j];
+    }
+
+    if (speed_up) {
+        // scale down in the frequency domain results in a speed up in the time domain
+        for (int j = 0; j < n_fft; j++) {
+            fft_out[j] = 0.5*(fft_out[2*j] + fft_out[2*j + 1]);
+        }
+    }
+
+    for (int j = 0; j < n_fft; j++) {
+        power[j*WHISPER_MEL_BLOCK] = fft_out[j];
+    }
+}
+
+// log10 of the mel energies of nb <= WHISPER_MEL_BLOCK frames, frame b starts at samples + b*fft_step
+// the samples beyond n_samples are zero
+// work must hold log_mel_work_size() floats, filter j of frame b goes to out[j*WHISPER_MEL_BLOCK + b]
+static void log_mel_block(
+    const float * samples,
+    const int n_samples,
+    const int fft_step,
+    const int nb,
+    const whisper_filters & filters,
+    const whisper_fft_plan & fft_plan,
+    const bool speed_up,
+    float * work,
+    float * out) {
+    assert(nb <= WHISPER_MEL_BLOCK);
+    assert(1 + (speed_up ? fft_plan.n/4 : fft_plan.n/2) == filters.n_fft);
+
+    // the power spectra of the frames, a bin of all the frames is contiguous
+    float * power = work + 4*fft_plan.n + 4;
+
+    for (int b = 0; b < nb; b++) {
+        log_mel_power(samples + b*fft_step, n_samples - b*fft_step, fft_plan, speed_up, work, power + b);
+    }
+
+    // mel spectrogram, only the non-zero band of each filter contributes
+    // a weight of the band multiplies the bin of all the frames of the block, in float, the loops over the frames
+    // have a fixed length and are vectorized - the frames b >= nb hold stale values and are not used
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float * row = filters.data.data() + j*filters.n_fft;
+
+        // a local accumulator, which does not alias the power spectra
+        float sum[WHISPER_MEL_BLOCK] = { 0.0f };
+
+        for (int k = filters.beg[j]; k < filters.end[j]; k++) {
+            const float   w = row[k];
+            const float * p = power + k*WHISPER_MEL_BLOCK;
+
+            for (int b = 0; b < WHISPER_MEL_BLOCK; b++) {
+                sum[b] += w*p[b];
+            }
+        }
+
+        memcpy(out + j*WHISPER_MEL_BLOCK, sum, sizeof(sum));
+    }
+
+    // log10f is a libm call, which is not vectorized without -ffast-math
+    for (int j = 0; j < filters.n_mel; j++) {
+        float * v = out + j*WHISPER_MEL_BLOCK;
+
+        for (int b = 0; b < nb; b++) {
+            v[b] = log10f(std::max(v[b], 1e-10f));
+        }
+    }
+}
+
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L92-L124
+static bool log_mel_spectrogram(
+    const float * samples,
+    const int n_samples,
+    const int sample_rate,
+    const int fft_size,
+    const int fft_step,
+    const int n_mel,
+    const int n_threads,
+    const whisper_filters & filters,
+    const whisper_fft_plan & fft_plan,
+    const bool speed_up,
+    whisper_mel & mel) {
+    assert(fft_plan.n == fft_size);
+    assert(filters.n_mel == n_mel);
+
+    mel.n_mel = n_mel;
+    mel.n_len = (n_samples)/fft_step;
+    mel.data.resize(mel.n_mel*mel.n_len);
+
+    //printf("%s: n_samples = %d, n_len = %d\n", __func__, n_samples, mel.n_len);
+    //printf("%s: recording length: %f s\n", __func__, (float) n_samples/sample_rate);
+
+    // maximum of each thread, reduced after the workers are done
+    std::vector<float> mmax_thread(n_threads, -1e20f);
+
+    std::vector<std::thread> workers(n_threads);
+    for (int iw = 0; iw < n_threads; ++iw) {
+        workers[iw] = std::thread([&](int ith) {
+            std::vector<float> work;
+            work.resize(log_mel_work_size(fft_plan));
+
+            // the frames are computed by blocks stored as [n_mel][WHISPER_MEL_BLOCK], like mel.data
+            // so each filter of a block is a contiguous run of mel.data
+            std::vector<float> block;
+            block.resize(WHISPER_MEL_BLOCK*mel.n_mel);
+
+            float mmax = -1e20f;
+
+            // each thread processes a contiguous range of frames
+            const int i0 = (int64_t) mel.n_len*(ith + 0)/n_threads;
+            const int i1 = (int64_t) mel.n_len*(ith + 1)/n_threads;
+
+            for (int ib = i0; ib < i1; ib += WHISPER_MEL_BLOCK) {
+                const int nb = std::min(WHISPER_MEL_BLOCK, i1 - ib);
+
+                const int offset = ib*fft_step;
+
+                log_mel_block(samples + offset, n_samples - offset, fft_step, nb, filters, fft_plan, speed_up, work.data(), block.data());
+
+                for (int j = 0; j < mel.n_mel; j++) {
+                    const float * src = block.data() + j*WHISPER_MEL_BLOCK;
+                    float * dst = mel.data.data() + j*mel.n_len + ib;
+                    for (int b = 0; b < nb; b++) {
+                        dst[b] = src[b];
+                        mmax = std::max(mmax, src[b]);
                     }
                 }
+            }
+
+            mmax_thread[ith] = mmax;
+        }, iw);
+    }
+
+    for (int iw = 0; iw < n_threads; ++iw) {
+        workers[iw].join();
+    }
+
+    // clamping and normalization
+    float mmax = -1e20f;
+    for (int iw = 0; iw < n_threads; ++iw) {
+        mmax = std::max(mmax, mmax_thread[iw]);
+    }
+    //printf("%s: max = %f\n", __func__, mmax);
+
+    mmax -= 8.0f;
+
+    for (int iw = 0; iw < n_threads; ++iw) {
+        workers[iw] = std::thread([&](int ith) {
+            const int64_t n  = (int64_t) mel.n_mel*mel.n_len;
+            const int64_t i0 = n*(ith + 0)/n_threads;
+            const int64_t i1 = n*(ith + 1)/n_threads;
+
+            float * data = mel.data.data();
+            for (int64_t i = i0; i < i1; i++) {
+                data[i] = (std::max(data[i], mmax) + 4.0f)/4.0f;
+            }
+        }, iw);
+    }
+
+    for (int iw = 0; iw < n_threads; ++iw) {
+        workers[iw].join();
+    }
+
+    return true;
+}
+
+//
+// interface implementation
+//
+
+struct whisper_context * whisper_init_no_state(const char * path_model) {
+    ggml_time_init();
+
+    whisper_context * ctx = new whisper_context;
+
+    const int64_t t_start_us = ggml_time_us();
+
+    ctx->t_start_us = t_start_us;
+
+    if (!whisper_model_load(path_model, *ctx)) {
+        Rprintf("%s: failed to load model from '%s'\n", __func__, path_model);
+        whisper_free(ctx);
+        return NULL;
+    }
+
+    whisper_fft_plan_init(ctx->fft_plan,    WHISPER_N_FFT);
+    whisper_fft_plan_init(ctx->fft_plan_x2, 2*WHISPER_N_FFT);
+
+    ctx->t_load_us = ggml_time_us() - t_start_us;
+
+    return ctx;
+}
+
+struct whisper_context * whisper_init(const char * path_model) {
+    whisper_context * ctx = whisper_init_no_state(path_model);
+    if (!ctx) {
+        return NULL;
+    }
+
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+struct whisper_state * whisper_init_state(struct whisper_context * ctx) {
+    if (!ctx) {
+        Rprintf("%s: no context\n", __func__);
+        return NULL;
+    }
+
+    whisper_state * state = new whisper_state;
+
+    // the compute buffers are allocated when the graphs are built, to the memory measured for them
+    // see whisper_graph_reserve()
+
+    // the key/value memory is allocated for the audio and text context in use, when it is first needed
+    // see whisper_kv_cross_init() and whisper_kv_self_init()
+
+    return state;
+}
+
+void whisper_free_state(struct whisper_state * state) {
+    if (state) {
+        if (state->ctx_mem) {
+            ggml_free(state->ctx_mem);
+        }
+        if (state->ctx_kv) {
+            ggml_free(state->ctx_kv);
+        }
+        if (state->threadpool) {
+            ggml_threadpool_free(state->threadpool);
+        }
+        whisper_decoder_graph_free(state->decoder_graph);
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        if (ctx->model.ctx) {
+            ggml_free(ctx->model.ctx);
+        }
+        if (ctx->buf_model) {
+            delete ctx->buf_model;
+        }
+        if (ctx->mapping) {
+            whisper_mmap_close(*ctx->mapping);
+            delete ctx->mapping;
+        }
+        whisper_free_state(ctx->state);
+        delete ctx;
+    }
+}
+
+int whisper_model_quantize(const char * path_model_inp, const char * path_model_out, enum whisper_ftype ftype) {
+    const ggml_type qtype = whisper_ftype_to_type(ftype);
+    if (qtype == GGML_TYPE_COUNT) {
+        Rprintf("%s: invalid quantization type %d\n", __func__, ftype);
+        return -1;
+    }
+
+    Rprintf("%s: quantizing model '%s' to '%s'\n", __func__, path_model_inp, path_model_out);
+
+    auto fin = std::ifstream(path_model_inp, std::ios::binary);
+    if (!fin) {
+        Rprintf("%s: failed to open '%s' for reading\n", __func__, path_model_inp);
+        return -1;
+    }
+
+    auto fout = std::ofstream(path_model_out, std::ios::binary);
+    if (!fout) {
+        Rprintf("%s: failed to open '%s' for writing\n", __func__, path_model_out);
+        return -1;
+    }
+
+    // verify magic
+    bool aligned = false;
+    {
+        uint32_t magic;
+        read_safe(fin, magic);
+        if (magic != WHISPER_FILE_MAGIC_GGML && magic != WHISPER_FILE_MAGIC_GGJT) {
+            Rprintf("%s: invalid model file '%s' (bad magic)\n", __func__, path_model_inp);
+            return -1;
+        }
+
+        aligned = magic == WHISPER_FILE_MAGIC_GGJT;
+
+        // the output is always written with aligned tensor data, so that it can be mapped by whisper_model_load
+        magic = WHISPER_FILE_MAGIC_GGJT;
+        fout.write((const char *) &magic, sizeof(magic));
+    }
+
+    // hparams - only the type of the weights changes
+    {
+        whisper_hparams hparams;
+
+        read_safe(fin, hparams.n_vocab);
+        read_safe(fin, hparams.n_audio_ctx);
+        read_safe(fin, hparams.n_audio_state);
+        read_safe(fin, hparams.n_audio_head);
+        read_safe(fin, hparams.n_audio_layer);
+        read_safe(fin, hparams.n_text_ctx);
+        read_safe(fin, hparams.n_text_state);
+        read_safe(fin, hparams.n_text_head);
+        read_safe(fin, hparams.n_text_layer);
+        read_safe(fin, hparams.n_mels);
+        read_safe(fin, hparams.ftype);
+
+        const ggml_type wtype = whisper_ftype_to_type(hparams.ftype);
+        if (wtype != GGML_TYPE_F32 && wtype != GGML_TYPE_F16) {
+            Rprintf("%s: invalid model file '%s' (ftype %d, expected F32 or F16 weights)\n", __func__, path_model_inp, hparams.ftype);
+            return -1;
+        }
+
+        hparams.ftype = ftype;
+
+        fout.write((const char *) &hparams.n_vocab,       sizeof(hparams.n_vocab));
+        fout.write((const char *) &hparams.n_audio_ctx,   sizeof(hparams.n_audio_ctx));
+        fout.write((const char *) &hparams.n_audio_state, sizeof(hparams.n_audio_state));
+        fout.write((const char *) &hparams.n_audio_head,  sizeof(hparams.n_audio_head));
+        fout.write((const char *) &hparams.n_audio_layer, sizeof(hparams.n_audio_layer));
+        fout.write((const char *) &hparams.n_text_ctx,    sizeof(hparams.n_text_ctx));
+        fout.write((const char *) &hparams.n_text_state,  sizeof(hparams.n_text_state));
+        fout.write((const char *) &hparams.n_text_head,   sizeof(hparams.n_text_head));
+        fout.write((const char *) &hparams.n_text_layer,  sizeof(hparams.n_text_layer));
+        fout.write((const char *) &hparams.n_mels,        sizeof(hparams.n_mels));
+        fout.write((const char *) &hparams.ftype,         sizeof(hparams.ftype));
+    }
+
+    // mel filters
+    {
+        int32_t n_mel;
+        int32_t n_fft;
+
+        read_safe(fin, n_mel);
+        read_safe(fin, n_fft);
+
+        std::vector<float> data(n_mel*n_fft);
+        fin.read((char *) data.data(), data.size()*sizeof(float));
+
+        fout.write((const char *) &n_mel, sizeof(n_mel));
+        fout.write((const char *) &n_fft, sizeof(n_fft));
+        fout.write((const char *) data.data(), data.size()*sizeof(float));
+    }
+
+    // vocab
+    {
+        int32_t n_vocab;
+        read_safe(fin, n_vocab);
+
+        fout.write((const char *) &n_vocab, sizeof(n_vocab));
+
+        std::vector<char> word;
+        for (int i = 0; i < n_vocab; i++) {
+            uint32_t len;
+            read_safe(fin, len);
+
+            word.resize(len);
+            fin.read(word.data(), len);
+
+            fout.write((const char *) &len, sizeof(len));
+            fout.write(word.data(), len);
+        }
+    }
+
+    // weights
+    {
+        size_t total_size_org = 0;
+        size_t total_size_new = 0;
+
+        std::vector<uint8_t>     data_inp;
+        std::vector<uint8_t>     data_out;
+        std::vector<float>       data_f32;
+        std::vector<ggml_fp16_t> data_f16;
+
+        while (true) {
+            int32_t n_dims;
+            int32_t length;
+            int32_t ttype;
+
+            read_safe(fin, n_dims);
+            read_safe(fin, length);
+            read_safe(fin, ttype);
+
+            if (fin.eof()) {
+                break;
+            }
+
+            int32_t nelements = 1;
+            int32_t ne[3] = { 1, 1, 1 };
+            for (int i = 0; i < n_dims; ++i) {
+                read_safe(fin, ne[i]);
+                nelements *= ne[i];
+            }
+
+            std::string name(length, 0);
+            fin.read(&name[0], length);
+
+            const ggml_type type = whisper_ftype_to_type(ttype);
+            if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16) {
+                Rprintf("%s: tensor '%s' has unsupported type %d\n", __func__, name.c_str(), ttype);
+                return -1;
+            }
+
+            if (aligned) {
+                const size_t offset = fin.tellg();
+                fin.seekg((WHISPER_FILE_ALIGN - offset % WHISPER_FILE_ALIGN) % WHISPER_FILE_ALIGN, std::ios::cur);
+            }
+
+            data_inp.resize(nelements*ggml_type_size(type));
+            fin.read((char *) data_inp.data(), data_inp.size());
+
+            if (!fin) {
+                Rprintf("%s: failed to read tensor '%s'\n", __func__, name.c_str());
+                return -1;
+            }
+
+            data_f32.resize(nelements);
+            if (type == GGML_TYPE_F16) {
+                const ggml_fp16_t * src = (const ggml_fp16_t *) data_inp.data();
+                for (int i = 0; i < nelements; ++i) {
+                    data_f32[i] = ggml_fp16_to_fp32(src[i]);
+                }
+            } else {
+                memcpy(data_f32.data(), data_inp.data(), nelements*sizeof(float));
+            }
 
-                // mel spectrogram
-                for (int j = 0; j < mel.n_mel; j++) {
-                    double sum = 0.0;
+            // the weights of the linear layers and the token embeddings are converted to the requested type
+            // the convolution weights are stored in 16-bit floats (32-bit for F32 models), as expected by whisper_model_load
+            int32_t ttype_out = ttype;
 
-                    for (int k = 0; k < n_fft; k++) {
-                        sum += fft_out[k]*filters.data[j*n_fft + k];
-                    }
-                    if (sum < 1e-10) {
-                        sum = 1e-10;
-                    }
+            ggml_type type_out = GGML_TYPE_COUNT;
+            if (n_dims == 2 && ne[0] % ggml_blck_size(qtype) == 0 && name.find("weight") != std::string::npos) {
+                type_out = qtype;
+            } else if (n_dims == 3) {
+                type_out = qtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16;
+            }
 
-                    sum = log10(sum);
+            if (type_out == GGML_TYPE_COUNT) {
+                data_out = data_inp;
+            } else if (ggml_is_quantized(type_out)) {
+                ttype_out = ftype;
 
-                    mel.data[j*mel.n_len + i] = sum;
+                data_out.resize((nelements*ggml_type_size(type_out))/ggml_blck_size(type_out));
+                ggml_quantize(type_out, data_f32.data(), data_out.data(), nelements);
+            } else if (type_out == GGML_TYPE_F16) {
+                ttype_out = WHISPER_FTYPE_F16;
+
+                data_f16.resize(nelements);
+                for (int i = 0; i < nelements; ++i) {
+                    data_f16[i] = ggml_fp32_to_fp16(data_f32[i]);
                 }
+
+                data_out.resize(nelements*sizeof(ggml_fp16_t));
+                memcpy(data_out.data(), data_f16.data(), data_out.size());
+            } else {
+                ttype_out = WHISPER_FTYPE_F32;
+
+                data_out.resize(nelements*sizeof(float));
+                memcpy(data_out.data(), data_f32.data(), data_out.size());
             }
-        }, iw);
+
+            fout.write((const char *) &n_dims,    sizeof(n_dims));
+            fout.write((const char *) &length,    sizeof(length));
+            fout.write((const char *) &ttype_out, sizeof(ttype_out));
+            for (int i = 0; i < n_dims; ++i) {
+                fout.write((const char *) &ne[i], sizeof(ne[i]));
+            }
+            fout.write(name.data(), length);
+
+            {
+                static const char zeros[WHISPER_FILE_ALIGN] = { 0 };
+
+                const size_t offset = fout.tellp();
+                fout.write(zeros, (WHISPER_FILE_ALIGN - offset % WHISPER_FILE_ALIGN) % WHISPER_FILE_ALIGN);
+            }
+
+            fout.write((const char *) data_out.data(), data_out.size());
+
+            total_size_org += data_inp.size();
+            total_size_new += data_out.size();
+        }
+
+        Rprintf("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
+        Rprintf("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
     }
 
-    for (int iw = 0; iw < n_threads; ++iw) {
-        workers[iw].join();
+    if (!fout) {
+        Rprintf("%s: failed to write '%s'\n", __func__, path_model_out);
+        return -1;
     }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+    return 0;
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!log_mel_spectrogram(samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, ctx->fft_plan, false, state->mel)) {
+        Rprintf("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    state->t_mel_us = ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
+static int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!log_mel_spectrogram(samples, n_samples, WHISPER_SAMPLE_RATE, 2*WHISPER_N_FFT, 2*WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, ctx->fft_plan_x2, true, state->mel)) {
+        Rprintf("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    state->t_mel_us = ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * /*ctx*/,
+        struct whisper_state * state,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    if (n_mel != WHISPER_N_MEL) {
+        Rprintf("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
+        return -1;
+    }
+
+    state->mel.n_len = n_len;
+    state->mel.n_mel = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+struct whisper_mel_stream {
+    const whisper_context * ctx;
+
+    // samples from pcm_offset on, the start of the next frame
+    std::vector<float> pcm;
+    int64_t pcm_offset = 0;
+    int64_t n_samples  = 0;
+
+    bool finished = false;
+
+    // log10 mel energies, [n_len - frame_offset][n_mel], from frame frame_offset on
+    std::vector<float> frames;
+    int frame_offset = 0;
+    int n_len        = 0;
+
+    // maximum over all frames computed so far, including the discarded ones
+    float mmax = -1e20f;
+
+    // the frames of a push are computed by up to n_threads threads
+    int n_threads = 1;
+
+    std::vector<float> work;
+};
+
+struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx) {
+    whisper_mel_stream * stream = new whisper_mel_stream;
+
+    stream->ctx = ctx;
+    stream->work.resize(log_mel_work_size(ctx->fft_plan));
+
+    return stream;
+}
+
+void whisper_mel_stream_free(struct whisper_mel_stream * stream) {
+    delete stream;
+}
+
+// compute the frames whose window is complete, or all the remaining frames once the stream is finished
+static void whisper_mel_stream_compute(whisper_mel_stream & stream) {
+    const auto & filters = stream.ctx->model.filters;
+
+    const int n_mel   = filters.n_mel;
+    const int n_total = stream.n_samples/WHISPER_HOP_LENGTH;
+
+    int n_ready = n_total;
+    if (!stream.finished) {
+        n_ready = stream.n_samples < WHISPER_N_FFT ? 0 : std::min<int64_t>(n_total, (stream.n_samples - WHISPER_N_FFT)/WHISPER_HOP_LENGTH + 1);
+    }
+
+    if (n_ready > stream.n_len) {
+        const int n_new = n_ready - stream.n_len;
+
+        stream.frames.resize((size_t) (n_ready - stream.frame_offset)*n_mel);
+
+        // frames [i0, i1) of the new frames, the maximum of a thread goes to mmax[ith]
+        auto compute = [&](int i0, int i1, float * work, float * mmax) {
+            std::vector<float> block(WHISPER_MEL_BLOCK*n_mel);
+
+            for (int ib = i0; ib < i1; ib += WHISPER_MEL_BLOCK) {
+                const int nb = std::min(WHISPER_MEL_BLOCK, i1 - ib);
+
+                const int64_t offset = (int64_t) (stream.n_len + ib)*WHISPER_HOP_LENGTH;
+
+                log_mel_block(stream.pcm.data() + (offset - stream.pcm_offset), stream.n_samples - offset, WHISPER_HOP_LENGTH, nb,
+                        filters, stream.ctx->fft_plan, false, work, block.data());
+
+                // the frames of the stream are stored one after the other
+                for (int b = 0; b < nb; b++) {
+                    float * out = stream.frames.data() + (size_t) (stream.n_len + ib + b - stream.frame_offset)*n_mel;
+
+                    for (int j = 0; j < n_mel; j++) {
+                        out[j] = block[j*WHISPER_MEL_BLOCK + b];
+                        *mmax  = std::max(*mmax, out[j]);
+                    }
+                }
+            }
+        };
+
+        // a thread for at least 100 frames (1 s of audio)
+        const int n_threads = std::max(1, std::min(stream.n_threads, n_new/100));
+
+        std::vector<float> mmax(n_threads, -1e20f);
+
+        if (n_threads == 1) {
+            compute(0, n_new, stream.work.data(), &mmax[0]);
+        } else {
+            std::vector<std::vector<float>> work(n_threads - 1, std::vector<float>(stream.work.size()));
+            std::vector<std::thread> workers(n_threads - 1);
+            for (int iw = 0; iw < n_threads - 1; ++iw) {
+                workers[iw] = std::thread(compute, (int64_t) n_new*(iw + 1)/n_threads, (int64_t) n_new*(iw + 2)/n_threads, work[iw].data(), &mmax[iw + 1]);
+            }
+
+            compute(0, n_new/n_threads, stream.work.data(), &mmax[0]);
+
+            for (int iw = 0; iw < n_threads - 1; ++iw) {
+                workers[iw].join();
+            }
+        }
+
+        for (int iw = 0; iw < n_threads; ++iw) {
+            stream.mmax = std::max(stream.mmax, mmax[iw]);
         }
+
+        stream.n_len = n_ready;
+    }
+
+    // drop the samples that precede the next frame
+    const int64_t offset = (int64_t) stream.n_len*WHISPER_HOP_LENGTH;
+    stream.pcm.erase(stream.pcm.begin(), stream.pcm.begin() + (offset - stream.pcm_offset));
+    stream.pcm_offset = offset;
+}
+
+int whisper_mel_stream_push(struct whisper_mel_stream * stream, const float * samples, int n_samples) {
+    if (stream->finished) {
+        Rprintf("%s: the stream has already been finished\n", __func__);
+        return -1;
+    }
+
+    stream->pcm.insert(stream->pcm.end(), samples, samples + n_samples);
+    stream->n_samples += n_samples;
+
+    whisper_mel_stream_compute(*stream);
+
+    return stream->n_len;
+}
+
+int whisper_mel_stream_finish(struct whisper_mel_stream * stream) {
+    stream->finished = true;
+
+    whisper_mel_stream_compute(*stream);
+
+    return stream->n_len;
+}
+
+int whisper_mel_stream_n_len(struct whisper_mel_stream * stream) {
+    return stream->n_len;
+}
+
+void whisper_mel_stream_discard(struct whisper_mel_stream * stream, int offset) {
+    offset = std::min(offset, stream->n_len);
+    if (offset <= stream->frame_offset) {
+        return;
+    }
+
+    const int n_mel = stream->ctx->model.filters.n_mel;
+
+    stream->frames.erase(stream->frames.begin(), stream->frames.begin() + (size_t) (offset - stream->frame_offset)*n_mel);
+    stream->frame_offset = offset;
+}
+
+int whisper_mel_stream_set_mel(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_mel_stream * stream,
+        int offset,
+        int n_len) {
+    if (stream->ctx != ctx) {
+        Rprintf("%s: the stream belongs to a different context\n", __func__);
+        return -1;
+    }
+
+    if (offset < stream->frame_offset || n_len < 0 || offset + n_len > stream->n_len) {
+        Rprintf("%s: frames [%d, %d) are not available, the stream holds [%d, %d)\n", __func__,
+                offset, offset + n_len, stream->frame_offset, stream->n_len);
+        return -1;
+    }
+
+    const int n_mel = stream->ctx->model.filters.n_mel;
+
+    auto & mel = state->mel;
+
+    mel.n_mel = n_mel;
+    mel.n_len = n_len;
+    mel.data.resize(n_mel*n_len);
+
+    // same clamping and normalization as log_mel_spectrogram(), with the maximum seen so far
+    const float mmin = stream->mmax - 8.0f;
+
+    const float * src = stream->frames.data() + (size_t) (offset - stream->frame_offset)*n_mel;
+    for (int i = 0; i < n_len; i++) {
+        for (int j = 0; j < n_mel; j++) {
+            mel.data[j*n_len + i] = (std::max(src[i*n_mel + j], mmin) + 4.0f)/4.0f;
+        }
+    }
+
+    return 0;
+}
+
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_encode(*ctx, *state, n_threads, offset)) {
+        Rprintf("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    state->t_encode_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    return whisper_encode_with_state(ctx, ctx->state, offset, n_threads);
+}
+
+int whisper_encode_batch_with_state(struct whisper_context * ctx, struct whisper_state ** states, const int * offsets, int n_states, int n_threads) {
+    if (n_states < 1) {
+        Rprintf("%s: no states to encode\n", __func__);
+        return -1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_encode_batch(*ctx, states, n_threads, offsets, n_states, false)) {
+        Rprintf("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    states[0]->t_encode_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_decode(*ctx, *state, n_threads, tokens, n_tokens, n_past, 1)) {
+        Rprintf("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    state->t_decode_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
+
+int whisper_decode_batch_with_state(struct whisper_context * ctx, struct whisper_state ** states, const whisper_token * const * tokens, const int * n_tokens, const int * n_past, int n_states, int n_threads) {
+    if (n_states < 1) {
+        Rprintf("%s: no states to decode\n", __func__);
+        return 1;
+    }
+
+    std::vector<whisper_decode_seq> seqs(n_states);
+    for (int i = 0; i < n_states; ++i) {
+        seqs[i].state    = states[i];
+        seqs[i].slot     = 0;
+        seqs[i].tokens   = tokens[i];
+        seqs[i].n_tokens = n_tokens[i];
+        seqs[i].n_past   = n_past[i];
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    if (!whisper_decode_batch(*ctx, *states[0], n_threads, seqs, false)) {
+        Rprintf("%s: failed to eval\n", __func__);
+        return 1;
+    }
+
+    states[0]->t_decode_us += ggml_time_us() - t_start_us;
+
+    return 0;
+}
+
+// a window that a state of a group encodes, or the tokens that it decodes
+struct whisper_group_request {
+    const whisper_context * ctx;
+    whisper_state * state;
+
+    // encode the window at mel_offset if n_tokens is 0
+    int mel_offset;
+
+    // decode n_tokens tokens after n_past tokens, n_tokens/n_seq in each of the first n_seq slots of the memory
+    const whisper_token * tokens;
+    int n_tokens;
+    int n_past;
+    int n_seq;
+
+    bool ok;
+};
+
+// the states of a group transcribe in lock step: a state that encodes a window or decodes tokens waits until each
+// other state of the group in whisper_full() does so too or leaves whisper_full(), then the last state that arrives
+// encodes the windows as one batch and decodes the tokens of all the states as one batch, with the threads of the group
+struct whisper_group {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    int n_threads = 1;
+
+    // the states of the group, the batches are computed in the buffers of the first one that takes part
+    std::vector<whisper_state *> states;
+
+    // number of states in whisper_full() and the windows of the current round
+    int n_active = 0;
+    std::vector<whisper_group_request *> requests;
+
+    // incremented after each round
+    int64_t n_rounds = 0;
+};
+
+struct whisper_group * whisper_group_init(int n_threads) {
+    whisper_group * group = new whisper_group;
+
+    group->n_threads = std::max(1, n_threads);
+
+    return group;
+}
+
+void whisper_group_free(struct whisper_group * group) {
+    if (group) {
+        for (auto * state : group->states) {
+            state->group = nullptr;
+        }
+        delete group;
+    }
+}
+
+int whisper_group_add_state(struct whisper_group * group, struct whisper_state * state) {
+    if (state->group) {
+        Rprintf("%s: the state already belongs to a group\n", __func__);
+        return -1;
+    }
+
+    state->group = group;
+    group->states.push_back(state);
+
+    return 0;
+}
+
+// called with the mutex of the group locked, once all the active states wait
+static void whisper_group_compute(whisper_group & group) {
+    // the same order for each round, so that the batches grow the buffers of the same state
+    std::stable_sort(group.requests.begin(), group.requests.end(),
+            [&group](const whisper_group_request * a, const whisper_group_request * b) {
+        return std::find(group.states.begin(), group.states.end(), a->state) < std::find(group.states.begin(), group.states.end(), b->state);
+    });
+
+    const whisper_context & wctx = *group.requests[0]->ctx;
+
+    std::vector<whisper_group_request *> encodes;
+    std::vector<whisper_group_request *> decodes;
+
+    for (auto * req : group.requests) {
+        (req->n_tokens > 0 ? decodes : encodes).push_back(req);
     }
-    //printf("%s: max = %f\n", __func__, mmax);
 
-    mmax -= 8.0;
+    if (!encodes.empty()) {
+        const int64_t t_start_us = ggml_time_us();
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+        std::vector<whisper_state *> states;
+        std::vector<int> mel_offsets;
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+        for (const auto * req : encodes) {
+            states.push_back(req->state);
+            mel_offsets.push_back(req->mel_offset);
+        }
 
-    return true;
-}
+        const bool ok = whisper_encode_batch(wctx, states.data(), group.n_threads, mel_offsets.data(), states.size(), false);
 
-//
-// interface implementation
-//
+        const int64_t t_encode_us = ggml_time_us() - t_start_us;
 
-struct whisper_context * whisper_init(const char * path_model) {
-    ggml_time_init();
+        for (auto * req : encodes) {
+            req->ok = ok;
+            req->state->t_encode_us += t_encode_us;
+        }
+    }
 
-    whisper_context * ctx = new whisper_context;
+    if (!decodes.empty()) {
+        const int64_t t_start_us = ggml_time_us();
 
-    const int64_t t_start_us = ggml_time_us();
+        bool ok = false;
 
-    ctx->t_start_us = t_start_us;
+        if (decodes.size() == 1) {
+            // a state on its own keeps its cached decoder graph
+            const auto * req = decodes[0];
 
-    if (!whisper_model_load(path_model, *ctx)) {
-        Rprintf("%s: failed to load model from '%s'\n", __func__, path_model);
-        return NULL;
-    }
+            ok = whisper_decode(wctx, *req->state, group.n_threads, req->tokens, req->n_tokens, req->n_past, req->n_seq);
+        } else {
+            std::vector<whisper_decode_seq> seqs;
 
-    ctx->t_load_us = ggml_time_us() - t_start_us;
+            for (const auto * req : decodes) {
+                const int n_tokens = req->n_tokens/req->n_seq;
 
-    return ctx;
-}
+                for (int j = 0; j < req->n_seq; ++j) {
+                    seqs.push_back({ req->state, j, req->tokens + j*n_tokens, n_tokens, req->n_past });
+                }
+            }
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        if (ctx->model.ctx) {
-            ggml_free(ctx->model.ctx);
-        }
-        if (ctx->model.ctx_mem) {
-            ggml_free(ctx->model.ctx_mem);
+            ok = whisper_decode_batch(wctx, *decodes[0]->state, group.n_threads, seqs, false);
         }
-        if (ctx->buf_model) {
-            delete ctx->buf_model;
+
+        const int64_t t_decode_us = ggml_time_us() - t_start_us;
+
+        for (auto * req : decodes) {
+            req->ok = ok;
+            req->state->t_decode_us += t_decode_us;
         }
-        delete ctx;
     }
+
+    group.requests.clear();
+    group.n_rounds++;
+
+    group.cv.notify_all();
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+// wait for the other states of the group and take part in the next round
+static bool whisper_group_run(whisper_group & group, whisper_group_request & req) {
+    std::unique_lock<std::mutex> lock(group.mutex);
 
-    if (!log_mel_spectrogram(samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, false, ctx->mel)) {
-        Rprintf("%s: failed to compute mel spectrogram\n", __func__);
-        return -1;
-    }
+    group.requests.push_back(&req);
 
-    ctx->t_mel_us = ggml_time_us() - t_start_us;
+    if ((int) group.requests.size() == group.n_active) {
+        whisper_group_compute(group);
+    } else {
+        const int64_t n_rounds = group.n_rounds;
+        group.cv.wait(lock, [&group, n_rounds] { return group.n_rounds != n_rounds; });
+    }
 
-    return 0;
+    return req.ok;
 }
 
-// same as whisper_pcm_to_mel, but applies a Phase Vocoder to speed up the audio x2
-int whisper_pcm_to_mel_phase_vocoder(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+// encode the window at offset of the spectrogram of the state together with the windows of the other states of its group
+static int whisper_group_encode(struct whisper_context * ctx, struct whisper_state * state, int offset) {
+    whisper_group_request req = { ctx, state, offset, nullptr, 0, 0, 0, false };
 
-    if (!log_mel_spectrogram(samples, n_samples, WHISPER_SAMPLE_RATE, 2*WHISPER_N_FFT, 2*WHISPER_HOP_LENGTH, WHISPER_N_MEL, n_threads, ctx->model.filters, true, ctx->mel)) {
-        Rprintf("%s: failed to compute mel spectrogram\n", __func__);
+    if (!whisper_group_run(*state->group, req)) {
+        Rprintf("%s: failed to eval\n", __func__);
         return -1;
     }
 
-    ctx->t_mel_us = ggml_time_us() - t_start_us;
-
     return 0;
 }
 
-int whisper_set_mel(
+// decode the tokens of the state as whisper_decode() does, in a batch with the tokens of the other states of its group
+static bool whisper_full_decode(
         struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    if (n_mel != WHISPER_N_MEL) {
-        Rprintf("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, WHISPER_N_MEL);
-        return -1;
-    }
-
-    ctx->mel.n_len = n_len;
-    ctx->mel.n_mel = n_mel;
-
-    ctx->mel.data.resize(n_len*n_mel);
-    memcpy(ctx->mel.data.data(), data, n_len*n_mel*sizeof(float));
+        struct whisper_state * state,
+        int n_threads,
+        const whisper_token * tokens,
+        int n_tokens,
+        int n_past,
+        int n_seq) {
+    if (state->group) {
+        whisper_group_request req = { ctx, state, 0, tokens, n_tokens, n_past, n_seq, false };
 
-    return 0;
-}
+        return whisper_group_run(*state->group, req);
+    }
 
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     const int64_t t_start_us = ggml_time_us();
 
-    if (!whisper_encode(*ctx, n_threads, offset)) {
-        Rprintf("%s: failed to eval\n", __func__);
-        return -1;
+    if (!whisper_decode(*ctx, *state, n_threads, tokens, n_tokens, n_past, n_seq)) {
+        return false;
     }
 
-    ctx->t_encode_us += ggml_time_us() - t_start_us;
+    state->t_decode_us += ggml_time_us() - t_start_us;
 
-    return 0;
+    return true;
 }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    const int64_t t_start_us = ggml_time_us();
+// a state of a group takes part in the rounds of its group while it is in whisper_full()
+struct whisper_group_scope {
+    whisper_group * group;
 
-    if (!whisper_decode(*ctx, n_threads, tokens, n_tokens, n_past)) {
-        Rprintf("%s: failed to eval\n", __func__);
-        return 1;
+    whisper_group_scope(whisper_group * group) : group(group) {
+        if (group) {
+            std::unique_lock<std::mutex> lock(group->mutex);
+            group->n_active++;
+        }
     }
 
-    ctx->t_decode_us += ggml_time_us() - t_start_us;
+    ~whisper_group_scope() {
+        if (group) {
+            std::unique_lock<std::mutex> lock(group->mutex);
+            group->n_active--;
 
-    return 0;
-}
+            // the other states waited for this one
+            if (!group->requests.empty() && (int) group->requests.size() == group->n_active) {
+                whisper_group_compute(*group);
+            }
+        }
+    }
+};
 
-struct whisper_token_data whisper_sample_best(struct whisper_context * ctx) {
+// samples the next token from the probabilities of the last decoder call
+static struct whisper_token_data whisper_sample_token(struct whisper_context * ctx, struct whisper_state * state, bool force_timestamp, bool is_initial) {
     const int64_t t_start_sample_us = ggml_time_us();
 
-    const auto res = whisper_sample_best(ctx->vocab, ctx->probs.data() + (ctx->probs.size() - ctx->vocab.n_vocab), false, false);
+    const auto res = whisper_sample_best(ctx->vocab, state->probs.data(), force_timestamp, is_initial);
 
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
     return res;
 }
 
-struct whisper_token_data whisper_sample_timestamp(struct whisper_context * ctx, bool is_initial) {
-    const int64_t t_start_sample_us = ggml_time_us();
-
-    const auto res = whisper_sample_best(ctx->vocab, ctx->probs.data() + (ctx->probs.size() - ctx->vocab.n_vocab), true, is_initial);
-
-    ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+struct whisper_token_data whisper_sample_best(struct whisper_context * ctx) {
+    return whisper_sample_token(ctx, ctx->state, false, false);
+}
 
-    return res;
+struct whisper_token_data whisper_sample_timestamp(struct whisper_context * ctx, bool is_initial) {
+    return whisper_sample_token(ctx, ctx->state, true, is_initial);
 }
 
 int whisper_lang_id(const char * lang) {
@@ -2294,8 +4426,12 @@ int whisper_lang_id(const char * lang) {
     return g_lang.at(lang).first;
 }
 
+int whisper_n_len_from_state(struct whisper_state * state) {
+    return state->mel.n_len;
+}
+
 int whisper_n_len(struct whisper_context * ctx) {
-    return ctx->mel.n_len;
+    return whisper_n_len_from_state(ctx->state);
 }
 
 int whisper_n_vocab(struct whisper_context * ctx) {
@@ -2310,8 +4446,12 @@ int whisper_is_multilingual(struct whisper_context * ctx) {
     return ctx->vocab.is_multilingual() ? 1 : 0;
 }
 
+float * whisper_get_probs_from_state(struct whisper_state * state) {
+    return state->probs.data();
+}
+
 float * whisper_get_probs(struct whisper_context * ctx) {
-    return ctx->probs.data();
+    return whisper_get_probs_from_state(ctx->state);
 }
 
 const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token) {
@@ -2355,17 +4495,23 @@ void whisper_print_timings(struct whisper_context * ctx) {
 
     Rprintf("\n");
     Rprintf("%s:     load time = %8.2f ms\n", __func__, ctx->t_load_us/1000.0f);
-    Rprintf("%s:      mel time = %8.2f ms\n", __func__, ctx->t_mel_us/1000.0f);
-    Rprintf("%s:   sample time = %8.2f ms\n", __func__, ctx->t_sample_us/1000.0f);
-    Rprintf("%s:   encode time = %8.2f ms / %.2f ms per layer\n", __func__, ctx->t_encode_us/1000.0f, ctx->t_encode_us/1000.0f/ctx->model.hparams.n_audio_layer);
-    Rprintf("%s:   decode time = %8.2f ms / %.2f ms per layer\n", __func__, ctx->t_decode_us/1000.0f, ctx->t_decode_us/1000.0f/ctx->model.hparams.n_text_layer);
+    if (ctx->state) {
+        const auto * state = ctx->state;
+
+        Rprintf("%s:      mel time = %8.2f ms\n", __func__, state->t_mel_us/1000.0f);
+        Rprintf("%s:   sample time = %8.2f ms\n", __func__, state->t_sample_us/1000.0f);
+        Rprintf("%s:   encode time = %8.2f ms / %.2f ms per layer\n", __func__, state->t_encode_us/1000.0f, state->t_encode_us/1000.0f/ctx->model.hparams.n_audio_layer);
+        Rprintf("%s:   decode time = %8.2f ms / %.2f ms per layer\n", __func__, state->t_decode_us/1000.0f, state->t_decode_us/1000.0f/ctx->model.hparams.n_text_layer);
+    }
     Rprintf("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
 void whisper_reset_timings(struct whisper_context * ctx) {
-    ctx->t_sample_us = 0;
-    ctx->t_encode_us = 0;
-    ctx->t_decode_us = 0;
+    if (ctx->state) {
+        ctx->state->t_sample_us = 0;
+        ctx->state->t_encode_us = 0;
+        ctx->state->t_decode_us = 0;
+    }
 }
 
 const char * whisper_print_system_info(void) {
@@ -2396,6 +4542,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                     /*.strategy         =*/ WHISPER_SAMPLING_GREEDY,
 
                     /*.n_threads        =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+                    /*.spin_us          =*/ GGML_DEFAULT_SPIN_US,
                     /*.n_max_text_ctx   =*/ 16384,
                     /*.offset_ms        =*/ 0,
                     /*.duration_ms      =*/ 0,
@@ -2417,6 +4564,12 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                     /*.speed_up         =*/ false,
                     /*.audio_ctx        =*/ 0,
 
+                    /*.vad                =*/ false,
+                    /*.vad_thold          =*/ 0.5f,
+                    /*.vad_freq_thold     =*/ 100.0f,
+                    /*.vad_min_silence_ms =*/ 1000,
+                    /*.vad_pad_ms         =*/ 200,
+
                     /*.prompt_tokens    =*/ nullptr,
                     /*.prompt_n_tokens  =*/ 0,
 
@@ -2445,6 +4598,7 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                     /*.strategy         =*/ WHISPER_SAMPLING_BEAM_SEARCH,
 
                     /*.n_threads        =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+                    /*.spin_us          =*/ GGML_DEFAULT_SPIN_US,
                     /*.n_max_text_ctx   =*/ 16384,
                     /*.offset_ms        =*/ 0,
                     /*.duration_ms      =*/ 0,
@@ -2466,6 +4620,12 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
                     /*.speed_up         =*/ false,
                     /*.audio_ctx        =*/ 0,
 
+                    /*.vad                =*/ false,
+                    /*.vad_thold          =*/ 0.5f,
+                    /*.vad_freq_thold     =*/ 100.0f,
+                    /*.vad_min_silence_ms =*/ 1000,
+                    /*.vad_pad_ms         =*/ 200,
+
                     /*.prompt_tokens    =*/ nullptr,
                     /*.prompt_n_tokens  =*/ 0,
 
@@ -2497,14 +4657,15 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context * ctx,
+        struct whisper_state * state,
         int   i_segment,
         float thold_pt,
         float thold_ptsum);
 
 // wrap the last segment to max_len characters
 // returns the number of new segments
-static int whisper_wrap_segment(struct whisper_context * ctx, int max_len) {
-    auto segment = ctx->result_all.back();
+static int whisper_wrap_segment(struct whisper_context * ctx, struct whisper_state * state, int max_len) {
+    auto segment = state->result_all.back();
 
     int res = 1;
     int acc = 0;
@@ -2523,24 +4684,24 @@ static int whisper_wrap_segment(struct whisper_context * ctx, int max_len) {
 
         if (acc + cur > max_len && i > 0) {
             // split here
-            ctx->result_all.back().text = std::move(text);
-            ctx->result_all.back().t1 = token.t0;
-            ctx->result_all.back().tokens.resize(i);
+            state->result_all.back().text = std::move(text);
+            state->result_all.back().t1 = token.t0;
+            state->result_all.back().tokens.resize(i);
 
-            ctx->result_all.push_back({});
-            ctx->result_all.back().t0 = token.t0;
-            ctx->result_all.back().t1 = segment.t1;
+            state->result_all.push_back({});
+            state->result_all.back().t0 = token.t0;
+            state->result_all.back().t1 = segment.t1;
 
             // add tokens [i, end] to the new segment
-            ctx->result_all.back().tokens.insert(
-                    ctx->result_all.back().tokens.end(),
+            state->result_all.back().tokens.insert(
+                    state->result_all.back().tokens.end(),
                     segment.tokens.begin() + i,
                     segment.tokens.end());
 
             acc = 0;
             text = "";
 
-            segment = ctx->result_all.back();
+            segment = state->result_all.back();
             i = -1;
 
             res++;
@@ -2550,43 +4711,497 @@ static int whisper_wrap_segment(struct whisper_context * ctx, int max_len) {
         }
     }
 
-    ctx->result_all.back().text = std::move(text);
+    state->result_all.back().text = std::move(text);
+
+    return res;
+}
+
+// the tokens decoded for the window at the current seek position
+struct whisper_sequence {
+    std::vector<whisper_token_data> tokens;
+
+    double sum_logprobs = 0.0;
+
+    int  seek_delta = 100*WHISPER_CHUNK_SIZE;
+    int  result_len = 0;     // the tokens after result_len are dropped
+    bool has_ts     = false; // have we already sampled a non-beg timestamp token for the current segment?
+    bool failed     = false;
+};
+
+// add the token sampled at step i to the sequence
+// returns true when the sequence is complete, the token is not added if it would go back in time
+static bool whisper_sequence_push(
+        struct whisper_context * ctx,
+        const struct whisper_full_params & params,
+        whisper_sequence & seq,
+        const whisper_token_data & token,
+        int i,
+        int seek,
+        int seek_end) {
+    // timestamp token - update sliding window
+    if (token.id > whisper_token_beg(ctx)) {
+        const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
+
+        // do not allow to go back in time
+        if (seq.has_ts && seq.seek_delta > seek_delta_new && seq.result_len < i) {
+            return true;
+        }
+
+        seq.seek_delta = seek_delta_new;
+        seq.result_len = i + 1;
+        seq.has_ts = true;
+    }
+
+    seq.tokens.push_back(token);
+    seq.sum_logprobs += log(token.p);
+
+    //{
+    //    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token[token.tid] : "[?]";
+    //    Rprintf("%s: %10s %6d %6.3f '%s'\n", __func__, tt.c_str(), token.id, token.pt, ctx->vocab.id_to_token[token.id].c_str());
+    //}
+
+    // end of segment
+    if (token.id == whisper_token_eot(ctx) ||                   // end of text token
+        (params.max_tokens > 0 && i > params.max_tokens) ||     // max tokens per segment reached
+        (seq.has_ts && seek + seq.seek_delta + 100 >= seek_end) // end of audio reached
+        ) {
+        if (seq.result_len == 0) {
+            if (seek + seq.seek_delta + 100 >= seek_end) {
+                seq.result_len = i + 1;
+            } else {
+                seq.failed = true;
+                return true;
+            }
+        }
+
+        if (params.single_segment) {
+            seq.result_len = i + 1;
+            seq.seek_delta = 100*WHISPER_CHUNK_SIZE;
+        }
+
+        return true;
+    }
+
+    // TESTS: if no tensors are loaded, it means we are running tests
+    if (ctx->model.n_loaded == 0) {
+        seq.seek_delta = 100*WHISPER_CHUNK_SIZE;
+        return true;
+    }
+
+    return false;
+}
+
+// sometimes, the decoding can get stuck in a repetition loop
+// this is a simple strategy to avoid such cases - we simply flag the decoding as failed and advance
+// the sliding window by 1 second
+static bool whisper_sequence_stuck(const whisper_sequence & seq) {
+    return seq.result_len == 0 || seq.seek_delta < 100*WHISPER_CHUNK_SIZE/2;
+}
+
+// beam search: keep the beam_width most probable sequences and extend them one token at a time
+//
+// all beams are decoded together, beam j in slot j of the self-attention memory
+// the children of a beam share its memory - only when a beam has several children, the memory is copied for
+// the others (copy-on-write)
+// the search stops when n_best sequences are complete, the one with the highest mean log probability is returned
+//
+static int whisper_beam_search(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        const struct whisper_full_params & params,
+        const std::vector<whisper_token> & prompt,
+        int seek,
+        int seek_end,
+        whisper_sequence & result) {
+    const auto & vocab = ctx->vocab;
+
+    const int n_vocab = ctx->model.hparams.n_vocab;
+    const int n_beams = std::min(params.beam_search.beam_width, state->kv_n_slots);
+    const int n_best  = params.beam_search.n_best > 0 ? std::min(params.beam_search.n_best, n_beams) : n_beams;
+
+    struct whisper_candidate {
+        int parent;
+        whisper_token_data token;
+        double sum_logprobs;
+    };
+
+    std::vector<whisper_sequence> beams(1); // the prompt
+    std::vector<whisper_sequence> beams_new;
+    std::vector<whisper_sequence> finished;
+
+    std::vector<whisper_candidate> candidates;
+    std::vector<whisper_token> tokens;
+    std::vector<int> parents;
+    std::vector<int> slots;
+    std::vector<bool> used;
+
+    // the prompt is decoded once, in the first slot
+    if (!whisper_full_decode(ctx, state, params.n_threads, prompt.data(), prompt.size(), 0, 1)) {
+        return 1;
+    }
+
+    int n_past = prompt.size();
+
+    for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        // the n_beams most probable tokens of each beam
+        candidates.clear();
+
+        for (int j = 0; j < (int) beams.size(); ++j) {
+            const auto top = whisper_sample_top_k(vocab, state->probs.data() + j*n_vocab, i == 0, i == 0, n_beams + 3);
+
+            int n = 0;
+            for (const auto & token : top) {
+                if (n == n_beams) {
+                    break;
+                }
+                if (!whisper_is_sampled(vocab, token.id) || !(token.p > 0.0f)) {
+                    continue;
+                }
+
+                candidates.push_back({ j, token, beams[j].sum_logprobs + log(token.p) });
+                n++;
+            }
+        }
+
+        std::stable_sort(candidates.begin(), candidates.end(),
+                [](const whisper_candidate & a, const whisper_candidate & b) {
+            return a.sum_logprobs > b.sum_logprobs;
+        });
+
+        // the best candidates are the new beams, the complete ones are set aside
+        beams_new.clear();
+        parents.clear();
+
+        for (const auto & c : candidates) {
+            if ((int) beams_new.size() == n_beams) {
+                break;
+            }
+
+            whisper_sequence seq = beams[c.parent];
+
+            if (whisper_sequence_push(ctx, params, seq, c.token, i, seek, seek_end)) {
+                finished.push_back(std::move(seq));
+            } else {
+                beams_new.push_back(std::move(seq));
+                parents.push_back(c.parent);
+            }
+        }
+
+        state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+        if ((int) finished.size() >= n_best || beams_new.empty()) {
+            break;
+        }
+
+        if (i == n_max - 1) {
+            for (auto & seq : beams_new) {
+                seq.failed = whisper_sequence_stuck(seq);
+                finished.push_back(std::move(seq));
+            }
+            break;
+        }
+
+        const int n_new = beams_new.size();
+
+        // the first child of a beam keeps its slot
+        slots.assign(n_new, -1);
+        used.assign(n_new, false);
+
+        for (int j = 0; j < n_new; ++j) {
+            if (parents[j] < n_new && !used[parents[j]]) {
+                slots[j] = parents[j];
+                used[parents[j]] = true;
+            }
+        }
+
+        // the other children get a copy of the memory of their parent in a slot that is not used by any parent
+        for (int j = 0, k = 0; j < n_new; ++j) {
+            if (slots[j] >= 0) {
+                continue;
+            }
+
+            while (used[k]) {
+                k++;
+            }
+
+            whisper_kv_self_copy(*ctx, *state, parents[j], k, n_past);
+
+            slots[j] = k;
+            used[k] = true;
+        }
+
+        beams.resize(n_new);
+        tokens.resize(n_new);
+
+        for (int j = 0; j < n_new; ++j) {
+            beams[slots[j]] = std::move(beams_new[j]);
+            tokens[slots[j]] = beams[slots[j]].tokens.back().id;
+        }
+
+        // decode the last token of all beams at once
+        if (!whisper_full_decode(ctx, state, params.n_threads, tokens.data(), n_new, n_past, n_new)) {
+            return 1;
+        }
+
+        n_past += 1;
+    }
+
+    if (finished.empty()) {
+        result = whisper_sequence();
+        result.failed = true;
+        return 0;
+    }
+
+    // prefer the sequences that did not fail, then the highest mean log probability of the tokens
+    int best = 0;
+
+    for (int j = 1; j < (int) finished.size(); ++j) {
+        const auto & a = finished[j];
+        const auto & b = finished[best];
+
+        if (a.failed != b.failed) {
+            if (!a.failed) {
+                best = j;
+            }
+            continue;
+        }
+
+        if (a.sum_logprobs/std::max<size_t>(1, a.tokens.size()) > b.sum_logprobs/std::max<size_t>(1, b.tokens.size())) {
+            best = j;
+        }
+    }
+
+    result = std::move(finished[best]);
+
+    return 0;
+}
+
+// [EXPERIMENTAL] voice activity detection
+//
+// returns the spans [i0, i1) of the samples with speech
+// the energy of a frame of 10 ms is the mean absolute amplitude of the high-passed signal around it, a frame is speech
+// if its energy is above vad_thold times the mean energy of the audio
+// silences shorter than vad_min_silence_ms are kept and each span is padded with vad_pad_ms on both sides
+//
+static std::vector<std::pair<int, int>> whisper_vad_speech_spans(
+        const float * samples,
+        int n_samples,
+        const whisper_full_params & params) {
+    const int n_frame = WHISPER_SAMPLE_RATE/100;
+    const int n_frames = (n_samples + n_frame - 1)/n_frame;
+
+    std::vector<std::pair<int, int>> spans;
+
+    if (n_frames == 0) {
+        return spans;
+    }
+
+    // one-pole high-pass filter, removes hum and offsets which would otherwise count as speech
+    const float rc    = 1.0f/(2.0f*M_PI*params.vad_freq_thold);
+    const float dt    = 1.0f/WHISPER_SAMPLE_RATE;
+    const float alpha = rc/(rc + dt);
+
+    std::vector<float> energy(n_frames, 0.0f);
+    {
+        float y = 0.0f;
+        for (int i = 0; i < n_samples; ++i) {
+            y = alpha*(y + samples[i] - (i > 0 ? samples[i - 1] : samples[0]));
+            energy[i/n_frame] += fabsf(y);
+        }
+        for (int f = 0; f < n_frames; ++f) {
+            energy[f] /= std::min(n_frame, n_samples - f*n_frame);
+        }
+    }
+
+    // smooth over 50 ms, so that short dips within words are not silence
+    std::vector<float> energy_smooth(n_frames);
+    double energy_mean = 0.0;
+    {
+        const int hw = 2;
+
+        for (int f = 0; f < n_frames; ++f) {
+            float sum = 0.0f;
+            int   n   = 0;
+            for (int j = std::max(0, f - hw); j <= std::min(n_frames - 1, f + hw); ++j) {
+                sum += energy[j];
+                n++;
+            }
+            energy_smooth[f] = sum/n;
+            energy_mean += energy[f];
+        }
+        energy_mean /= n_frames;
+    }
+
+    if (energy_mean <= 0.0) {
+        return spans;
+    }
+
+    const float thold = params.vad_thold*energy_mean;
+
+    const int n_min_silence = params.vad_min_silence_ms/10;
+    const int n_pad         = params.vad_pad_ms/10;
+
+    // runs of speech frames, merged when the silence between them is short
+    std::vector<std::pair<int, int>> runs;
+    for (int f = 0; f < n_frames; ) {
+        if (energy_smooth[f] <= thold) {
+            ++f;
+            continue;
+        }
+
+        const int f0 = f;
+        while (f < n_frames && energy_smooth[f] > thold) {
+            ++f;
+        }
+
+        if (!runs.empty() && f0 - runs.back().second < n_min_silence) {
+            runs.back().second = f;
+        } else {
+            runs.push_back({ f0, f });
+        }
+    }
+
+    // pad and merge the spans which overlap after padding
+    for (const auto & run : runs) {
+        const int i0 = std::max(0, run.first - n_pad)*n_frame;
+        const int i1 = std::min(n_samples, (run.second + n_pad)*n_frame);
+
+        if (!spans.empty() && i0 <= spans.back().second) {
+            spans.back().second = i1;
+        } else {
+            spans.push_back({ i0, i1 });
+        }
+    }
+
+    return spans;
+}
+
+// map a time of the transcribed speech to the time in the input audio, both in units of 10 ms
+// the end of a segment which stops at the end of a span stays in that span
+static int64_t whisper_vad_map_time(const whisper_state & state, int64_t t, bool is_end) {
+    const auto & map = state.vad_map;
+
+    if (map.empty() || t < 0) {
+        return t;
+    }
+
+    const int64_t i = t*(WHISPER_SAMPLE_RATE/100);
+
+    // the last span starting before i
+    int k = 0;
+    while (k + 1 < (int) map.size() && (is_end ? map[k + 1].i_speech < i : map[k + 1].i_speech <= i)) {
+        ++k;
+    }
+
+    const int64_t offset = std::max((int64_t) 0, std::min(map[k].n, i - map[k].i_speech));
+
+    return (map[k].i_input + offset)/(WHISPER_SAMPLE_RATE/100);
+}
+
+// map the timestamps of the segments from i_segment on to the input audio
+static void whisper_vad_map_segments(whisper_state & state, int i_segment) {
+    if (state.vad_map.empty()) {
+        return;
+    }
+
+    for (int i = i_segment; i < (int) state.result_all.size(); ++i) {
+        auto & segment = state.result_all[i];
 
-    return res;
+        segment.t0 = whisper_vad_map_time(state, segment.t0, false);
+        segment.t1 = whisper_vad_map_time(state, segment.t1, true);
+
+        for (auto & token : segment.tokens) {
+            token.t0 = whisper_vad_map_time(state, token.t0, false);
+            token.t1 = whisper_vad_map_time(state, token.t1, true);
+        }
+    }
 }
 
-int whisper_full(
+static int whisper_full_seek(
         struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_full_params params,
+        int seek_start,
+        int seek_end,
+        const std::function<int(int)> & mel_window);
+
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
         struct whisper_full_params params,
         const float * samples,
         int n_samples) {
     // clear old results
-    auto & result_all = ctx->result_all;
+    auto & result_all = state->result_all;
 
     result_all.clear();
 
+    // only the speech is transcribed, the offset and the duration select the part of the input with the speech to transcribe
+    std::vector<float> samples_speech;
+
+    state->vad_map.clear();
+
+    if (params.vad) {
+        const int i0 = std::min((int64_t) n_samples, ((int64_t) params.offset_ms*WHISPER_SAMPLE_RATE)/1000);
+        const int i1 = params.duration_ms == 0 ? n_samples : std::min((int64_t) n_samples, i0 + ((int64_t) params.duration_ms*WHISPER_SAMPLE_RATE)/1000);
+
+        for (const auto & span : whisper_vad_speech_spans(samples + i0, i1 - i0, params)) {
+            state->vad_map.push_back({ (int64_t) samples_speech.size(), (int64_t) i0 + span.first, (int64_t) span.second - span.first });
+
+            samples_speech.insert(samples_speech.end(), samples + i0 + span.first, samples + i0 + span.second);
+        }
+
+        if (samples_speech.empty()) {
+            return 0;
+        }
+
+        samples   = samples_speech.data();
+        n_samples = samples_speech.size();
+
+        params.offset_ms   = 0;
+        params.duration_ms = 0;
+    }
+
     // compute log mel spectrogram
     if (params.speed_up) {
-        if (whisper_pcm_to_mel_phase_vocoder(ctx, samples, n_samples, params.n_threads) != 0) {
+        if (whisper_pcm_to_mel_phase_vocoder(ctx, state, samples, n_samples, params.n_threads) != 0) {
             Rprintf("%s: failed to compute log mel spectrogram\n", __func__);
             return -1;
         }
     } else {
-        if (whisper_pcm_to_mel(ctx, samples, n_samples, params.n_threads) != 0) {
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
             Rprintf("%s: failed to compute log mel spectrogram\n", __func__);
             return -1;
         }
     }
 
     if (params.token_timestamps) {
-        ctx->t_beg = 0;
-        ctx->t_last = 0;
-        ctx->tid_last = 0;
-        ctx->energy = get_signal_energy(samples, n_samples, 32);
+        state->t_beg = 0;
+        state->t_last = 0;
+        state->tid_last = 0;
+        state->energy = get_signal_energy(samples, n_samples, 32);
     }
 
     const int seek_start = params.offset_ms/10;
-    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len(ctx) : params.duration_ms/10);
+    const int seek_end = seek_start + (params.duration_ms == 0 ? whisper_n_len_from_state(state) : params.duration_ms/10);
+
+    // the spectrogram of all the samples is in the state
+    return whisper_full_seek(ctx, state, params, seek_start, seek_end, [](int seek) { return seek; });
+}
+
+// transcribe the windows of the log mel spectrogram from seek_start until seek_end
+// mel_window(seek) makes the frames from seek on available in state->mel and returns the offset of frame seek in it,
+// -1 on failure
+static int whisper_full_seek(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_full_params params,
+        int seek_start,
+        int seek_end,
+        const std::function<int(int)> & mel_window) {
+    auto & result_all = state->result_all;
 
     // if length of spectrogram is less than 1s (100 samples), then return
     // basically don't process anything that is less than 1s
@@ -2596,7 +5211,7 @@ int whisper_full(
     }
 
     // the accumulated text context so far
-    auto & prompt_past = ctx->prompt_past;
+    auto & prompt_past = state->prompt_past;
     if (params.no_context) {
         prompt_past.clear();
     }
@@ -2610,8 +5225,13 @@ int whisper_full(
         std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
     }
 
+    // the windows are encoded and the tokens decoded together with the ones of the other states of the group until the transcription ends
+    whisper_group_scope group_scope(state->group);
+
     // overwrite audio_ctx
-    ctx->exp_n_audio_ctx = params.audio_ctx;
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    state->spin_us = params.spin_us;
 
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx) };
@@ -2624,12 +5244,26 @@ int whisper_full(
         }
     }
 
+    // one slot of the self-attention memory per beam, with the text positions a window can use:
+    // the previous text (at most half of the text context) and the task tokens, followed by the sampled tokens
+    {
+        const int n_text_ctx = whisper_n_text_ctx(ctx);
+        const int n_prompt   = 1 + std::min(std::max(params.n_max_text_ctx, 0), n_text_ctx/2) + (int) prompt_init.size();
+        const int n_ctx      = std::min(n_text_ctx, n_prompt + n_text_ctx/2 - 5);
+
+        const int n_slots = params.strategy == WHISPER_SAMPLING_BEAM_SEARCH ? std::max(params.beam_search.beam_width, 1) : 1;
+
+        if (n_slots > state->kv_n_slots || n_ctx != state->kv_n_ctx) {
+            if (!whisper_kv_self_init(*ctx, *state, n_slots, n_ctx)) {
+                Rprintf("%s: failed to allocate the memory of %d beams\n", __func__, n_slots);
+                return -1;
+            }
+        }
+    }
+
     int progress_prev = 0;
     int progress_step = 5;
 
-    std::vector<whisper_token_data> tokens_cur;
-    tokens_cur.reserve(whisper_n_text_ctx(ctx));
-
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
@@ -2649,14 +5283,15 @@ int whisper_full(
         }
 
         if (params.encoder_begin_callback) {
-            if (params.encoder_begin_callback(ctx, params.encoder_begin_callback_user_data) == false) {
+            if (params.encoder_begin_callback(ctx, state, params.encoder_begin_callback_user_data) == false) {
                 Rprintf("%s: encoder_begin_callback returned false - aborting\n", __func__);
                 break;
             }
         }
 
         // encode audio features starting at offset seek
-        if (whisper_encode(ctx, seek, params.n_threads) != 0) {
+        const int mel_offset = mel_window(seek);
+        if (mel_offset < 0 || (state->group ? whisper_group_encode(ctx, state, mel_offset) : whisper_encode_with_state(ctx, state, mel_offset, params.n_threads)) != 0) {
             Rprintf("%s: failed to encode\n", __func__);
             return 7;
         }
@@ -2677,8 +5312,6 @@ int whisper_full(
 
         prompt.insert(prompt.end(), prompt_init.begin(), prompt_init.end());
 
-        int seek_delta = 100*WHISPER_CHUNK_SIZE;
-
         // print the prompt
         //printf("\n\n");
         //for (int i = 0; i < prompt.size(); i++) {
@@ -2687,100 +5320,55 @@ int whisper_full(
         //printf("\n\n");
 
         // the accumulated transcription in the current interation
-        int result_len = 0;
-        tokens_cur.clear();
+        whisper_sequence seq;
 
-        bool failed = false;
-        bool has_ts = false; // have we already sampled a non-beg timestamp token for the current segment?
-
-        for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
-            if (whisper_decode(ctx, prompt.data(), prompt.size(), n_past, params.n_threads) != 0) {
+        if (params.strategy == WHISPER_SAMPLING_BEAM_SEARCH && params.beam_search.beam_width > 1) {
+            if (whisper_beam_search(ctx, state, params, prompt, seek, seek_end, seq) != 0) {
                 Rprintf("%s: failed to decode\n", __func__);
                 return 8;
             }
+        } else {
+            for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
+                if (!whisper_full_decode(ctx, state, params.n_threads, prompt.data(), prompt.size(), n_past, 1)) {
+                    Rprintf("%s: failed to decode\n", __func__);
+                    return 8;
+                }
 
-            n_past += prompt.size();
-            prompt.clear();
-
-            // very basic greedy sampling strategy:
-            //
-            //   - always take the most probable token
-            //
-            // more sophisticated sampling strategies could be implemented here, but we keep it simple
-            // feel free to experiment!
-            //
-            {
-                const auto token = (i == 0) ? whisper_sample_timestamp(ctx, true) : whisper_sample_best(ctx);
-
-                // timestamp token - update sliding window
-                if (token.id > whisper_token_beg(ctx)) {
-                    const int seek_delta_new = 2*(token.id - whisper_token_beg(ctx));
-
-                    // do not allow to go back in time
-                    if (has_ts && seek_delta > seek_delta_new && result_len < i) {
-                        break;
-                    }
+                n_past += prompt.size();
+                prompt.clear();
 
-                    seek_delta = seek_delta_new;
-                    result_len = i + 1;
-                    has_ts = true;
-                }
+                // very basic greedy sampling strategy:
+                //
+                //   - always take the most probable token
+                //
+                const auto token = whisper_sample_token(ctx, state, i == 0, i == 0);
 
                 // add it to the context
                 prompt.push_back(token.id);
-                tokens_cur.push_back(token);
-
-                //{
-                //    const auto tt = token.pt > 0.10 ? ctx->vocab.id_to_token[token.tid] : "[?]";
-                //    Rprintf("%s: %10s %6d %6.3f '%s'\n", __func__, tt.c_str(), token.id, token.pt, ctx->vocab.id_to_token[token.id].c_str());
-                //}
-
-                // end of segment
-                if (token.id == whisper_token_eot(ctx) ||               // end of text token
-                    (params.max_tokens > 0 && i > params.max_tokens) || // max tokens per segment reached
-                    (has_ts && seek + seek_delta + 100 >= seek_end)     // end of audio reached
-                    ) {
-                    if (result_len == 0) {
-                        if (seek + seek_delta + 100 >= seek_end) {
-                            result_len = i + 1;
-                        } else {
-                            failed = true;
-                            break;
-                        }
-                    }
-
-                    if (params.single_segment) {
-                        result_len = i + 1;
-                        seek_delta = 100*WHISPER_CHUNK_SIZE;
-                    }
 
+                if (whisper_sequence_push(ctx, params, seq, token, i, seek, seek_end)) {
                     break;
                 }
 
-                // TESTS: if no tensors are loaded, it means we are running tests
-                if (ctx->model.n_loaded == 0) {
-                    seek_delta = 100*WHISPER_CHUNK_SIZE;
+                if (i == n_max - 1 && whisper_sequence_stuck(seq)) {
+                    seq.failed = true;
                     break;
                 }
             }
-
-            // sometimes, the decoding can get stuck in a repetition loop
-            // this is a simple strategy to avoid such cases - we simply flag the decoding as failed and advance
-            // the sliding window by 1 second
-            if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
-                failed = true;
-                break;
-            }
         }
 
-        if (failed) {
+        if (seq.failed) {
             Rprintf("\n%s: failed to generate timestamp token - using fallback strategy\n\n", __func__);
             seek += 100;
             continue;
         }
 
+        const int seek_delta = seq.seek_delta;
+
         // shrink down to result_len
-        tokens_cur.resize(result_len);
+        seq.tokens.resize(seq.result_len);
+
+        const auto & tokens_cur = seq.tokens;
 
         for (const auto & r : tokens_cur) {
             prompt_past.push_back(r.id);
@@ -2810,7 +5398,7 @@ int whisper_full(
 
                         if (params.print_realtime) {
                             if (params.print_timestamps) {
-                                Rprintf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                                Rprintf("[%s --> %s]  %s\n", to_timestamp(whisper_vad_map_time(*state, tt0, false)).c_str(), to_timestamp(whisper_vad_map_time(*state, tt1, true)).c_str(), text.c_str());
                             } else {
                                 Rprintf("%s", text.c_str());
                                 Rcpp::checkUserInterrupt();
@@ -2827,14 +5415,17 @@ int whisper_full(
 
                         if (params.token_timestamps) {
                             whisper_exp_compute_token_level_timestamps(
-                                    ctx, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                                    ctx, state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
                             if (params.max_len > 0) {
-                                n_new = whisper_wrap_segment(ctx, params.max_len);
+                                n_new = whisper_wrap_segment(ctx, state, params.max_len);
                             }
                         }
+
+                        whisper_vad_map_segments(*state, result_all.size() - n_new);
+
                         if (params.new_segment_callback) {
-                            params.new_segment_callback(ctx, n_new, params.new_segment_callback_user_data);
+                            params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                         }
                     }
                     text = "";
@@ -2855,7 +5446,7 @@ int whisper_full(
 
                 if (params.print_realtime) {
                     if (params.print_timestamps) {
-                        Rprintf("[%s --> %s]  %s\n", to_timestamp(tt0).c_str(), to_timestamp(tt1).c_str(), text.c_str());
+                        Rprintf("[%s --> %s]  %s\n", to_timestamp(whisper_vad_map_time(*state, tt0, false)).c_str(), to_timestamp(whisper_vad_map_time(*state, tt1, true)).c_str(), text.c_str());
                     } else {
                         Rprintf("%s", text.c_str());
                         Rcpp::checkUserInterrupt();
@@ -2872,14 +5463,17 @@ int whisper_full(
 
                 if (params.token_timestamps) {
                     whisper_exp_compute_token_level_timestamps(
-                            ctx, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
+                            ctx, state, result_all.size() - 1, params.thold_pt, params.thold_ptsum);
 
                     if (params.max_len > 0) {
-                        n_new = whisper_wrap_segment(ctx, params.max_len);
+                        n_new = whisper_wrap_segment(ctx, state, params.max_len);
                     }
                 }
+
+                whisper_vad_map_segments(*state, result_all.size() - n_new);
+
                 if (params.new_segment_callback) {
-                    params.new_segment_callback(ctx, n_new, params.new_segment_callback_user_data);
+                    params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
                 }
             }
         }
@@ -2890,68 +5484,135 @@ int whisper_full(
     return 0;
 }
 
-int whisper_full_parallel(
+int whisper_full(
         struct whisper_context * ctx,
         struct whisper_full_params params,
         const float * samples,
-        int n_samples,
-        int n_processors) {
-    if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
+        int n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+int whisper_full_from_reader_with_state(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_full_params params,
+        whisper_pcm_read_callback read,
+        whisper_pcm_rewind_callback rewind,
+        void * user_data) {
+    state->result_all.clear();
+    state->vad_map.clear();
+
+    if (params.vad || params.speed_up || params.token_timestamps) {
+        Rprintf("%s: vad, speed_up and token_timestamps need all the samples, use whisper_full_with_state()\n", __func__);
+        return -1;
     }
 
-    int ret = 0;
+    typedef std::unique_ptr<whisper_mel_stream, void (*)(whisper_mel_stream *)> mel_stream_ptr;
 
-    // prepare separate contexts for each thread
-    std::vector<struct whisper_context> ctxs(n_processors - 1);
+    std::vector<float> block(WHISPER_SAMPLE_RATE);
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        ctxs[i] = *ctx;
+    // first pass: the maximum of the spectrogram, which normalizes all its frames, the frames are dropped right away
+    int   n_len = 0;
+    float mmax  = 0.0f;
+    {
+        mel_stream_ptr stream(whisper_mel_stream_init(ctx), whisper_mel_stream_free);
+        stream->n_threads = params.n_threads;
 
-        auto & model = ctxs[i].model;
+        int n_read = 0;
+        while ((n_read = read(block.data(), block.size(), user_data)) > 0) {
+            whisper_mel_stream_push(stream.get(), block.data(), n_read);
+            whisper_mel_stream_discard(stream.get(), stream->n_len);
+        }
+        if (n_read < 0) {
+            Rprintf("%s: failed to read the audio\n", __func__);
+            return -1;
+        }
 
-        // create the ggml memory context
-        {
-            struct ggml_init_params params;
-            params.mem_size   = ctxs[i].buf_memory.size();
-            params.mem_buffer = ctxs[i].buf_memory.data();
+        n_len = whisper_mel_stream_finish(stream.get());
+        mmax  = stream->mmax;
+    }
 
-            model.ctx_mem = ggml_init(params);
-            if (!model.ctx_mem) {
-                Rprintf("%s: ggml_init() failed\n", __func__);
-                return false;
+    if (rewind(user_data) != 0) {
+        Rprintf("%s: failed to rewind the audio\n", __func__);
+        return -1;
+    }
+
+    // second pass: the frames are computed as the windows need them and dropped once the transcription moved past them
+    mel_stream_ptr stream(whisper_mel_stream_init(ctx), whisper_mel_stream_free);
+    stream->n_threads = params.n_threads;
+    stream->mmax      = mmax;
+
+    const int n_window = 2*ctx->model.hparams.n_audio_ctx;
+
+    auto mel_window = [&](int seek) {
+        const int i0 = std::min(seek, n_len);
+        const int i1 = std::min(seek + n_window, n_len);
+
+        while (stream->n_len < i1 && !stream->finished) {
+            const int n_read = read(block.data(), block.size(), user_data);
+            if (n_read < 0) {
+                Rprintf("%s: failed to read the audio\n", __func__);
+                return -1;
+            }
+            if (n_read == 0) {
+                whisper_mel_stream_finish(stream.get());
+            } else {
+                whisper_mel_stream_push(stream.get(), block.data(), n_read);
             }
         }
 
-        // separate key + value memory for each processor
-        {
-            auto & ctx = model.ctx_mem;
+        whisper_mel_stream_discard(stream.get(), i0);
 
-            const auto & hparams = model.hparams;
+        if (whisper_mel_stream_set_mel(ctx, state, stream.get(), i0, i1 - i0) != 0) {
+            return -1;
+        }
 
-            const int n_text_state = hparams.n_text_state;
-            const int n_text_layer = hparams.n_text_layer;
-            const int n_text_ctx   = hparams.n_text_ctx;
+        return 0;
+    };
 
-            // key/value memory for the self-attention layer
-            {
-                const int n_mem      = n_text_layer*n_text_ctx;
-                const int n_elements = n_text_state*n_mem;
+    const int seek_start = params.offset_ms/10;
+    const int seek_end = seek_start + (params.duration_ms == 0 ? n_len : params.duration_ms/10);
 
-                model.memory_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-                model.memory_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-            }
+    return whisper_full_seek(ctx, state, params, seek_start, seek_end, mel_window);
+}
 
-            // key/value memory for the cross-attention layer
-            {
-                const int n_audio_ctx = hparams.n_audio_ctx;
+int whisper_full_parallel_with_state(
+        struct whisper_context * ctx,
+        struct whisper_state * state,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    if (n_processors == 1) {
+        return whisper_full_with_state(ctx, state, params, samples, n_samples);
+    }
+
+    int ret = 0;
 
-                const int n_mem      = n_text_layer*n_audio_ctx;
-                const int n_elements = n_text_state*n_mem;
+    // prepare separate states for each thread
+    // the model weights and the vocabulary are shared, each state only allocates
+    // its own key/value memory and compute buffers
+    std::vector<struct whisper_state *> states(n_processors - 1, nullptr);
 
-                model.memory_cross_k = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
-                model.memory_cross_v = ggml_new_tensor_1d(ctx, GGML_TYPE_F16, n_elements);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        states[i] = whisper_init_state(ctx);
+        if (states[i] == nullptr) {
+            Rprintf("%s: failed to allocate the state for processor %d\n", __func__, i + 1);
+            for (int j = 0; j < i; ++j) {
+                whisper_free_state(states[j]);
             }
+            return -1;
+        }
+    }
+
+    // the windows of the chunks are encoded as one batch, with the threads of all the processors
+    whisper_group * group = nullptr;
+    if (!state->group) {
+        group = whisper_group_init(params.n_threads*n_processors);
+
+        whisper_group_add_state(group, state);
+        for (int i = 0; i < n_processors - 1; ++i) {
+            whisper_group_add_state(group, states[i]);
         }
     }
 
@@ -2975,24 +5636,26 @@ int whisper_full_parallel(
         params_cur.new_segment_callback = nullptr;
         params_cur.new_segment_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full, &ctxs[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
     }
 
     {
         auto params_cur = params;
 
-        ret = whisper_full(ctx, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+        ret = whisper_full_with_state(ctx, state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
     }
 
     for (int i = 0; i < n_processors - 1; ++i) {
         workers[i].join();
     }
 
+    whisper_group_free(group);
+
     const int64_t offset_t = (int64_t) params.offset_ms/10.0;
 
-    // combine results into ctx->result_all
+    // combine results into state->result_all
     for (int i = 0; i < n_processors - 1; ++i) {
-        auto & results_i = ctxs[i].result_all;
+        auto & results_i = states[i]->result_all;
 
         for (int j = 0; j < (int) results_i.size(); ++j) {
             // correct the segment timestamp taking into account the offset
@@ -3000,29 +5663,31 @@ int whisper_full_parallel(
             results_i[j].t1 += 100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t;
 
             // make sure that segments are not overlapping
-            if (ctx->result_all.size() > 0) {
-                results_i[j].t0 = std::max(results_i[j].t0, ctx->result_all.back().t1);
+            if (state->result_all.size() > 0) {
+                results_i[j].t0 = std::max(results_i[j].t0, state->result_all.back().t1);
             }
 
-            ctx->result_all.push_back(std::move(results_i[j]));
+            state->result_all.push_back(std::move(results_i[j]));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
-                params.new_segment_callback(ctx, 1, params.new_segment_callback_user_data);
+                params.new_segment_callback(ctx, state, 1, params.new_segment_callback_user_data);
             }
         }
 
-        ctx->t_mel_us    += ctxs[i].t_mel_us;
-        ctx->t_sample_us += ctxs[i].t_sample_us;
-        ctx->t_encode_us += ctxs[i].t_encode_us;
-        ctx->t_decode_us += ctxs[i].t_decode_us;
+        state->t_mel_us    += states[i]->t_mel_us;
+        state->t_sample_us += states[i]->t_sample_us;
+        state->t_encode_us += states[i]->t_encode_us;
+        state->t_decode_us += states[i]->t_decode_us;
+
+        whisper_free_state(states[i]);
     }
 
     // average the timings
-    ctx->t_mel_us    /= n_processors;
-    ctx->t_sample_us /= n_processors;
-    ctx->t_encode_us /= n_processors;
-    ctx->t_decode_us /= n_processors;
+    state->t_mel_us    /= n_processors;
+    state->t_sample_us /= n_processors;
+    state->t_encode_us /= n_processors;
+    state->t_decode_us /= n_processors;
 
     // print information about the audio boundaries
     Rprintf("\n");
@@ -3035,40 +5700,356 @@ int whisper_full_parallel(
     return ret;
 }
 
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+    return whisper_full_parallel_with_state(ctx, ctx->state, params, samples, n_samples, n_processors);
+}
+
+int whisper_full_n_segments_from_state(struct whisper_state * state) {
+    return state->result_all.size();
+}
+
 int whisper_full_n_segments(struct whisper_context * ctx) {
-    return ctx->result_all.size();
+    return whisper_full_n_segments_from_state(ctx->state);
+}
+
+int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t0;
 }
 
 int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].t0;
+    return whisper_full_get_segment_t0_from_state(ctx->state, i_segment);
+}
+
+int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].t1;
 }
 
 int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].t1;
+    return whisper_full_get_segment_t1_from_state(ctx->state, i_segment);
+}
+
+const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].text.c_str();
 }
 
 const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].text.c_str();
+    return whisper_full_get_segment_text_from_state(ctx->state, i_segment);
+}
+
+int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment) {
+    return state->result_all[i_segment].tokens.size();
 }
 
 int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment) {
-    return ctx->result_all[i_segment].tokens.size();
+    return whisper_full_n_tokens_from_state(ctx->state, i_segment);
+}
+
+const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token) {
+    return ctx->vocab.id_to_token[state->result_all[i_segment].tokens[i_token].id].c_str();
 }
 
 const char * whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->vocab.id_to_token[ctx->result_all[i_segment].tokens[i_token].id].c_str();
+    return whisper_full_get_token_text_from_state(ctx, ctx->state, i_segment, i_token);
+}
+
+whisper_token whisper_full_get_token_id_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].id;
 }
 
 whisper_token whisper_full_get_token_id(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token].id;
+    return whisper_full_get_token_id_from_state(ctx->state, i_segment, i_token);
+}
+
+struct whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token];
 }
 
 struct whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token];
+    return whisper_full_get_token_data_from_state(ctx->state, i_segment, i_token);
+}
+
+float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token) {
+    return state->result_all[i_segment].tokens[i_token].p;
 }
 
 float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token) {
-    return ctx->result_all[i_segment].tokens[i_token].p;
+    return whisper_full_get_token_p_from_state(ctx->state, i_segment, i_token);
+}
+
+struct whisper_stream {
+    whisper_context * ctx   = nullptr;
+    whisper_state   * state = nullptr;
+
+    whisper_full_params params;
+
+    // in samples
+    int n_step   = 0;
+    int n_length = 0;
+    int n_keep   = 0;
+
+    // the current window holds n_window samples, from sample t_offset of the stream on
+    int     n_window = 0;
+    int64_t t_offset = 0;
+
+    // number of samples at the end of the window that have not been transcribed yet
+    int n_new = 0;
+
+    // the log mel spectrogram is computed once, as the audio arrives, frame i of mel starts at sample mel_t0 + i*WHISPER_HOP_LENGTH
+    // vad, speed_up and token_timestamps need the samples, the window is then kept in pcm and transcribed by whisper_full_with_state()
+    whisper_mel_stream * mel = nullptr;
+    int64_t mel_t0 = 0;
+
+    std::vector<float> pcm;
+
+    // text tokens of the committed segments, used as prompt for the next windows
+    std::vector<whisper_token> prompt;
+
+    std::vector<whisper_segment> committed;
+    std::vector<whisper_segment> tentative;
+};
+
+struct whisper_stream * whisper_stream_init(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        int step_ms,
+        int length_ms,
+        int keep_ms) {
+    if (step_ms <= 0) {
+        Rprintf("%s: invalid step %d ms\n", __func__, step_ms);
+        return NULL;
+    }
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        return NULL;
+    }
+
+    whisper_stream * stream = new whisper_stream;
+
+    stream->ctx   = ctx;
+    stream->state = state;
+
+    stream->n_step   = (int64_t) step_ms*WHISPER_SAMPLE_RATE/1000;
+    stream->n_length = (int64_t) std::max(length_ms, step_ms)*WHISPER_SAMPLE_RATE/1000;
+    stream->n_keep   = (int64_t) std::max(0, std::min(keep_ms, step_ms))*WHISPER_SAMPLE_RATE/1000;
+
+    // the stream keeps the prompt tokens itself, the windows are positioned by the stream
+    if (params.prompt_tokens && params.prompt_n_tokens > 0) {
+        stream->prompt.assign(params.prompt_tokens, params.prompt_tokens + params.prompt_n_tokens);
+    }
+
+    params.prompt_tokens   = nullptr;
+    params.prompt_n_tokens = 0;
+    params.offset_ms       = 0;
+    params.duration_ms     = 0;
+
+    // the windows are at most length_ms long, 2 frames per position of the encoder
+    // the size is the same for every window, so that the cross attention memory is allocated once
+    if (params.audio_ctx == 0) {
+        params.audio_ctx = std::min<int64_t>(ctx->model.hparams.n_audio_ctx, (stream->n_length/WHISPER_HOP_LENGTH + 1)/2);
+    }
+
+    if (!params.vad && !params.speed_up && !params.token_timestamps) {
+        stream->mel = whisper_mel_stream_init(ctx);
+        stream->mel->n_threads = params.n_threads;
+    }
+
+    stream->params = params;
+
+    return stream;
+}
+
+void whisper_stream_free(struct whisper_stream * stream) {
+    if (stream) {
+        whisper_mel_stream_free(stream->mel);
+        whisper_free_state(stream->state);
+        delete stream;
+    }
+}
+
+static void whisper_stream_commit(whisper_stream & stream, std::vector<whisper_segment> & segments) {
+    const whisper_token token_eot = whisper_token_eot(stream.ctx);
+
+    for (auto & segment : segments) {
+        for (const auto & token : segment.tokens) {
+            if (token.id < token_eot) {
+                stream.prompt.push_back(token.id);
+            }
+        }
+
+        // only the text and the timestamps are kept
+        segment.tokens.clear();
+        segment.tokens.shrink_to_fit();
+
+        stream.committed.push_back(std::move(segment));
+    }
+
+    segments.clear();
+
+    // whisper_full() uses at most half of the text context as prompt
+    const int n_prompt_max = whisper_n_text_ctx(stream.ctx)/2;
+    if ((int) stream.prompt.size() > n_prompt_max) {
+        stream.prompt.erase(stream.prompt.begin(), stream.prompt.end() - n_prompt_max);
+    }
+}
+
+// transcribe the first n_samples of the window and either commit the segments or keep them as tentative
+static int whisper_stream_run(whisper_stream & stream, int n_samples, bool commit) {
+    auto params = stream.params;
+
+    // the context is passed explicitly so that the tentative windows do not end up in the prompt
+    params.no_context = true;
+    if (!stream.params.no_context && !stream.prompt.empty()) {
+        params.prompt_tokens   = stream.prompt.data();
+        params.prompt_n_tokens = stream.prompt.size();
+    }
+
+    int ret = 0;
+    if (stream.mel) {
+        auto state = stream.state;
+
+        // the last frames of the window are not available until the audio after them arrived
+        const int i0    = (stream.t_offset - stream.mel_t0)/WHISPER_HOP_LENGTH;
+        const int n_len = std::min(n_samples/WHISPER_HOP_LENGTH, whisper_mel_stream_n_len(stream.mel) - i0);
+
+        state->result_all.clear();
+        state->vad_map.clear();
+
+        if (whisper_mel_stream_set_mel(stream.ctx, state, stream.mel, i0, n_len) != 0) {
+            return -1;
+        }
+
+        ret = whisper_full_seek(stream.ctx, state, params, 0, n_len, [](int seek) { return seek; });
+    } else {
+        ret = whisper_full_with_state(stream.ctx, stream.state, params, stream.pcm.data(), n_samples);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    const int64_t t_offset = stream.t_offset/(WHISPER_SAMPLE_RATE/100);
+
+    std::vector<whisper_segment> segments;
+    segments.swap(stream.state->result_all);
+    for (auto & segment : segments) {
+        segment.t0 += t_offset;
+        segment.t1 += t_offset;
+    }
+
+    stream.tentative.clear();
+    if (commit) {
+        whisper_stream_commit(stream, segments);
+    } else {
+        stream.tentative.swap(segments);
+    }
+
+    return 0;
+}
+
+int whisper_stream_push(struct whisper_stream * stream, const float * samples, int n_samples) {
+    if (stream->mel) {
+        if (whisper_mel_stream_push(stream->mel, samples, n_samples) < 0) {
+            return -1;
+        }
+    } else {
+        stream->pcm.insert(stream->pcm.end(), samples, samples + n_samples);
+    }
+    stream->n_window += n_samples;
+    stream->n_new    += n_samples;
+
+    while (stream->n_new >= stream->n_step) {
+        const int n_window = stream->n_window - (stream->n_new - stream->n_step);
+
+        stream->n_new -= stream->n_step;
+
+        // commit once the next step does not fit in the window anymore
+        const bool commit = n_window + stream->n_step > stream->n_length;
+
+        const int ret = whisper_stream_run(*stream, n_window, commit);
+        if (ret != 0) {
+            return ret;
+        }
+
+        if (commit) {
+            int n_drop = n_window - std::min(stream->n_keep, n_window);
+
+            // the windows start on a frame of the spectrogram
+            n_drop -= n_drop % WHISPER_HOP_LENGTH;
+
+            if (stream->mel) {
+                whisper_mel_stream_discard(stream->mel, (stream->t_offset + n_drop - stream->mel_t0)/WHISPER_HOP_LENGTH);
+            } else {
+                stream->pcm.erase(stream->pcm.begin(), stream->pcm.begin() + n_drop);
+            }
+            stream->t_offset += n_drop;
+            stream->n_window -= n_drop;
+        }
+    }
+
+    return 0;
+}
+
+int whisper_stream_finish(struct whisper_stream * stream) {
+    if (stream->mel) {
+        whisper_mel_stream_finish(stream->mel);
+    }
+
+    if (stream->n_new > 0) {
+        const int ret = whisper_stream_run(*stream, stream->n_window, true);
+        if (ret != 0) {
+            return ret;
+        }
+    } else {
+        // the tentative segments already cover all the audio
+        whisper_stream_commit(*stream, stream->tentative);
+    }
+
+    stream->t_offset += stream->n_window;
+    stream->n_window = 0;
+    stream->n_new    = 0;
+    stream->pcm.clear();
+
+    // the audio pushed after this starts a new spectrogram
+    if (stream->mel) {
+        const int n_threads = stream->mel->n_threads;
+
+        whisper_mel_stream_free(stream->mel);
+        stream->mel = whisper_mel_stream_init(stream->ctx);
+        stream->mel->n_threads = n_threads;
+        stream->mel_t0 = stream->t_offset;
+    }
+
+    return 0;
+}
+
+int whisper_stream_n_segments(struct whisper_stream * stream) {
+    return stream->committed.size() + stream->tentative.size();
+}
+
+int whisper_stream_n_committed(struct whisper_stream * stream) {
+    return stream->committed.size();
+}
+
+static const whisper_segment & whisper_stream_get_segment(const whisper_stream & stream, int i_segment) {
+    const int n_committed = stream.committed.size();
+    return i_segment < n_committed ? stream.committed[i_segment] : stream.tentative[i_segment - n_committed];
+}
+
+int64_t whisper_stream_get_segment_t0(struct whisper_stream * stream, int i_segment) {
+    return whisper_stream_get_segment(*stream, i_segment).t0;
+}
+
+int64_t whisper_stream_get_segment_t1(struct whisper_stream * stream, int i_segment) {
+    return whisper_stream_get_segment(*stream, i_segment).t1;
+}
+
+const char * whisper_stream_get_segment_text(struct whisper_stream * stream, int i_segment) {
+    return whisper_stream_get_segment(*stream, i_segment).text.c_str();
 }
 
 // =================================================================================================
@@ -3141,13 +6122,14 @@ static std::vector<float> get_signal_energy(const float * signal, int n_samples,
 
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context * ctx,
+        struct whisper_state * state,
         int   i_segment,
         float thold_pt,
         float thold_ptsum) {
-    auto & segment = ctx->result_all[i_segment];
+    auto & segment = state->result_all[i_segment];
     auto & tokens  = segment.tokens;
 
-    const int n_samples = ctx->energy.size();
+    const int n_samples = state->energy.size();
 
     if (n_samples == 0) {
         Rprintf("%s: no signal data available\n", __func__);
@@ -3170,9 +6152,9 @@ static void whisper_exp_compute_token_level_timestamps(
         return;
     }
 
-    auto & t_beg    = ctx->t_beg;
-    auto & t_last   = ctx->t_last;
-    auto & tid_last = ctx->tid_last;
+    auto & t_beg    = state->t_beg;
+    auto & t_last   = state->t_last;
+    auto & tid_last = state->tid_last;
 
     for (int j = 0; j < n; ++j) {
         auto & token = tokens[j];
@@ -3293,15 +6275,15 @@ static void whisper_exp_compute_token_level_timestamps(
             float sum = 0.0f;
 
             for (int k = ss0; k < ss1; k++) {
-                sum += ctx->energy[k];
+                sum += state->energy[k];
             }
 
             const float thold = 0.5*sum/ns;
 
             {
                 int k = s0;
-                if (ctx->energy[k] > thold && j > 0) {
-                    while (k > 0 && ctx->energy[k] > thold) {
+                if (state->energy[k] > thold && j > 0) {
+                    while (k > 0 && state->energy[k] > thold) {
                         k--;
                     }
                     tokens[j].t0 = sample_to_timestamp(k);
@@ -3311,7 +6293,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s0 = k;
                     }
                 } else {
-                    while (ctx->energy[k] < thold && k < s1) {
+                    while (state->energy[k] < thold && k < s1) {
                         k++;
                     }
                     s0 = k;
@@ -3321,8 +6303,8 @@ static void whisper_exp_compute_token_level_timestamps(
 
             {
                 int k = s1;
-                if (ctx->energy[k] > thold) {
-                    while (k < n_samples - 1 && ctx->energy[k] > thold) {
+                if (state->energy[k] > thold) {
+                    while (k < n_samples - 1 && state->energy[k] > thold) {
                         k++;
                     }
                     tokens[j].t1 = sample_to_timestamp(k);
@@ -3332,7 +6314,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s1 = k;
                     }
                 } else {
-                    while (ctx->energy[k] < thold && k > s0) {
+                    while (state->energy[k] < thold && k > s0) {
                         k--;
                     }
                     s1 = k;
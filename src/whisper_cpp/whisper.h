@@ -65,6 +65,10 @@ extern "C" {
     //
 
     struct whisper_context;
+    struct whisper_state;
+    struct whisper_mel_stream;
+    struct whisper_stream;
+    struct whisper_group;
 
     typedef int whisper_token;
 
@@ -85,12 +89,42 @@ extern "C" {
     } whisper_token_data;
 
     // Allocates all memory needed for the model and loads the model from the given file.
+    // The context gets a default state, which is used by all the functions without a state argument.
     // Returns NULL on failure.
     WHISPER_API struct whisper_context * whisper_init(const char * path_model);
 
-    // Frees all memory allocated by the model.
+    // Same as whisper_init(), but without the default state.
+    // Only the functions which take a whisper_state argument can be used with such a context.
+    // Returns NULL on failure.
+    WHISPER_API struct whisper_context * whisper_init_no_state(const char * path_model);
+
+    // Creates the state that holds the key/value memory, the compute buffers and the results of a transcription.
+    // The memory is allocated when it is first needed, for the audio and text context in use.
+    // The model in the context is only read, so several states can be used concurrently with the same context,
+    // as long as each state is used by one thread at a time.
+    // Returns NULL on failure.
+    WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
+
+    // Frees all memory allocated by the model, including the default state.
     WHISPER_API void whisper_free(struct whisper_context * ctx);
 
+    // Frees all memory allocated by the state.
+    WHISPER_API void whisper_free_state(struct whisper_state * state);
+
+    // The type of the weights of the linear layers in a model file
+    enum whisper_ftype {
+        WHISPER_FTYPE_F32  = 0,
+        WHISPER_FTYPE_F16  = 1,
+        WHISPER_FTYPE_Q4_0 = 2, // 4-bit blocks, the model is ~3x smaller than with F16
+        WHISPER_FTYPE_Q8_0 = 7, // 8-bit blocks, the model is ~1.7x smaller than with F16
+    };
+
+    // Writes a copy of the model file in which the weights of the linear layers are converted to the given type.
+    // The input file must contain F32 or F16 weights.
+    // The tensor data of the output file is aligned, so whisper_init maps it instead of reading it into memory.
+    // Returns 0 on success
+    WHISPER_API int whisper_model_quantize(const char * path_model_inp, const char * path_model_out, enum whisper_ftype ftype);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the provided whisper context.
     // Returns 0 on success
@@ -100,6 +134,13 @@ extern "C" {
                                int   n_samples,
                                int   n_threads);
 
+    WHISPER_API int whisper_pcm_to_mel_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_threads);
+
     // This can be used to set a custom log mel spectrogram inside the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -110,6 +151,52 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    WHISPER_API int whisper_set_mel_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * data,
+                               int   n_len,
+                               int   n_mel);
+
+    // Incremental log mel spectrogram computation for long or live audio.
+    // PCM samples are pushed in chunks of any size and a frame is computed as soon as its window is complete,
+    // only the samples still needed by the next frames are kept.
+    // The frames are normalized with the maximum seen so far when they are copied into a state, after
+    // whisper_mel_stream_finish() the frames are the same as the ones computed by whisper_pcm_to_mel().
+    // The stream must not outlive the context.
+    WHISPER_API struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx);
+
+    WHISPER_API void whisper_mel_stream_free(struct whisper_mel_stream * stream);
+
+    // Append PCM samples (16 kHz mono, float)
+    // Returns the total number of frames computed so far, -1 on failure
+    WHISPER_API int whisper_mel_stream_push(
+        struct whisper_mel_stream * stream,
+                      const float * samples,
+                              int   n_samples);
+
+    // Signal the end of the audio: the remaining frames are computed with zero padding
+    // Returns the total number of frames
+    WHISPER_API int whisper_mel_stream_finish(struct whisper_mel_stream * stream);
+
+    // Total number of frames computed so far, including the discarded ones
+    WHISPER_API int whisper_mel_stream_n_len(struct whisper_mel_stream * stream);
+
+    // Release the frames before frame offset, they can no longer be copied into a state
+    WHISPER_API void whisper_mel_stream_discard(
+        struct whisper_mel_stream * stream,
+                              int   offset);
+
+    // Set the log mel spectrogram of the state to the frames [offset, offset + n_len) of the stream
+    // Use whisper_encode_with_state() with offset 0 afterwards
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_set_mel(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+         struct whisper_mel_stream * stream,
+                               int   offset,
+                               int   n_len);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -119,6 +206,38 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    WHISPER_API int whisper_encode_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   offset,
+                               int   n_threads);
+
+    // Run the Whisper encoder on n_states windows as one batch, window i is taken at offsets[i] of the spectrogram of states[i]
+    // and its encoded features are stored in states[i], so each window needs its own state.
+    // The weights are read once for the whole batch. The computation uses the buffers and the threads of states[0].
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch_with_state(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+                         const int * offsets,
+                               int   n_states,
+                               int   n_threads);
+
+    // A group of states that transcribe at the same time with whisper_full_with_state(), with the same context and the
+    // same audio_ctx, e.g. the states of a pool of threads. While the states of a group are in whisper_full_with_state(),
+    // each state waits for the others before it encodes a window or decodes tokens: the windows are encoded as one batch
+    // as with whisper_encode_batch_with_state() and the tokens are decoded as one batch as with
+    // whisper_decode_batch_with_state(), using n_threads threads.
+    // whisper_full_parallel_with_state() groups the states of its chunks.
+    WHISPER_API struct whisper_group * whisper_group_init(int n_threads);
+
+    // Free the group before its states, and not while they are in whisper_full_with_state()
+    WHISPER_API void whisper_group_free(struct whisper_group * group);
+
+    // Add the state to the group, a state belongs to at most one group
+    // Returns 0 on success
+    WHISPER_API int whisper_group_add_state(struct whisper_group * group, struct whisper_state * state);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -131,6 +250,30 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    WHISPER_API int whisper_decode_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+               const whisper_token * tokens,
+                               int   n_tokens,
+                               int   n_past,
+                               int   n_threads);
+
+    // Run the Whisper decoder on n_states independent sequences as one batch.
+    // Sequence i continues the decoding of states[i] with tokens[i] + n_tokens[i] after n_past[i] tokens, each state
+    // with the audio it encoded, and its probabilities are stored in states[i] as with whisper_decode_with_state().
+    // Each state decodes 1 sequence, in the first slot of its self-attention memory like whisper_decode_with_state(),
+    // so states[i] must all be different. The other slots only hold the beams of whisper_full().
+    // The weights are read once for the whole batch. The computation uses the buffers and the threads of states[0].
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_batch_with_state(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+        const whisper_token * const * tokens,
+                         const int * n_tokens,
+                         const int * n_past,
+                               int   n_states,
+                               int   n_threads);
+
     // Token sampling methods.
     // These are provided for convenience and can be used after each call to whisper_decode().
     // You can also implement your own sampling method using the whisper_get_probs() function.
@@ -143,12 +286,14 @@ extern "C" {
     WHISPER_API int whisper_lang_id(const char * lang);
 
     WHISPER_API int whisper_n_len          (struct whisper_context * ctx); // mel length
+    WHISPER_API int whisper_n_len_from_state(struct whisper_state * state); // mel length
     WHISPER_API int whisper_n_vocab        (struct whisper_context * ctx);
     WHISPER_API int whisper_n_text_ctx     (struct whisper_context * ctx);
     WHISPER_API int whisper_is_multilingual(struct whisper_context * ctx);
 
     // The probabilities for the next token
     WHISPER_API float * whisper_get_probs(struct whisper_context * ctx);
+    WHISPER_API float * whisper_get_probs_from_state(struct whisper_state * state);
 
     // Token Id -> String. Uses the vocabulary in the provided context
     WHISPER_API const char * whisper_token_to_str(struct whisper_context * ctx, whisper_token token);
@@ -177,18 +322,18 @@ extern "C" {
     // Available sampling strategies
     enum whisper_sampling_strategy {
         WHISPER_SAMPLING_GREEDY,      // Always select the most probable token
-        WHISPER_SAMPLING_BEAM_SEARCH, // TODO: not implemented yet!
+        WHISPER_SAMPLING_BEAM_SEARCH, // Keep the beam_width most probable sequences, decoded in a single batch
     };
 
     // Text segment callback
     // Called on every newly generated text segment
     // Use the whisper_full_...() functions to obtain the text segments
-    typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, int n_new, void * user_data);
+    typedef void (*whisper_new_segment_callback)(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data);
 
     // Encoder begin callback
     // If not NULL, called before the encoder starts
     // If it returns false, the computation is aborted
-    typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, void * user_data);
+    typedef bool (*whisper_encoder_begin_callback)(struct whisper_context * ctx, struct whisper_state * state, void * user_data);
 
     // Parameters for the whisper_full() function
     // If you chnage the order or add new parameters, make sure to update the default values in whisper.cpp:
@@ -197,6 +342,7 @@ extern "C" {
         enum whisper_sampling_strategy strategy;
 
         int n_threads;
+        int spin_us;            // time in us the threads busy-wait for each other before sleeping (0 - sleep right away, -1 - never sleep)
         int n_max_text_ctx;
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
@@ -220,6 +366,14 @@ extern "C" {
         bool speed_up;          // speed-up the audio by 2x using Phase Vocoder
         int  audio_ctx;         // overwrite the audio context size (0 = use default)
 
+        // [EXPERIMENTAL] voice activity detection
+        // only the spans of the audio with speech are transcribed, the timestamps of the results refer to the input audio
+        bool  vad;                // enable voice activity detection
+        float vad_thold;          // a 10 ms frame is speech if its energy is above vad_thold times the mean energy (~0.5)
+        float vad_freq_thold;     // cut-off frequency of the high-pass filter applied before the energy is computed (~100 Hz)
+        int   vad_min_silence_ms; // silences shorter than this are transcribed with the speech around them
+        int   vad_pad_ms;         // audio kept before and after each span of speech
+
         // tokens to provide the whisper model as initial prompt
         // these are prepended to any existing text context from a previous call
         const whisper_token * prompt_tokens;
@@ -233,8 +387,8 @@ extern "C" {
 
         struct {
             int n_past;
-            int beam_width;
-            int n_best;
+            int beam_width;     // number of beams, each beam keeps its own self-attention memory
+            int n_best;         // stop when n_best sequences are complete (0 = beam_width)
         } beam_search;
 
         whisper_new_segment_callback new_segment_callback;
@@ -254,6 +408,38 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // Same as whisper_full(), but uses the given state instead of the default state of the context.
+    // The results are stored in the state and are read with the whisper_full_..._from_state() functions.
+    WHISPER_API int whisper_full_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples);
+
+    // Audio source of whisper_full_from_reader_with_state()
+    // Reads at most n_samples PCM samples (16 kHz mono, float) into samples
+    // Returns the number of samples read, 0 at the end of the audio, -1 on failure
+    typedef int (*whisper_pcm_read_callback)(float * samples, int n_samples, void * user_data);
+    // Restarts the audio at its first sample
+    // Returns 0 on success
+    typedef int (*whisper_pcm_rewind_callback)(void * user_data);
+
+    // Same as whisper_full_with_state(), but the audio is read in blocks from a reader instead of being passed in memory.
+    // A first pass over the audio finds the maximum of the log mel spectrogram, which normalizes all its frames.
+    // In the second pass the spectrogram is computed as the windows need it and only the frames from the current window
+    // on are kept, such that the memory does not grow with the length of the audio. The results are the same as the ones
+    // of whisper_full_with_state() on all the samples.
+    // params.vad, params.speed_up and params.token_timestamps need all the samples and are not supported.
+    // Returns 0 on success
+    WHISPER_API int whisper_full_from_reader_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+             whisper_pcm_read_callback   read,
+           whisper_pcm_rewind_callback   rewind,
+                                  void * user_data);
+
     // Split the input audio in chunks and process each chunk separately using whisper_full()
     // It seems this approach can offer some speedup in some cases.
     // However, the transcription accuracy can be worse at the beginning and end of each chunk.
@@ -264,30 +450,88 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    WHISPER_API int whisper_full_parallel_with_state(
+                struct whisper_context * ctx,
+                  struct whisper_state * state,
+            struct whisper_full_params   params,
+                           const float * samples,
+                                   int   n_samples,
+                                   int   n_processors);
+
     // Number of generated text segments.
     // A segment can be a few words, a sentence, or even a paragraph.
-    WHISPER_API int whisper_full_n_segments(struct whisper_context * ctx);
+    WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
+    WHISPER_API int whisper_full_n_segments_from_state(struct whisper_state * state);
 
     // Get the start and end time of the specified segment.
-    WHISPER_API int64_t whisper_full_get_segment_t0(struct whisper_context * ctx, int i_segment);
-    WHISPER_API int64_t whisper_full_get_segment_t1(struct whisper_context * ctx, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t0           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t0_from_state(struct whisper_state * state, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t1           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int64_t whisper_full_get_segment_t1_from_state(struct whisper_state * state, int i_segment);
 
     // Get the text of the specified segment.
-    WHISPER_API const char * whisper_full_get_segment_text(struct whisper_context * ctx, int i_segment);
+    WHISPER_API const char * whisper_full_get_segment_text           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API const char * whisper_full_get_segment_text_from_state(struct whisper_state * state, int i_segment);
 
     // Get number of tokens in the specified segment.
-    WHISPER_API int whisper_full_n_tokens(struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_n_tokens           (struct whisper_context * ctx, int i_segment);
+    WHISPER_API int whisper_full_n_tokens_from_state(struct whisper_state * state, int i_segment);
 
     // Get the token text of the specified token in the specified segment.
-    WHISPER_API const char * whisper_full_get_token_text(struct whisper_context * ctx, int i_segment, int i_token);
-    WHISPER_API whisper_token whisper_full_get_token_id (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API const char * whisper_full_get_token_text           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API const char * whisper_full_get_token_text_from_state(struct whisper_context * ctx, struct whisper_state * state, int i_segment, int i_token);
+    WHISPER_API whisper_token whisper_full_get_token_id            (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token whisper_full_get_token_id_from_state (struct whisper_state * state, int i_segment, int i_token);
 
     // Get token data for the specified token in the specified segment.
     // This contains probabilities, timestamps, etc.
-    WHISPER_API whisper_token_data whisper_full_get_token_data(struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token_data whisper_full_get_token_data           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API whisper_token_data whisper_full_get_token_data_from_state(struct whisper_state * state, int i_segment, int i_token);
 
     // Get the probability of the specified token in the specified segment.
-    WHISPER_API float whisper_full_get_token_p(struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API float whisper_full_get_token_p           (struct whisper_context * ctx, int i_segment, int i_token);
+    WHISPER_API float whisper_full_get_token_p_from_state(struct whisper_state * state, int i_segment, int i_token);
+
+    // Streaming transcription of audio that arrives in chunks, e.g. live audio.
+    // The audio is transcribed every step_ms over a sliding window of at most length_ms. The segments of the
+    // current window are tentative: they are replaced when the next step is transcribed. Once the window is full,
+    // its segments are committed and the next window starts with the last keep_ms of audio. Unless params.no_context
+    // is set, the tokens of the committed segments are passed as prompt to the next windows.
+    // The stream uses its own state, which is reused for every window.
+    // The log mel spectrogram of the audio is computed once, as the audio arrives, and normalized with the maximum seen so
+    // far; with params.vad, params.speed_up or params.token_timestamps it is computed from the samples of every window.
+    // Unless params.audio_ctx is set, the encoder is sized to length_ms. The encoder output is not reused from one step
+    // to the next: the attention spans the whole window, so every step encodes the window again.
+    // params is copied, params.language must remain valid while the stream is used. The offset and duration are ignored.
+    // Returns NULL on failure
+    WHISPER_API struct whisper_stream * whisper_stream_init(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+                                   int   step_ms,
+                                   int   length_ms,
+                                   int   keep_ms);
+
+    WHISPER_API void whisper_stream_free(struct whisper_stream * stream);
+
+    // Append PCM samples (16 kHz mono, float) and transcribe every complete step
+    // Returns 0 on success
+    WHISPER_API int whisper_stream_push(
+                struct whisper_stream * stream,
+                          const float * samples,
+                                  int   n_samples);
+
+    // Transcribe the remaining audio and commit all segments
+    // Returns 0 on success
+    WHISPER_API int whisper_stream_finish(struct whisper_stream * stream);
+
+    // Segments of the stream: the first whisper_stream_n_committed() are committed, the others are tentative
+    // The timestamps are relative to the start of the stream
+    WHISPER_API int whisper_stream_n_segments (struct whisper_stream * stream);
+    WHISPER_API int whisper_stream_n_committed(struct whisper_stream * stream);
+
+    WHISPER_API int64_t      whisper_stream_get_segment_t0  (struct whisper_stream * stream, int i_segment);
+    WHISPER_API int64_t      whisper_stream_get_segment_t1  (struct whisper_stream * stream, int i_segment);
+    WHISPER_API const char * whisper_stream_get_segment_text(struct whisper_stream * stream, int i_segment);
 
 #ifdef __cplusplus
 }